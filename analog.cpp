@@ -1,6 +1,8 @@
 #include "analog.h"
 #include "io.h"
 #include "util.h"
+#include "flash.h"
+#include <bit>
 
 constexpr uint8_t ADC_CHANNELS = 10;
 constexpr uint8_t ADC_OVERSAMPLE = 80;
@@ -8,10 +10,27 @@ constexpr float VDDA = 3.3f;
 constexpr float OVERSAMPLE = static_cast<float>(ADC_OVERSAMPLE);
 constexpr float R_TOP = 5600.0f;
 constexpr float R_BOTTOM = 10000.0f;
+static_assert(VDDA * (R_TOP + R_BOTTOM) / R_BOTTOM * 1000.0f < ANALOG_FULL_SCALE_MV + 1.0f);
+
+// data channel (analog 0..5, NTC 0..3) each ADC channel feeds
+constexpr std::array<uint8_t, ADC_CHANNELS> ADC_DATA_CHANNEL = {4, 1, 2, 0, 5, 3, 6, 7, 8, 9};
 
 static adcsample_t adcBuffer[ADC_CHANNELS * ADC_OVERSAMPLE];
+static_assert(ADC_CAPTURE_CAPACITY == ADC_CHANNELS * ADC_OVERSAMPLE && ADC_CAPTURE_CHANNELS == ADC_CHANNELS);
+
+// pending burst, set by requestAdcCapture, taken by the analog thread
+static adcCaptureSink captureSink = nullptr;
+static uint16_t captureMask;
+static uint16_t captureSamples;
+static uint32_t captureContext;
 
 static chibios_rt::BinarySemaphore adcDoneSemaphore(/* taken =*/true);
+static EVENTSOURCE_DECL(analogEvent);
+
+event_source_t &getAnalogEvent()
+{
+    return analogEvent;
+}
 
 static void adcDoneCallback(ADCDriver *)
 {
@@ -30,6 +49,30 @@ static constexpr ADCConversionGroup adcgrpcfg = {
     .smpr = ADC_SMPR_SMP_239P5,
     .chselr = ADC_CHSELR_CHSEL0 | ADC_CHSELR_CHSEL1 | ADC_CHSELR_CHSEL2 | ADC_CHSELR_CHSEL3 | ADC_CHSELR_CHSEL4 | ADC_CHSELR_CHSEL5 | ADC_CHSELR_CHSEL6 | ADC_CHSELR_CHSEL7 | ADC_CHSELR_CHSEL8 | ADC_CHSELR_CHSEL9};
 
+bool requestAdcCapture(uint16_t mask, uint16_t samples, uint32_t context, adcCaptureSink sink)
+{
+    const size_t channels = static_cast<size_t>(std::popcount(mask));
+
+    // the driver takes a sequence depth of 1 or an even one, anything else
+    // trips its debug check and halts
+    if (sink == nullptr || channels == 0U || (mask >> ADC_CHANNELS) != 0U || samples == 0U ||
+        (samples > 1U && (samples & 1U) != 0U) || channels * samples > ADC_CAPTURE_CAPACITY)
+    {
+        return false;
+    }
+    chSysLock();
+    const bool idle = captureSink == nullptr;
+    if (idle)
+    {
+        captureMask = mask;
+        captureSamples = samples;
+        captureContext = context;
+        captureSink = sink;
+    }
+    chSysUnlock();
+    return idle;
+}
+
 static float AverageSamples(adcsample_t *buffer, size_t idx)
 {
     uint32_t sum = 0;
@@ -93,6 +136,65 @@ static void AnalogSampleFinish()
             g_inputs.setAnalogTempInputValue(ch - 6, getOutputValue(value_mV, ch, true));
         }
     }
+    g_inputs.markAnalogSampled();
+    chEvtBroadcast(&analogEvent);
+}
+
+/* Runs a pending burst between two averaging cycles, the inputs keep their
+   last values (and sample time) until the next cycle */
+static void AnalogCapture()
+{
+    chSysLock();
+    const adcCaptureSink sink = captureSink;
+    const uint16_t mask = captureMask;
+    const uint16_t samples = captureSamples;
+    const uint32_t context = captureContext;
+    chSysUnlock();
+
+    if (sink == nullptr)
+    {
+        return;
+    }
+
+    adcCapture capture = {};
+    ADCConversionGroup grp = adcgrpcfg;
+    std::array<uint8_t, ADC_CHANNELS> scanIndex = {};
+    uint8_t slot = 0;
+
+    // a scan runs in ADC channel order, the slots count in data channel order
+    grp.num_channels = 0;
+    grp.chselr = 0;
+    for (size_t ch = 0; ch < ADC_CHANNELS; ch++)
+    {
+        if (mask & (1U << ADC_DATA_CHANNEL[ch]))
+        {
+            scanIndex[ADC_DATA_CHANNEL[ch]] = static_cast<uint8_t>(grp.num_channels++);
+            grp.chselr |= 1U << ch;
+        }
+    }
+    for (size_t data = 0; data < ADC_CHANNELS; data++)
+    {
+        if (mask & (1U << data))
+        {
+            capture.scanPos[slot++] = scanIndex[data];
+        }
+    }
+
+    const systime_t start = chVTGetSystemTimeX();
+    adcStartConversion(&ADCD1, &grp, adcBuffer, samples);
+    adcDoneSemaphore.wait(TIME_INFINITE);
+
+    capture.mask = mask;
+    capture.samples = samples;
+    capture.channels = static_cast<uint8_t>(grp.num_channels);
+    capture.durationUs = TIME_I2US(chTimeDiffX(start, chVTGetSystemTimeX()));
+    capture.context = context;
+    capture.raw = std::span<const adcsample_t>(adcBuffer, static_cast<size_t>(grp.num_channels) * samples);
+    sink(capture);
+
+    chSysLock();
+    captureSink = nullptr;
+    chSysUnlock();
 }
 
 static THD_WORKING_AREA(waAnalogThread, 1024);
@@ -106,7 +208,10 @@ static void AnalogThread(void *arg)
     while (true)
     {
         AnalogSampleFinish();
+        AnalogCapture();
         adcStartConversion(&ADCD1, &adcgrpcfg, adcBuffer, ADC_OVERSAMPLE);
+        // the DMA samples through a flash erase, the averaging would stall
+        getFlashEngine().slot();
     }
 }
 
@@ -1,5 +1,38 @@
 #pragma once
 #include "hal.h"
 #include "ch.hpp"
+#include <array>
+#include <span>
+#include <cstdint>
 
-void startAnalogSampling();
\ No newline at end of file
+// the averaging buffer, shared with raw captures
+constexpr size_t ADC_CAPTURE_CAPACITY = 800;
+constexpr size_t ADC_CAPTURE_CHANNELS = 10;
+
+/* Raw samples of one burst, in the order the ADC scanned them */
+struct adcCapture
+{
+    uint16_t mask;        // bit n = data channel n (analog 0..5, NTC 0..3)
+    uint16_t samples;     // per channel
+    uint8_t channels;
+    uint32_t durationUs;  // whole burst, sample period = duration / (samples * channels)
+    uint32_t context;     // handed through from the request
+    std::span<const adcsample_t> raw;
+    std::array<uint8_t, ADC_CAPTURE_CHANNELS> scanPos; // n-th selected data channel -> place in a scan
+
+    // sample of the n-th selected channel, counting in data channel order
+    adcsample_t value(size_t sample, size_t slot) const { return raw[sample * channels + scanPos[slot]]; };
+};
+
+using adcCaptureSink = void (*)(const adcCapture &capture);
+
+void startAnalogSampling();
+// broadcast after every ADC cycle, once the new values are in the inputs
+event_source_t &getAnalogEvent();
+/* Instead of the next averaging cycle the ADC converts only the selected
+   channels, samples times each at the full rate, into the averaging
+   buffer. The sink runs on the analog thread and must be done with the
+   samples when it returns, averaging resumes after it. False if the
+   request does not fit, samples is odd and above 1, or a capture is
+   already pending. */
+bool requestAdcCapture(uint16_t mask, uint16_t samples, uint32_t context, adcCaptureSink sink);
\ No newline at end of file
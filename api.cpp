@@ -1,139 +1,95 @@
 #include "api.h"
 #include "config.h"
 #include "usbcfg.h"
+#include "can_stats.h"
+#include "usb_response.h"
+#include "usb_stream.h"
+#include "analog.h"
+#include <algorithm>
 
-api::api()
+void api::sendData(std::optional<frameTag> frame)
 {
-    m_outVolts.fill(0);
-    m_outVals.fill(0);
-    m_avCals.fill(0);
-    m_avCalsVolt.fill(0);
-    m_ntcCals.fill(0);
-    m_ntcCalsTemp.fill(0);
-    m_calsBuffer.fill(0);
-    m_factors.fill(0);
-    m_pullups.fill(0);
-    m_outVals[0] = static_cast<uint8_t>(apiresponse::dataResponse);
-    m_outVolts[0] = static_cast<uint8_t>(apiresponse::voltsResponse);
-    m_avCals[0] = static_cast<uint8_t>(apiresponse::avCalsResponse);
-    m_avCalsVolt[0] = static_cast<uint8_t>(apiresponse::avCalsVoltResponse);
-    m_ntcCals[0] = static_cast<uint8_t>(apiresponse::ntcCalsResponse);
-    m_ntcCalsTemp[0] = static_cast<uint8_t>(apiresponse::ntcCalsTempResponse);
-    m_factors[0] = static_cast<uint8_t>(apiresponse::factorResponse);
-    m_pullups[0] = static_cast<uint8_t>(apiresponse::pullupResponse);
-}
-
-void api::getData()
-{
-    inputs &g_inputs = getInputs();
+    const inputs &g_inputs = getInputs();
+    usbResponse resp(&SDU1, frame);
 
-    for (size_t i = 1; i < m_outVals.size(); i += 2)
+    // 0x11 packet with the raw values, then the 0x22 packet with the millivolts
+    resp.u8(static_cast<uint8_t>(apiresponse::dataResponse));
+    for (size_t ch = 0; ch < DATA_CHANNELS; ch++)
     {
-        const size_t ch = (i - 1) / 2;
-
-        uint16_t raw, mv;
-
-        if (ch < 6) {
-            raw = g_inputs.getAnalogInputValue(ch);
-            mv  = g_inputs.getAnalogVolt(ch);
-        } else {
-            const size_t t = ch - 6;   // 0..3
-            raw = g_inputs.getAnalogTempInputValue(t);
-            mv  = g_inputs.getAnalogTempVolt(t);
-        }
-
-        m_outVals[i]     = raw & 0xFF;
-        m_outVals[i + 1] = raw >> 8;
-
-        m_outVolts[i]     = mv & 0xFF;
-        m_outVolts[i + 1] = mv >> 8;
+        resp.u16(ch < 6 ? g_inputs.getAnalogInputValue(ch) : g_inputs.getAnalogTempInputValue(ch - 6));
     }
+    resp.u8(static_cast<uint8_t>(apiresponse::voltsResponse));
+    for (size_t ch = 0; ch < DATA_CHANNELS; ch++)
+    {
+        resp.u16(ch < 6 ? g_inputs.getAnalogVolt(ch) : g_inputs.getAnalogTempVolt(ch - 6));
+    }
+    resp.send();
 }
 
-void api::getCals()
+void api::encodeCals(std::span<uint8_t, CAL_IMAGE_SIZE> image)
 {
     const config &g_config = getConfig();
-    for (size_t i = 1; i < m_avCals.size(); i += 4)
-    {
-        const analogCal &cal = g_config.getAnalogConfig(i / 4);
-        m_avCals[i] = cal.lowCal & 0xFF;
-        m_avCals[i + 1] = cal.lowCal >> 8;
-        m_avCals[i + 2] = cal.highCal & 0xFF;
-        m_avCals[i + 3] = cal.highCal >> 8;
-    }
-    for (size_t i = 1; i < m_avCalsVolt.size(); i += 4)
+
+    image[AV_CALS_BASE] = static_cast<uint8_t>(apiresponse::avCalsResponse);
+    image[AV_VOLTS_BASE] = static_cast<uint8_t>(apiresponse::avCalsVoltResponse);
+    image[NTC_R_BASE] = static_cast<uint8_t>(apiresponse::ntcCalsResponse);
+    image[NTC_T_BASE] = static_cast<uint8_t>(apiresponse::ntcCalsTempResponse);
+    image[FACTORS_BASE] = static_cast<uint8_t>(apiresponse::factorResponse);
+    image[PULLUPS_BASE] = static_cast<uint8_t>(apiresponse::pullupResponse);
+
+    for (size_t i = 1; i < AV_VOLTS_BASE; i += 4)
     {
         const analogCal &cal = g_config.getAnalogConfig(i / 4);
-        m_avCalsVolt[i] = cal.lowV & 0xFF;
-        m_avCalsVolt[i + 1] = cal.lowV >> 8;
-        m_avCalsVolt[i + 2] = cal.highV & 0xFF;
-        m_avCalsVolt[i + 3] = cal.highV >> 8;
+        image[AV_CALS_BASE + i] = cal.lowCal & 0xFF;
+        image[AV_CALS_BASE + i + 1] = cal.lowCal >> 8;
+        image[AV_CALS_BASE + i + 2] = cal.highCal & 0xFF;
+        image[AV_CALS_BASE + i + 3] = cal.highCal >> 8;
+        image[AV_VOLTS_BASE + i] = cal.lowV & 0xFF;
+        image[AV_VOLTS_BASE + i + 1] = cal.lowV >> 8;
+        image[AV_VOLTS_BASE + i + 2] = cal.highV & 0xFF;
+        image[AV_VOLTS_BASE + i + 3] = cal.highV >> 8;
     }
-    for (size_t i = 1; i < m_ntcCals.size(); i += 12)
+    for (size_t i = 1; i < NTC_T_BASE - NTC_R_BASE; i += 12)
     {
         const ntcCal &cal = g_config.getNtcConfig(i / 12);
-        m_ntcCals[i] = cal.r1 & 0xFF;
-        m_ntcCals[i + 1] = (cal.r1 >> 8) & 0xFF;
-        m_ntcCals[i + 2] = (cal.r1 >> 16) & 0xFF;
-        m_ntcCals[i + 3] = (cal.r1 >> 24) & 0xFF;
-        m_ntcCals[i + 4] = cal.r2 & 0xFF;
-        m_ntcCals[i + 5] = (cal.r2 >> 8) & 0xFF;
-        m_ntcCals[i + 6] = (cal.r2 >> 16) & 0xFF;
-        m_ntcCals[i + 7] = (cal.r2 >> 24) & 0xFF;
-        m_ntcCals[i + 8] = cal.r3 & 0xFF;
-        m_ntcCals[i + 9] = (cal.r3 >> 8) & 0xFF;
-        m_ntcCals[i + 10] = (cal.r3 >> 16) & 0xFF;
-        m_ntcCals[i + 11] = (cal.r3 >> 24) & 0xFF;
-    }
-    for (size_t i = 1; i < m_ntcCalsTemp.size(); i += 6)
+        const uint32_t r[] = {cal.r1, cal.r2, cal.r3};
+        for (size_t k = 0; k < 3; k++)
+        {
+            image[NTC_R_BASE + i + k * 4] = r[k] & 0xFF;
+            image[NTC_R_BASE + i + k * 4 + 1] = (r[k] >> 8) & 0xFF;
+            image[NTC_R_BASE + i + k * 4 + 2] = (r[k] >> 16) & 0xFF;
+            image[NTC_R_BASE + i + k * 4 + 3] = (r[k] >> 24) & 0xFF;
+        }
+    }
+    for (size_t i = 1; i < FACTORS_BASE - NTC_T_BASE; i += 6)
     {
         const ntcCal &cal = g_config.getNtcConfig(i / 6);
-        uint16_t t1 = static_cast<uint16_t>(cal.t1);
-        m_ntcCalsTemp[i] = t1 & 0xFF;
-        m_ntcCalsTemp[i + 1] = t1 >> 8;
-        uint16_t t2 = static_cast<uint16_t>(cal.t2);
-        m_ntcCalsTemp[i + 2] = t2 & 0xFF;
-        m_ntcCalsTemp[i + 3] = t2 >> 8;
-        uint16_t t3 = static_cast<uint16_t>(cal.t3);
-        m_ntcCalsTemp[i + 4] = t3 & 0xFF;
-        m_ntcCalsTemp[i + 5] = t3 >> 8;
-    }
-    for (size_t i = 1; i < m_factors.size(); i++)
+        const uint16_t t[] = {static_cast<uint16_t>(cal.t1), static_cast<uint16_t>(cal.t2), static_cast<uint16_t>(cal.t3)};
+        for (size_t k = 0; k < 3; k++)
+        {
+            image[NTC_T_BASE + i + k * 2] = t[k] & 0xFF;
+            image[NTC_T_BASE + i + k * 2 + 1] = t[k] >> 8;
+        }
+    }
+    for (size_t i = 1; i < PULLUPS_BASE - FACTORS_BASE; i++)
     {
         const analogCal &cal = g_config.getAnalogConfig(i - 1);
-        m_factors[i] = static_cast<uint8_t>(cal.factor);
+        image[FACTORS_BASE + i] = static_cast<uint8_t>(cal.factor);
     }
-    for (size_t i = 1; i < m_pullups.size(); i++)
+    for (size_t i = 1; i < CAL_IMAGE_SIZE - PULLUPS_BASE; i++)
     {
         const pullupVolt pu = g_config.getDigitalPullup(i - 1);
-        m_pullups[i] = static_cast<uint8_t>(pu);
+        image[PULLUPS_BASE + i] = static_cast<uint8_t>(pu);
     }
-
-}
-
-void api::sendData()
-{
-    chnWrite(&SDU1, m_outVals.data(), m_outVals.size());
-    chnWrite(&SDU1, m_outVolts.data(), m_outVolts.size());
-}
-
-void api::sendCals()
-{
-    chnWrite(&SDU1, m_avCals.data(), m_avCals.size());
-    chnWrite(&SDU1, m_avCalsVolt.data(), m_avCalsVolt.size());
-    chnWrite(&SDU1, m_ntcCals.data(), m_ntcCals.size());
-    chnWrite(&SDU1, m_ntcCalsTemp.data(), m_ntcCalsTemp.size());
-    chnWrite(&SDU1, m_factors.data(), m_factors.size());
-    chnWrite(&SDU1, m_pullups.data(), m_pullups.size());
 }
 
-void api::writeCals()
+apistatus api::applyCals(std::span<const uint8_t, CAL_IMAGE_SIZE> image, bool save)
 {
     // Helper lambdas to decode little-endian fields safely (avoid signed-overflow UB on shifts)
     auto rd_u16 = [&](size_t off) -> uint16_t
     {
-        return static_cast<uint16_t>(static_cast<uint16_t>(m_calsBuffer[off]) |
-                                     (static_cast<uint16_t>(m_calsBuffer[off + 1]) << 8));
+        return static_cast<uint16_t>(static_cast<uint16_t>(image[off]) |
+                                     (static_cast<uint16_t>(image[off + 1]) << 8));
     };
     auto rd_i16 = [&](size_t off) -> int16_t
     {
@@ -141,97 +97,423 @@ void api::writeCals()
     };
     auto rd_u32 = [&](size_t off) -> uint32_t
     {
-        return (static_cast<uint32_t>(m_calsBuffer[off]) |
-                (static_cast<uint32_t>(m_calsBuffer[off + 1]) << 8) |
-                (static_cast<uint32_t>(m_calsBuffer[off + 2]) << 16) |
-                (static_cast<uint32_t>(m_calsBuffer[off + 3]) << 24));
+        return (static_cast<uint32_t>(image[off]) |
+                (static_cast<uint32_t>(image[off + 1]) << 8) |
+                (static_cast<uint32_t>(image[off + 2]) << 16) |
+                (static_cast<uint32_t>(image[off + 3]) << 24));
     };
 
-    if (chnRead(&SDU1, m_calsBuffer.data(), m_calsBuffer.size()) != m_calsBuffer.size())
+    if (image[AV_CALS_BASE] != static_cast<uint8_t>(apiresponse::avCalsResponse) ||
+        image[AV_VOLTS_BASE] != static_cast<uint8_t>(apiresponse::avCalsVoltResponse) ||
+        image[NTC_R_BASE] != static_cast<uint8_t>(apiresponse::ntcCalsResponse) ||
+        image[NTC_T_BASE] != static_cast<uint8_t>(apiresponse::ntcCalsTempResponse) ||
+        image[FACTORS_BASE] != static_cast<uint8_t>(apiresponse::factorResponse) ||
+        image[PULLUPS_BASE] != static_cast<uint8_t>(apiresponse::pullupResponse))
+    {
+        return apistatus::rejected;
+    }
+
+    config &g_config = getConfig();
+
+    auto edit = [&]()
+    {
+        // --- Analog value calibration (low/high cal) and voltage points (low/high volt) ---
+        for (size_t i = 1; i < AV_VOLTS_BASE; i += 4)
+        {
+            const size_t idx = i / 4;
+            analogCal cal = g_config.getAnalogConfig(idx);
+            cal.lowCal = rd_u16(AV_CALS_BASE + i);
+            cal.highCal = rd_u16(AV_CALS_BASE + i + 2);
+            cal.lowV = rd_u16(AV_VOLTS_BASE + i);
+            cal.highV = rd_u16(AV_VOLTS_BASE + i + 2);
+            g_config.setAnalogConfig(idx, cal);
+        }
+
+        // --- NTC resistances (r1/r2/r3) ---
+        for (size_t i = 1; i < NTC_T_BASE - NTC_R_BASE; i += 12)
+        {
+            const size_t idx = i / 12;
+            ntcCal cal = g_config.getNtcConfig(idx);
+            cal.r1 = rd_u32(NTC_R_BASE + i);
+            cal.r2 = rd_u32(NTC_R_BASE + i + 4);
+            cal.r3 = rd_u32(NTC_R_BASE + i + 8);
+            g_config.setNtcConfig(idx, cal);
+        }
+
+        // --- NTC temperature points (t1/t2/t3) ---
+        for (size_t i = 1; i < FACTORS_BASE - NTC_T_BASE; i += 6)
+        {
+            const size_t idx = i / 6;
+            ntcCal cal = g_config.getNtcConfig(idx);
+            cal.t1 = rd_i16(NTC_T_BASE + i);
+            cal.t2 = rd_i16(NTC_T_BASE + i + 2);
+            cal.t3 = rd_i16(NTC_T_BASE + i + 4);
+            g_config.setNtcConfig(idx, cal);
+        }
+        for (size_t i = 1; i < PULLUPS_BASE - FACTORS_BASE; i++)
+        {
+            const size_t idx = i - 1;
+            analogCal cal = g_config.getAnalogConfig(idx);
+            cal.factor = static_cast<scaling>(image[FACTORS_BASE + i]);
+            g_config.setAnalogConfig(idx, cal);
+        }
+        for (size_t i = 1; i < CAL_IMAGE_SIZE - PULLUPS_BASE; i++)
+        {
+            const size_t idx = i - 1;
+            pullupVolt pu = static_cast<pullupVolt>(image[PULLUPS_BASE + i]);
+            g_config.setDigitalPullup(idx, pu);
+        }
+    };
+
+    if (!save)
+    {
+        g_config.apply(edit);
+        return apistatus::ok;
+    }
+    return g_config.update(edit) ? apistatus::ok : apistatus::saveFailed;
+}
+
+void api::sendCals(std::optional<frameTag> frame)
+{
+    usbResponse resp(&SDU1, frame);
+
+    if (auto image = resp.reserve<CAL_IMAGE_SIZE>())
+    {
+        encodeCals(*image);
+        resp.send();
+    }
+}
+
+apistatus api::writeCals(std::span<const uint8_t> in)
+{
+    if (in.size() != CAL_IMAGE_SIZE)
+    {
+        return apistatus::rejected;
+    }
+    return applyCals(in.first<CAL_IMAGE_SIZE>());
+}
+
+static void encodeCanCfg(std::span<uint8_t, CAN_CFG_PACKET_SIZE> out)
+{
+    const configCan &cfg = getConfig().getCanConfig();
+
+    out[0] = static_cast<uint8_t>(apiresponse::canCfgResponse);
+    out[1] = static_cast<uint8_t>(cfg.getTxMode());
+    out[2] = cfg.getHeartbeatMs() & 0xFF;
+    out[3] = cfg.getHeartbeatMs() >> 8;
+    for (size_t i = 4; i < CAN_CFG_LAYOUT; i += 4)
+    {
+        const canDeadband &db = cfg.getDeadband((i - 4) / 4);
+        out[i] = db.absolute & 0xFF;
+        out[i + 1] = db.absolute >> 8;
+        out[i + 2] = db.relative & 0xFF;
+        out[i + 3] = db.relative >> 8;
+    }
+    out[CAN_CFG_LAYOUT] = static_cast<uint8_t>(cfg.getLayout());
+    out[CAN_CFG_TRIGGER] = static_cast<uint8_t>(cfg.getTrigger());
+    out[CAN_CFG_SYNC_ID] = cfg.getSyncId() & 0xFF;
+    out[CAN_CFG_SYNC_ID + 1] = cfg.getSyncId() >> 8;
+    out[CAN_CFG_NODE_ID] = cfg.getNodeId();
+    out[CAN_CFG_SLOT] = cfg.getSlotUs() & 0xFF;
+    out[CAN_CFG_SLOT + 1] = cfg.getSlotUs() >> 8;
+    out[CAN_CFG_PROTOCOL] = static_cast<uint8_t>(cfg.getProtocol());
+    out[CAN_CFG_J1939_ADDRESS] = cfg.getJ1939Address();
+    out[CAN_CFG_J1939_PGN_BASE] = cfg.getJ1939PgnBase();
+    out[CAN_CFG_DIAG_ID] = cfg.getDiagId() & 0xFF;
+    out[CAN_CFG_DIAG_ID + 1] = cfg.getDiagId() >> 8;
+    out[CAN_CFG_DIAG_PERIOD] = cfg.getDiagPeriodMs() & 0xFF;
+    out[CAN_CFG_DIAG_PERIOD + 1] = cfg.getDiagPeriodMs() >> 8;
+    out[CAN_CFG_BUS_MONITOR] = cfg.getBusMonitor() ? 1U : 0U;
+    out[CAN_CFG_ADAPTIVE] = cfg.getAdaptive() ? 1U : 0U;
+    out[CAN_CFG_LOAD_HIGH] = cfg.getLoadHigh() & 0xFF;
+    out[CAN_CFG_LOAD_HIGH + 1] = cfg.getLoadHigh() >> 8;
+    out[CAN_CFG_LOAD_LOW] = cfg.getLoadLow() & 0xFF;
+    out[CAN_CFG_LOAD_LOW + 1] = cfg.getLoadLow() >> 8;
+    out[CAN_CFG_MAX_STRETCH] = cfg.getMaxStretch();
+    out[CAN_CFG_STRETCH_MASK] = cfg.getStretchMask();
+    out[CAN_CFG_QUERY_ID] = cfg.getQueryId() & 0xFF;
+    out[CAN_CFG_QUERY_ID + 1] = cfg.getQueryId() >> 8;
+    out[CAN_CFG_RESPONSE_ID] = cfg.getResponseId() & 0xFF;
+    out[CAN_CFG_RESPONSE_ID + 1] = cfg.getResponseId() >> 8;
+    out[CAN_CFG_ISOTP_RX_ID] = cfg.getIsotpRxId() & 0xFF;
+    out[CAN_CFG_ISOTP_RX_ID + 1] = cfg.getIsotpRxId() >> 8;
+    out[CAN_CFG_ISOTP_TX_ID] = cfg.getIsotpTxId() & 0xFF;
+    out[CAN_CFG_ISOTP_TX_ID + 1] = cfg.getIsotpTxId() >> 8;
+    out[CAN_CFG_ISOTP_BS] = cfg.getIsotpBlockSize();
+    out[CAN_CFG_ISOTP_STMIN] = cfg.getIsotpStMin();
+    out[CAN_CFG_AUTO_ADDRESS] = cfg.getAutoAddress() ? 1U : 0U;
+    out[CAN_CFG_ID_STRIDE] = cfg.getIdStride() & 0xFF;
+    out[CAN_CFG_ID_STRIDE + 1] = cfg.getIdStride() >> 8;
+    out[CAN_CFG_TIME_SYNC_ID] = cfg.getTimeSyncId() & 0xFF;
+    out[CAN_CFG_TIME_SYNC_ID + 1] = cfg.getTimeSyncId() >> 8;
+    for (size_t i = CAN_CFG_VOLT_DEADBANDS; i < CAN_CFG_PACKET_SIZE; i += 2)
+    {
+        const uint16_t mv = cfg.getVoltDeadband((i - CAN_CFG_VOLT_DEADBANDS) / 2).absolute;
+        out[i] = mv & 0xFF;
+        out[i + 1] = mv >> 8;
+    }
+}
+
+void api::sendCanCfg(std::optional<frameTag> frame)
+{
+    usbResponse resp(&SDU1, frame);
+
+    if (auto out = resp.reserve<CAN_CFG_PACKET_SIZE>())
     {
-        return;
+        encodeCanCfg(*out);
+        resp.send();
     }
+}
 
-    if (m_calsBuffer[0] != static_cast<uint8_t>(apiresponse::avCalsResponse) ||
-        m_calsBuffer[25] != static_cast<uint8_t>(apiresponse::avCalsVoltResponse) ||
-        m_calsBuffer[50] != static_cast<uint8_t>(apiresponse::ntcCalsResponse) ||
-        m_calsBuffer[99] != static_cast<uint8_t>(apiresponse::ntcCalsTempResponse) ||
-        m_calsBuffer[124] != static_cast<uint8_t>(apiresponse::factorResponse) ||
-        m_calsBuffer[131] != static_cast<uint8_t>(apiresponse::pullupResponse))
+apistatus api::writeCanCfg(std::span<const uint8_t> in)
+{
+    auto rd_u16 = [&](size_t off) -> uint16_t
     {
-        return;
+        return static_cast<uint16_t>(static_cast<uint16_t>(in[off]) |
+                                     (static_cast<uint16_t>(in[off + 1]) << 8));
+    };
+
+    // Same layout as the 0x99 response, id byte included
+    if (in.size() != CAN_CFG_PACKET_SIZE || in[0] != static_cast<uint8_t>(apiresponse::canCfgResponse))
+    {
+        return apistatus::rejected;
     }
 
     config &g_config = getConfig();
+    auto edit = [&]()
+    {
+        configCan cfg = g_config.getCanConfig();
 
-    // Layout in m_calsBuffer:
-    //  0..24   : AV cals        (id + 6*(lowCal,highCal))
-    // 25..49   : AV volts       (id + 6*(lowV,highV))
-    // 50..98   : NTC resistances(id + 4*(r1,r2,r3))
-    // 99..123  : NTC temps      (id + 4*(t1,t2,t3))
-    // 124..130 : Scaling factors(id + factor)
-    // 131..135 : Digital pullups(id + pullup)
+        cfg.setTxMode(in[1] <= static_cast<uint8_t>(canTxMode::polled) ? static_cast<canTxMode>(in[1]) : canTxMode::periodic);
+        cfg.setHeartbeatMs(rd_u16(2));
+        for (size_t i = 4; i < CAN_CFG_LAYOUT; i += 4)
+        {
+            canDeadband &db = cfg.writeDeadband((i - 4) / 4);
+            db.absolute = rd_u16(i);
+            db.relative = rd_u16(i + 2);
+        }
+        cfg.setLayout(in[CAN_CFG_LAYOUT] <= static_cast<uint8_t>(canLayoutMode::custom) ? static_cast<canLayoutMode>(in[CAN_CFG_LAYOUT]) : canLayoutMode::legacy);
+        cfg.setTrigger(in[CAN_CFG_TRIGGER] == static_cast<uint8_t>(canTrigger::sync) ? canTrigger::sync : canTrigger::freeRunning);
+        cfg.setSyncId(rd_u16(CAN_CFG_SYNC_ID) & 0x7FF);
+        cfg.setNodeId(in[CAN_CFG_NODE_ID]);
+        cfg.setSlotUs(rd_u16(CAN_CFG_SLOT));
+        cfg.setProtocol(in[CAN_CFG_PROTOCOL] == static_cast<uint8_t>(canProtocol::j1939) ? canProtocol::j1939 : canProtocol::raw11);
+        cfg.setJ1939Address(in[CAN_CFG_J1939_ADDRESS]);
+        cfg.setJ1939PgnBase(in[CAN_CFG_J1939_PGN_BASE]);
+        cfg.setDiagId(rd_u16(CAN_CFG_DIAG_ID) & 0x7FF);
+        cfg.setDiagPeriodMs(rd_u16(CAN_CFG_DIAG_PERIOD));
+        cfg.setBusMonitor(in[CAN_CFG_BUS_MONITOR] != 0U);
+        cfg.setAdaptive(in[CAN_CFG_ADAPTIVE] != 0U);
+        cfg.setLoadHigh(rd_u16(CAN_CFG_LOAD_HIGH));
+        cfg.setLoadLow(rd_u16(CAN_CFG_LOAD_LOW));
+        cfg.setMaxStretch(in[CAN_CFG_MAX_STRETCH] != 0U ? in[CAN_CFG_MAX_STRETCH] : 1U);
+        cfg.setStretchMask(in[CAN_CFG_STRETCH_MASK]);
+        cfg.setQueryId(rd_u16(CAN_CFG_QUERY_ID) & 0x7FF);
+        cfg.setResponseId(rd_u16(CAN_CFG_RESPONSE_ID) & 0x7FF);
+        cfg.setIsotpRxId(rd_u16(CAN_CFG_ISOTP_RX_ID) & 0x7FF);
+        cfg.setIsotpTxId(rd_u16(CAN_CFG_ISOTP_TX_ID) & 0x7FF);
+        cfg.setIsotpBlockSize(in[CAN_CFG_ISOTP_BS]);
+        cfg.setIsotpStMin(in[CAN_CFG_ISOTP_STMIN]);
+        cfg.setAutoAddress(in[CAN_CFG_AUTO_ADDRESS] != 0U);
+        cfg.setIdStride(rd_u16(CAN_CFG_ID_STRIDE) & 0x7FF);
+        cfg.setTimeSyncId(rd_u16(CAN_CFG_TIME_SYNC_ID) & 0x7FF);
+        for (size_t i = CAN_CFG_VOLT_DEADBANDS; i < CAN_CFG_PACKET_SIZE; i += 2)
+        {
+            cfg.setVoltDeadband((i - CAN_CFG_VOLT_DEADBANDS) / 2, rd_u16(i));
+        }
+
+        g_config.setCanConfig(cfg);
+    };
+    return g_config.update(edit) ? apistatus::ok : apistatus::saveFailed;
+}
 
-    // --- Analog value calibration (low/high cal) ---
-    for (size_t i = 1; i < m_avCals.size(); i += 4)
+static void encodeCanMap(std::span<uint8_t, CAN_MAP_PACKET_SIZE> out)
+{
+    const configCan &cfg = getConfig().getCanConfig();
+
+    out[0] = static_cast<uint8_t>(apiresponse::canMapResponse);
+    for (size_t f = 0; f < CAN_MAP_FRAMES; f++)
+    {
+        out[1 + f * 2] = cfg.getMapId(f) & 0xFF;
+        out[2 + f * 2] = cfg.getMapId(f) >> 8;
+    }
+    for (size_t i = 0; i < CAN_MAP_ENTRIES; i++)
     {
-        const size_t idx = i / 4;
-        analogCal cal = g_config.getAnalogConfig(idx);
-        cal.lowCal = rd_u16(i);
-        cal.highCal = rd_u16(i + 2);
-        g_config.setAnalogConfig(idx, cal);
+        const canField &field = cfg.getMapField(i);
+        uint8_t *entry = &out[CAN_MAP_FIELDS_BASE + i * 5];
+        entry[0] = field.frame;
+        entry[1] = field.bitOffset;
+        entry[2] = field.bitLength;
+        entry[3] = static_cast<uint8_t>(field.signal);
+        entry[4] = field.shift;
     }
+}
+
+void api::sendCanMap(std::optional<frameTag> frame)
+{
+    usbResponse resp(&SDU1, frame);
 
-    // --- Analog voltage points (low/high volt) ---
-    constexpr size_t AV_VOLTS_BASE = 25;
-    for (size_t i = 1; i < m_avCalsVolt.size(); i += 4)
+    if (auto out = resp.reserve<CAN_MAP_PACKET_SIZE>())
     {
-        const size_t idx = i / 4;
-        analogCal cal = g_config.getAnalogConfig(idx);
-        cal.lowV = rd_u16(AV_VOLTS_BASE + i);
-        cal.highV = rd_u16(AV_VOLTS_BASE + i + 2);
-        g_config.setAnalogConfig(idx, cal);
+        encodeCanMap(*out);
+        resp.send();
     }
+}
 
-    // --- NTC resistances (r1/r2/r3) ---
-    constexpr size_t NTC_R_BASE = 50;
-    for (size_t i = 1; i < m_ntcCals.size(); i += 12)
+apistatus api::writeCanMap(std::span<const uint8_t> in)
+{
+    if (in.size() != CAN_MAP_PACKET_SIZE || in[0] != static_cast<uint8_t>(apiresponse::canMapResponse))
     {
-        const size_t idx = i / 12;
-        ntcCal cal = g_config.getNtcConfig(idx);
-        cal.r1 = rd_u32(NTC_R_BASE + i);
-        cal.r2 = rd_u32(NTC_R_BASE + i + 4);
-        cal.r3 = rd_u32(NTC_R_BASE + i + 8);
-        g_config.setNtcConfig(idx, cal);
+        return apistatus::rejected;
     }
 
-    // --- NTC temperature points (t1/t2/t3) ---
-    constexpr size_t NTC_T_BASE = 99;
-    for (size_t i = 1; i < m_ntcCalsTemp.size(); i += 6)
+    std::array<canField, CAN_MAP_ENTRIES> fields;
+    for (size_t i = 0; i < CAN_MAP_ENTRIES; i++)
     {
-        const size_t idx = i / 6;
-        ntcCal cal = g_config.getNtcConfig(idx);
-        cal.t1 = rd_i16(NTC_T_BASE + i);
-        cal.t2 = rd_i16(NTC_T_BASE + i + 2);
-        cal.t3 = rd_i16(NTC_T_BASE + i + 4);
-        g_config.setNtcConfig(idx, cal);
+        const uint8_t *entry = &in[CAN_MAP_FIELDS_BASE + i * 5];
+        fields[i] = {entry[0], entry[1], entry[2], static_cast<canSignal>(entry[3]), entry[4]};
+        if (fields[i].bitLength == 0U)
+        {
+            fields[i] = {};
+        }
     }
-    constexpr size_t FACTORS_BASE = 124;
-    for (size_t i = 1; i < m_factors.size(); i++)
+    // overlapping fields would OR their values into each other
+    if (!mapValid(fields))
     {
-        const size_t idx = i - 1;
-        analogCal cal = g_config.getAnalogConfig(idx);
-        cal.factor = static_cast<scaling>(m_calsBuffer[FACTORS_BASE + i]);
-        g_config.setAnalogConfig(idx, cal);
+        return apistatus::rejected;
     }
 
-    constexpr size_t PULLUPS_BASE = 131;
-    for (size_t i = 1; i < m_pullups.size(); i++)
+    config &g_config = getConfig();
+    auto edit = [&]()
     {
-        const size_t idx = i - 1;
-        pullupVolt pu = static_cast<pullupVolt>(m_calsBuffer[PULLUPS_BASE + i]);
-        g_config.setDigitalPullup(idx, pu);
+        configCan cfg = g_config.getCanConfig();
+
+        for (size_t f = 0; f < CAN_MAP_FRAMES; f++)
+        {
+            cfg.setMapId(f, static_cast<uint16_t>(in[1 + f * 2] | (in[2 + f * 2] << 8)) & 0x7FF);
+        }
+        for (size_t i = 0; i < CAN_MAP_ENTRIES; i++)
+        {
+            cfg.writeMapField(i) = fields[i];
+        }
+
+        g_config.setCanConfig(cfg);
+    };
+    return g_config.update(edit) ? apistatus::ok : apistatus::saveFailed;
+}
+
+void api::sendCanStats(std::optional<frameTag> frame)
+{
+    const canStatsSnapshot stats = getCanStats().snapshot();
+    usbResponse resp(&SDU1, frame);
+
+    resp.u8(static_cast<uint8_t>(apiresponse::canStatsResponse));
+    resp.u32(stats.txFrames);
+    resp.u32(stats.txDropped);
+    resp.u32(stats.rxFrames);
+    resp.u32(stats.rxOverruns);
+    resp.u32(stats.busOff);
+    resp.u32(stats.errorPassive);
+    resp.u32(stats.errorWarning);
+    resp.u8(stats.tec);
+    resp.u8(stats.rec);
+    resp.u8(stats.lastErrorCode);
+    resp.u16(stats.busLoad);
+    resp.u16(stats.peakBusLoad);
+    resp.u32(stats.backoffStretches);
+    resp.u32(stats.backoffRecoveries);
+    resp.u32(stats.throttledFrames);
+    resp.u8(stats.backoffFactor);
+    resp.send();
+}
+
+apistatus api::startStream(std::span<const uint8_t> in, bool framed)
+{
+    // channel mask (bit n = signal n of the CAN signal list), ADC cycle divider,
+    // batch flush timeout ms, delta key interval; a frame may leave out the
+    // trailing fields, they count as 0
+    if (in.size() != STREAM_REQUEST_SIZE && in.size() != STREAM_REQUEST_SIZE - 2 && in.size() != STREAM_REQUEST_SIZE - 4)
+    {
+        return apistatus::rejected;
+    }
+    auto rd_u16 = [&](size_t off) -> uint16_t
+    {
+        return (off + 1 < in.size()) ? static_cast<uint16_t>(in[off] | (in[off + 1] << 8)) : 0U;
+    };
+    const uint32_t mask = in[0] | (in[1] << 8) | (in[2] << 16) | (static_cast<uint32_t>(in[3]) << 24);
+    getUsbStream().start(mask, rd_u16(4), rd_u16(6), rd_u16(8), framed);
+    return apistatus::ok;
+}
+
+apistatus api::stopStream()
+{
+    getUsbStream().stop();
+    return apistatus::ok;
+}
+
+/* Capture readout on the stream port, from the analog thread: the 0x15
+   header, then 0x16 packets of whole sample rows (the selected channels in
+   data channel order) filling one USB buffer each */
+static void sendCapture(const adcCapture &capture)
+{
+    const bool framed = capture.context != 0U;
+    const sysinterval_t timeout = TIME_MS2I(CAPTURE_WRITE_TIMEOUT_MS);
+    uint8_t sequence = 0;
+
+    auto tag = [&](apiresponse id) -> std::optional<frameTag>
+    {
+        if (!framed)
+        {
+            return std::nullopt;
+        }
+        return frameTag{static_cast<uint8_t>(id), sequence++};
+    };
+
+    {
+        usbResponse resp(&SDU2, tag(apiresponse::captureResponse), timeout);
+        resp.u8(static_cast<uint8_t>(apiresponse::captureResponse));
+        resp.u16(capture.mask);
+        resp.u16(capture.samples);
+        resp.u32(capture.durationUs);
+        if (resp.send() == 0U)
+        {
+            return;
+        }
+    }
+
+    const size_t rowBytes = capture.channels * sizeof(uint16_t);
+    const size_t rows = std::min<size_t>(255, (SERIAL_USB_BUFFERS_SIZE - FRAME_OVERHEAD - CAPTURE_DATA_HEADER) / rowBytes);
+    for (size_t first = 0; first < capture.samples; first += rows)
+    {
+        const size_t n = std::min<size_t>(rows, capture.samples - first);
+        usbResponse resp(&SDU2, tag(apiresponse::captureDataResponse), timeout);
+
+        resp.u8(static_cast<uint8_t>(apiresponse::captureDataResponse));
+        resp.u16(static_cast<uint16_t>(first));
+        resp.u8(static_cast<uint8_t>(n));
+        for (size_t sample = first; sample < first + n; sample++)
+        {
+            for (size_t slot = 0; slot < capture.channels; slot++)
+            {
+                resp.u16(capture.value(sample, slot));
+            }
+        }
+        // host stopped reading, the rest is dropped
+        if (resp.send() == 0U)
+        {
+            return;
+        }
     }
+}
 
-    g_config.save();
-}
\ No newline at end of file
+apistatus api::startCapture(std::span<const uint8_t> in, bool framed)
+{
+    // channel mask (bit n = data channel n: analog 0..5, NTC 0..3), samples per channel
+    if (in.size() != CAPTURE_REQUEST_SIZE)
+    {
+        return apistatus::rejected;
+    }
+    const uint16_t mask = static_cast<uint16_t>(in[0] | (in[1] << 8));
+    const uint16_t samples = static_cast<uint16_t>(in[2] | (in[3] << 8));
+    return requestAdcCapture(mask, samples, framed ? 1U : 0U, sendCapture) ? apistatus::ok : apistatus::rejected;
+}
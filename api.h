@@ -2,44 +2,310 @@
 #include "ch.h"
 #include "hal.h"
 #include <array>
+#include <span>
+#include <algorithm>
+#include <optional>
+#include <string_view>
 #include "io.h"
+#include "can_layout.h"
+#include "usb_frame.h"
 
 enum class apicommand : uint8_t
 {
     getData = 0xAA,
     getCals = 0xBB,
-    writeCals = 0xCC
+    writeCals = 0xCC,
+    getCanCfg = 0xBD,
+    writeCanCfg = 0xCD,
+    getCanMap = 0xBE,
+    writeCanMap = 0xCE,
+    getCanStats = 0xBF,
+    startStream = 0xAD,
+    stopStream = 0xAE,
+    getSchema = 0xA0,
+    getFields = 0xA1,
+    slcanMode = 0xAF,
+    captureBurst = 0xB0
 };
 
 enum class apiresponse : uint8_t
 {
     dataResponse = 0x11,
     voltsResponse = 0x22,
+    streamResponse = 0x12,
+    streamBatchResponse = 0x13,
+    streamDeltaResponse = 0x14,
+    captureResponse = 0x15,
+    captureDataResponse = 0x16,
     avCalsResponse = 0x33,
     avCalsVoltResponse = 0x44,
     ntcCalsResponse = 0x55,
     ntcCalsTempResponse = 0x66,
     factorResponse = 0x77,
     pullupResponse = 0x88,
+    canCfgResponse = 0x99,
+    canMapResponse = 0x9A,
+    canStatsResponse = 0x9B,
+    schemaResponse = 0x9C,
+    fieldResponse = 0x9D,
 };
 
+// payload of the reply to a framed request that returns no data of its own,
+// and of the NACK for a request that never ran
+enum class apistatus : uint8_t
+{
+    ok = 0x00,             // ACK
+    rejected = 0x01,       // the handler refused the packet contents
+    unknownCommand = 0x02,
+    badLength = 0x03,
+    timeout = 0x04,        // the request did not arrive in full in time
+    badCrc = 0x05,
+    saveFailed = 0x06      // applied in RAM, but the flash store did not take it
+};
+
+// 0x33, 0x44, 0x55, 0x66, 0x77 and 0x88 packets back to back
+constexpr size_t CAL_IMAGE_SIZE = 25 + 25 + 49 + 25 + 7 + 5;
+// analog 0..5 then NTC 0..3 in the 0x11 and 0x22 packets
+constexpr size_t DATA_CHANNELS = 10;
+// id + tx mode + heartbeat + 10*(absolute, relative) deadbands + layout
+// + trigger + sync id + node id + slot width + protocol + J1939 address + PGN base
+// + diag id + diag period + bus monitor + adaptive, load high/low, max stretch, stretch mask
+// + query id + response id + ISO-TP rx id, tx id, block size, STmin + auto address + id stride
+// + time sync id + 10 absolute voltage deadbands
+constexpr size_t CAN_CFG_PACKET_SIZE = 1 + 1 + 2 + 10 * 4 + 1 + 1 + 2 + 1 + 2 + 3 + 2 + 2 + 1 + 1 + 2 + 2 + 1 + 1 + 2 + 2 + 2 + 2 + 1 + 1 + 1 + 2 + 2 + 10 * 2;
+// id + frame ids + (frame, bit offset, bit length, signal, shift) entries
+constexpr size_t CAN_MAP_PACKET_SIZE = 1 + CAN_MAP_FRAMES * 2 + CAN_MAP_ENTRIES * 5;
+// id + 7 counters + TEC, REC, last error + load, peak load + 3 backoff counters + backoff factor
+constexpr size_t CAN_STATS_PACKET_SIZE = 1 + 7 * 4 + 3 + 2 * 2 + 3 * 4 + 1;
+// channel mask + ADC cycle divider + batch flush timeout + delta key interval
+constexpr size_t STREAM_REQUEST_SIZE = 4 + 2 + 2 + 2;
+// channel mask + samples per channel
+constexpr size_t CAPTURE_REQUEST_SIZE = 2 + 2;
+// 0x16 packet: id, first sample, sample rows
+constexpr size_t CAPTURE_DATA_HEADER = 1 + 2 + 1;
+// a stalled host costs the capture, not the analog loop
+constexpr uint32_t CAPTURE_WRITE_TIMEOUT_MS = 100;
+
+// Layout of the calibration image, the six 0x33..0x88 packets back to back:
+//  0..24   : AV cals        (id + 6*(lowCal,highCal))
+// 25..49   : AV volts       (id + 6*(lowV,highV))
+// 50..98   : NTC resistances(id + 4*(r1,r2,r3))
+// 99..123  : NTC temps      (id + 4*(t1,t2,t3))
+// 124..130 : Scaling factors(id + factor)
+// 131..135 : Digital pullups(id + pullup)
+constexpr size_t AV_CALS_BASE = 0;
+constexpr size_t AV_VOLTS_BASE = 25;
+constexpr size_t NTC_R_BASE = 50;
+constexpr size_t NTC_T_BASE = 99;
+constexpr size_t FACTORS_BASE = 124;
+constexpr size_t PULLUPS_BASE = 131;
+
+// offsets in the 0x99 packet, deadbands from 4 on
+constexpr size_t CAN_CFG_LAYOUT = 44;
+constexpr size_t CAN_CFG_TRIGGER = 45;
+constexpr size_t CAN_CFG_SYNC_ID = 46;
+constexpr size_t CAN_CFG_NODE_ID = 48;
+constexpr size_t CAN_CFG_SLOT = 49;
+constexpr size_t CAN_CFG_PROTOCOL = 51;
+constexpr size_t CAN_CFG_J1939_ADDRESS = 52;
+constexpr size_t CAN_CFG_J1939_PGN_BASE = 53;
+constexpr size_t CAN_CFG_DIAG_ID = 54;
+constexpr size_t CAN_CFG_DIAG_PERIOD = 56;
+constexpr size_t CAN_CFG_BUS_MONITOR = 58;
+constexpr size_t CAN_CFG_ADAPTIVE = 59;
+constexpr size_t CAN_CFG_LOAD_HIGH = 60;
+constexpr size_t CAN_CFG_LOAD_LOW = 62;
+constexpr size_t CAN_CFG_MAX_STRETCH = 64;
+constexpr size_t CAN_CFG_STRETCH_MASK = 65;
+constexpr size_t CAN_CFG_QUERY_ID = 66;
+constexpr size_t CAN_CFG_RESPONSE_ID = 68;
+constexpr size_t CAN_CFG_ISOTP_RX_ID = 70;
+constexpr size_t CAN_CFG_ISOTP_TX_ID = 72;
+constexpr size_t CAN_CFG_ISOTP_BS = 74;
+constexpr size_t CAN_CFG_ISOTP_STMIN = 75;
+constexpr size_t CAN_CFG_AUTO_ADDRESS = 76;
+constexpr size_t CAN_CFG_ID_STRIDE = 77;
+constexpr size_t CAN_CFG_TIME_SYNC_ID = 79;
+constexpr size_t CAN_CFG_VOLT_DEADBANDS = 81;
+
+// first entry in the 0x9A packet
+constexpr size_t CAN_MAP_FIELDS_BASE = 1 + CAN_MAP_FRAMES * 2;
+
+enum class fieldType : uint8_t
+{
+    u8 = 0,
+    u16,
+    i16,
+    u32
+};
+
+constexpr size_t fieldTypeSize(fieldType type)
+{
+    return (type == fieldType::u8) ? 1U : (type == fieldType::u32) ? 4U : 2U;
+}
+
+constexpr size_t USB_FIELD_NAME = 16;
+// 0x9D packet: id, opcode, index, field count, type, offset, count, stride, name
+constexpr size_t FIELD_PACKET_SIZE = 8 + USB_FIELD_NAME;
+
+/* One field of a reply packet for host parsers (getFields): count values
+   of type, little-endian, the first at offset and each stride bytes after
+   the one before. Write requests that echo a reply use the same layout. */
+struct usbField
+{
+    const char *name;
+    fieldType type;
+    uint8_t offset;
+    uint8_t count;
+    uint8_t stride;
+};
+
+// every byte of a size byte packet belongs to exactly one field
+template <size_t N>
+constexpr bool fieldsCover(const std::array<usbField, N> &fields, size_t size)
+{
+    std::array<uint8_t, 256> owners = {};
+
+    for (const usbField &f : fields)
+    {
+        if (std::string_view(f.name).size() > USB_FIELD_NAME || f.count == 0U)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < f.count; i++)
+        {
+            for (size_t b = 0; b < fieldTypeSize(f.type); b++)
+            {
+                const size_t at = f.offset + i * f.stride + b;
+                if (at >= size || owners[at]++ != 0U)
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return std::all_of(owners.begin(), owners.begin() + size, [](uint8_t n) { return n == 1U; });
+}
+
+// 0x11 packet, then the 0x22 packet
+constexpr size_t DATA_REPLY_SIZE = 2 * (1 + DATA_CHANNELS * 2);
+inline constexpr auto dataFields = std::to_array<usbField>({
+    {"id", fieldType::u8, 0, 1, 1},
+    {"value", fieldType::u16, 1, DATA_CHANNELS, 2},
+    {"voltsId", fieldType::u8, 1 + DATA_CHANNELS * 2, 1, 1},
+    {"mV", fieldType::u16, 2 + DATA_CHANNELS * 2, DATA_CHANNELS, 2},
+});
+static_assert(fieldsCover(dataFields, DATA_REPLY_SIZE));
+
+inline constexpr auto calFields = std::to_array<usbField>({
+    {"avCalsId", fieldType::u8, AV_CALS_BASE, 1, 1},
+    {"lowCal", fieldType::u16, AV_CALS_BASE + 1, 6, 4},
+    {"highCal", fieldType::u16, AV_CALS_BASE + 3, 6, 4},
+    {"avVoltsId", fieldType::u8, AV_VOLTS_BASE, 1, 1},
+    {"lowV", fieldType::u16, AV_VOLTS_BASE + 1, 6, 4},
+    {"highV", fieldType::u16, AV_VOLTS_BASE + 3, 6, 4},
+    {"ntcRId", fieldType::u8, NTC_R_BASE, 1, 1},
+    {"r1", fieldType::u32, NTC_R_BASE + 1, 4, 12},
+    {"r2", fieldType::u32, NTC_R_BASE + 5, 4, 12},
+    {"r3", fieldType::u32, NTC_R_BASE + 9, 4, 12},
+    {"ntcTId", fieldType::u8, NTC_T_BASE, 1, 1},
+    {"t1", fieldType::i16, NTC_T_BASE + 1, 4, 6},
+    {"t2", fieldType::i16, NTC_T_BASE + 3, 4, 6},
+    {"t3", fieldType::i16, NTC_T_BASE + 5, 4, 6},
+    {"factorId", fieldType::u8, FACTORS_BASE, 1, 1},
+    {"factor", fieldType::u8, FACTORS_BASE + 1, 6, 1},
+    {"pullupId", fieldType::u8, PULLUPS_BASE, 1, 1},
+    {"pullup", fieldType::u8, PULLUPS_BASE + 1, 4, 1},
+});
+static_assert(fieldsCover(calFields, CAL_IMAGE_SIZE));
+
+inline constexpr auto canCfgFields = std::to_array<usbField>({
+    {"id", fieldType::u8, 0, 1, 1},
+    {"txMode", fieldType::u8, 1, 1, 1},
+    {"heartbeatMs", fieldType::u16, 2, 1, 2},
+    {"deadbandAbs", fieldType::u16, 4, 10, 4},
+    {"deadbandRel", fieldType::u16, 6, 10, 4},
+    {"layout", fieldType::u8, CAN_CFG_LAYOUT, 1, 1},
+    {"trigger", fieldType::u8, CAN_CFG_TRIGGER, 1, 1},
+    {"syncId", fieldType::u16, CAN_CFG_SYNC_ID, 1, 2},
+    {"nodeId", fieldType::u8, CAN_CFG_NODE_ID, 1, 1},
+    {"slotUs", fieldType::u16, CAN_CFG_SLOT, 1, 2},
+    {"protocol", fieldType::u8, CAN_CFG_PROTOCOL, 1, 1},
+    {"j1939Address", fieldType::u8, CAN_CFG_J1939_ADDRESS, 1, 1},
+    {"j1939PgnBase", fieldType::u8, CAN_CFG_J1939_PGN_BASE, 1, 1},
+    {"diagId", fieldType::u16, CAN_CFG_DIAG_ID, 1, 2},
+    {"diagPeriodMs", fieldType::u16, CAN_CFG_DIAG_PERIOD, 1, 2},
+    {"busMonitor", fieldType::u8, CAN_CFG_BUS_MONITOR, 1, 1},
+    {"adaptive", fieldType::u8, CAN_CFG_ADAPTIVE, 1, 1},
+    {"loadHigh", fieldType::u16, CAN_CFG_LOAD_HIGH, 1, 2},
+    {"loadLow", fieldType::u16, CAN_CFG_LOAD_LOW, 1, 2},
+    {"maxStretch", fieldType::u8, CAN_CFG_MAX_STRETCH, 1, 1},
+    {"stretchMask", fieldType::u8, CAN_CFG_STRETCH_MASK, 1, 1},
+    {"queryId", fieldType::u16, CAN_CFG_QUERY_ID, 1, 2},
+    {"responseId", fieldType::u16, CAN_CFG_RESPONSE_ID, 1, 2},
+    {"isotpRxId", fieldType::u16, CAN_CFG_ISOTP_RX_ID, 1, 2},
+    {"isotpTxId", fieldType::u16, CAN_CFG_ISOTP_TX_ID, 1, 2},
+    {"isotpBlockSize", fieldType::u8, CAN_CFG_ISOTP_BS, 1, 1},
+    {"isotpStMin", fieldType::u8, CAN_CFG_ISOTP_STMIN, 1, 1},
+    {"autoAddress", fieldType::u8, CAN_CFG_AUTO_ADDRESS, 1, 1},
+    {"idStride", fieldType::u16, CAN_CFG_ID_STRIDE, 1, 2},
+    {"timeSyncId", fieldType::u16, CAN_CFG_TIME_SYNC_ID, 1, 2},
+    {"voltDeadbandAbs", fieldType::u16, CAN_CFG_VOLT_DEADBANDS, 10, 2},
+});
+static_assert(fieldsCover(canCfgFields, CAN_CFG_PACKET_SIZE));
+
+inline constexpr auto canMapFields = std::to_array<usbField>({
+    {"id", fieldType::u8, 0, 1, 1},
+    {"frameId", fieldType::u16, 1, CAN_MAP_FRAMES, 2},
+    {"frame", fieldType::u8, CAN_MAP_FIELDS_BASE, CAN_MAP_ENTRIES, 5},
+    {"bitOffset", fieldType::u8, CAN_MAP_FIELDS_BASE + 1, CAN_MAP_ENTRIES, 5},
+    {"bitLength", fieldType::u8, CAN_MAP_FIELDS_BASE + 2, CAN_MAP_ENTRIES, 5},
+    {"signal", fieldType::u8, CAN_MAP_FIELDS_BASE + 3, CAN_MAP_ENTRIES, 5},
+    {"shift", fieldType::u8, CAN_MAP_FIELDS_BASE + 4, CAN_MAP_ENTRIES, 5},
+});
+static_assert(fieldsCover(canMapFields, CAN_MAP_PACKET_SIZE));
+
+// in the order sendCanStats writes them
+inline constexpr auto canStatsFields = std::to_array<usbField>({
+    {"id", fieldType::u8, 0, 1, 1},
+    {"txFrames", fieldType::u32, 1, 1, 4},
+    {"txDropped", fieldType::u32, 5, 1, 4},
+    {"rxFrames", fieldType::u32, 9, 1, 4},
+    {"rxOverruns", fieldType::u32, 13, 1, 4},
+    {"busOff", fieldType::u32, 17, 1, 4},
+    {"errorPassive", fieldType::u32, 21, 1, 4},
+    {"errorWarning", fieldType::u32, 25, 1, 4},
+    {"tec", fieldType::u8, 29, 1, 1},
+    {"rec", fieldType::u8, 30, 1, 1},
+    {"lastErrorCode", fieldType::u8, 31, 1, 1},
+    {"busLoad", fieldType::u16, 32, 1, 2},
+    {"peakBusLoad", fieldType::u16, 34, 1, 2},
+    {"backoffStretches", fieldType::u32, 36, 1, 4},
+    {"backoffRecovery", fieldType::u32, 40, 1, 4},
+    {"throttledFrames", fieldType::u32, 44, 1, 4},
+    {"backoffFactor", fieldType::u8, 48, 1, 1},
+});
+static_assert(fieldsCover(canStatsFields, CAN_STATS_PACKET_SIZE));
+
+/* Responses are encoded straight into the USB output queue (usbResponse),
+   framed when the request came in a frame. The USB thread collects the
+   packets the host writes and hands them over whole. */
 class api
 {
-private:
-    std::array<uint8_t, 21> m_outVolts;
-    std::array<uint8_t, 21> m_outVals;
-    std::array<uint8_t, 25> m_avCals;
-    std::array<uint8_t, 25> m_avCalsVolt;
-    std::array<uint8_t, 49> m_ntcCals;
-    std::array<uint8_t, 25> m_ntcCalsTemp;
-    std::array<uint8_t, 7> m_factors;
-    std::array<uint8_t, 5> m_pullups;
-    std::array<uint8_t, 25 + 25 + 49 + 25 + 7 + 5> m_calsBuffer;
 public:
-    api();
-    void getData();
-    void getCals();
-    void sendData();
-    void sendCals();
-    void writeCals();
+    void sendData(std::optional<frameTag> frame);
+    void sendCals(std::optional<frameTag> frame);
+    apistatus writeCals(std::span<const uint8_t> in);
+    void sendCanCfg(std::optional<frameTag> frame);
+    apistatus writeCanCfg(std::span<const uint8_t> in);
+    void sendCanMap(std::optional<frameTag> frame);
+    apistatus writeCanMap(std::span<const uint8_t> in);
+    void sendCanStats(std::optional<frameTag> frame);
+    apistatus startStream(std::span<const uint8_t> in, bool framed);
+    apistatus stopStream();
+    apistatus startCapture(std::span<const uint8_t> in, bool framed);
+    // shared with the ISO-TP channel, which carries the same image over CAN
+    static void encodeCals(std::span<uint8_t, CAL_IMAGE_SIZE> image);
+    // save = false only changes the config in RAM, the caller saves it later
+    static apistatus applyCals(std::span<const uint8_t, CAL_IMAGE_SIZE> image, bool save = true);
 };
\ No newline at end of file
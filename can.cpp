@@ -1,112 +1,731 @@
 #include "can.h"
 #include "io.h"
+#include "config.h"
+#include "can_delta.h"
+#include "can_layout.h"
+#include "j1939.h"
+#include "can_stats.h"
+#include "can_backoff.h"
+#include "isotp.h"
+#include "api.h"
+#include "can_address.h"
+#include "can_time.h"
+#include "gs_usb.h"
+#include "slcan.h"
 #include <bitset>
 #include <algorithm>
 
+static_assert(legacyIds.size() <= CAN_MAP_FRAMES && packedIds.size() <= CAN_MAP_FRAMES);
+static_assert(ISOTP_MAX_PAYLOAD >= 1 + CAL_IMAGE_SIZE);
+
+constexpr eventmask_t CAN_SYNC_EVENT = EVENT_MASK(0);
+constexpr eventmask_t CAN_REQUEST_EVENT = EVENT_MASK(1);
+constexpr eventmask_t CAN_RX_EVENT = EVENT_MASK(1);    // RX thread
+constexpr eventmask_t CAN_ERROR_EVENT = EVENT_MASK(2); // RX thread
+constexpr eventmask_t CAN_SAVED_EVENT = EVENT_MASK(3); // RX thread
+constexpr eventmask_t CAN_SAVE_EVENT = EVENT_MASK(0);  // save thread
+constexpr uint32_t CAN_TX_PERIOD_MS = 20;
+constexpr uint32_t CAN_SYNC_TIMEOUT_MS = 500; // free-run slowly when the SYNC master is gone
+constexpr size_t CAN_OUTPUT_FILTER = 0;       // FMI of the output command filter bank
+constexpr uint16_t CAN_OUTPUT_ID = 0xAB;
+constexpr size_t CAN_OUTPUT_BACKOFF_SLOT = 7; // stretch mask bit of the output command frame
+constexpr uint8_t CAN_QUERY_FRAME = 0x80;     // query byte 0 flag: poll a whole data frame
+constexpr size_t CAN_QUERY_MAX_SIGNALS = 2;
+constexpr size_t CAN_QUERY_QUEUE = 4;          // replies waiting for the TX thread
+constexpr uint32_t CAN_QUERY_TX_TIMEOUT_MS = 10; // for a mailbox, several frame times at any bitrate
+constexpr uint32_t CAN_INIT_TIMEOUT_MS = 10; // the frame on the bus finishes first
+
+static thread_t *canTxThread = nullptr;
+static thread_t *canRxThread = nullptr;
+static thread_t *canSaveThread = nullptr;
+static canRxRing<> rxRing;
+static busClock timeSync; // owned by the RX thread
+static canSnapshot syncSnapshot;
+static systime_t syncTime;
+static uint16_t syncRxId = 0xFFFF;  // SYNC id the RX interrupt latches the inputs on, set once at start
+static canSnapshot syncLatch;       // inputs at the last SYNC, read in the RX interrupt
+static systime_t syncLatchSampled;  // and their analog sample time
+static uint8_t requestedFrames; // bit n = data frame n was polled, owned by the TX thread
+static std::array<CANTxFrame, CAN_QUERY_QUEUE> queryReplies; // built by the RX thread, sent by the TX thread
+static size_t queryReplyCount;
+static j1939Node j1939;
+static isotpLink isotp; // owned by the RX thread
+static bool calSavePending; // owned by the RX thread, the ISO-TP reply waits for the save
+static bool calSaved;       // result of the last save, set before CAN_SAVED_EVENT
+// each CAN thread works on its own copy, the USB thread may replace the config at any time
+static configCan rxCanCfg;
+static configCan txCanCfg;
+static canAddress nodeAddress;
+static uint32_t acceptAllBank; // last filter bank, takes every frame while active
+static eventflags_t canErrorFlags; // gathered by canErrorCallback, taken by the RX thread
+static bool acceptAllPinned;   // bus monitor, adaptive backoff or USB adapter, always active
+
+msg_t canSend(const CANTxFrame &frame, sysinterval_t timeout)
+{
+    const msg_t result = canTransmit(&CAND1, CAN_ANY_MAILBOX, &frame, timeout);
+    getCanStats().recordTx(frame, result);
+    return result;
+}
+
+/* A filter bank may be switched on and off while the bus runs, only its
+   registers need the filters stopped */
+void canAcceptAll(bool on)
+{
+    if (acceptAllPinned)
+    {
+        return;
+    }
+    chSysLock();
+    if (on)
+    {
+        CAND1.can->FA1R |= 1U << acceptAllBank;
+    }
+    else
+    {
+        CAND1.can->FA1R &= ~(1U << acceptAllBank);
+    }
+    chSysUnlock();
+}
+
+/* SILM is only writable in initialization mode, which the bxCAN enters once
+   the bus is idle. Frames waiting in the mailboxes cannot go out while
+   silent, they are aborted both ways so none of them is sent late */
+bool canSilent(bool on)
+{
+    CAN_TypeDef *can = CAND1.can;
+    bool halted = false;
+
+    can->MCR |= CAN_MCR_INRQ;
+    for (uint32_t ms = 0; ms < CAN_INIT_TIMEOUT_MS && !halted; ms++)
+    {
+        chThdSleepMilliseconds(1);
+        halted = (can->MSR & CAN_MSR_INAK) != 0U;
+    }
+    if (halted)
+    {
+        can->TSR = CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2;
+        can->BTR = on ? (can->BTR | CAN_BTR_SILM) : (can->BTR & ~CAN_BTR_SILM);
+    }
+    // back on the bus after 11 recessive bits
+    can->MCR &= ~CAN_MCR_INRQ;
+    return halted;
+}
+
+/* Reading of the inputs with the analog sample time in bus time */
+static canSnapshot takeSnapshot(const inputs &g_inputs)
+{
+    canSnapshot snap = readSnapshot(g_inputs);
+    stampSnapshot(snap, timeSync.toBusTime(g_inputs.getAnalogSampleTime()));
+    return snap;
+}
+
+/* RX FIFO interrupt: stamp and queue whatever the FIFO holds. Frames that
+   arrived together share the stamp of the interrupt, which is taken once
+   per FIFO non-empty event; only a frame drained alone is marked exact.
+   A SYNC latches the inputs right here. */
+static void canRxFullCallback(CANDriver *canp, uint32_t flags)
+{
+    (void)flags;
+    const uint32_t stamp = chVTGetSystemTimeX();
+    CANRxFrame frame;
+    CANRxFrame next;
+
+    chSysLockFromISR();
+    // one frame of look-ahead tells whether the first one was alone
+    bool more = !canTryReceiveI(canp, CAN_ANY_MAILBOX, &frame);
+    bool first = true;
+    while (more)
+    {
+        const bool following = !canTryReceiveI(canp, CAN_ANY_MAILBOX, &next);
+
+        if (frame.IDE == CAN_IDE_STD && frame.SID == syncRxId)
+        {
+            const inputs &g_inputs = getInputs();
+            syncLatch = readSnapshot(g_inputs);
+            syncLatchSampled = g_inputs.getAnalogSampleTime();
+        }
+        rxRing.pushI(frame, stamp, first && !following);
+#if USE_GS_USB
+        getGsUsb().canRxI(frame, stamp);
+#endif
+        getSlcan().canRxI(frame, stamp);
+
+        frame = next;
+        more = following;
+        first = false;
+    }
+    if (canRxThread != nullptr)
+    {
+        chEvtSignalI(canRxThread, CAN_RX_EVENT);
+    }
+    chSysUnlockFromISR();
+}
+
+/* Status change interrupt: the driver has no error event with callbacks
+   enforced, so the flags are gathered here until the RX thread takes them */
+static void canErrorCallback(CANDriver *canp, uint32_t flags)
+{
+    (void)canp;
+
+    chSysLockFromISR();
+    canErrorFlags |= flags;
+    if (canRxThread != nullptr)
+    {
+        chEvtSignalI(canRxThread, CAN_ERROR_EVENT);
+    }
+    chSysUnlockFromISR();
+}
+
+static canLayout activeLayout(const configCan &cfg)
+{
+    switch (cfg.getLayout())
+    {
+    case canLayoutMode::packed:
+        return packedLayout;
+    case canLayoutMode::custom:
+        return cfg.getCustomLayout();
+    default:
+        return legacyLayout;
+    }
+}
+
+static void handleOutputFrame(const CANRxFrame &rxmsg, inputs &g_inputs)
+{
+    std::bitset<4> outputToggles;
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        if (i == 0)
+        {
+            outputToggles[i] = (rxmsg.data8[0] & (1U << i)) != 0;
+        }
+        else
+        {
+            g_inputs.setOutputDc(i, std::clamp(rxmsg.data8[i], static_cast<uint8_t>(0), static_cast<uint8_t>(100)));
+        }
+    }
+    for (size_t i = 0; i < 4; i++)
+    {
+        g_inputs.toggleOutput(i, outputToggles[i]);
+    }
+}
+
+/* Hand the inputs latched in the RX interrupt to the TX thread, which sends
+   them in this node's slot after the SYNC. Latch and stamp are both taken
+   in the interrupt that received the SYNC. */
+static void handleSyncFrame(systime_t stamp)
+{
+    chSysLock();
+    syncSnapshot = syncLatch;
+    stampSnapshot(syncSnapshot, timeSync.toBusTime(syncLatchSampled));
+    syncTime = stamp;
+    chSysUnlock();
+
+    chEvtSignal(canTxThread, CAN_SYNC_EVENT);
+}
+
+/* Hand a polled data frame to the TX thread, it owns the pack program */
+static void requestFrame(size_t frame)
+{
+    chSysLock();
+    requestedFrames |= static_cast<uint8_t>(1U << frame);
+    chSysUnlock();
+
+    chEvtSignal(canTxThread, CAN_REQUEST_EVENT);
+}
+
+/* Hand a query reply to the TX thread, which sends it ahead of its data
+   frames and waits for a mailbox if all three are taken. A reply that finds
+   the queue full is counted as a dropped TX frame. */
+static void queueQueryReply(const CANTxFrame &txmsg)
+{
+    chSysLock();
+    const bool queued = queryReplyCount < queryReplies.size();
+    if (queued)
+    {
+        queryReplies[queryReplyCount] = txmsg;
+        queryReplyCount++;
+    }
+    chSysUnlock();
+
+    if (queued)
+    {
+        chEvtSignal(canTxThread, CAN_REQUEST_EVENT);
+    }
+    else
+    {
+        getCanStats().recordTx(txmsg, MSG_TIMEOUT);
+    }
+}
+
+/* Query: [0] first signal, [1] count (1..2). Answered with the values read
+   by the RX thread: [0] first signal, [1] count (0 = rejected), [2..3] age
+   of the oldest sample in ms, [4..7] the values. With bit 7 of byte 0 set
+   the low bits select a data frame instead, which the TX thread sends as usual. */
+static void handleQueryFrame(const CANRxFrame &rxmsg, const inputs &g_inputs, const configCan &canCfg)
+{
+    if (rxmsg.DLC < 1)
+    {
+        return;
+    }
+    if (rxmsg.data8[0] & CAN_QUERY_FRAME)
+    {
+        const size_t frame = rxmsg.data8[0] & ~CAN_QUERY_FRAME;
+        if (frame < CAN_MAP_FRAMES)
+        {
+            requestFrame(frame);
+        }
+        return;
+    }
+
+    const size_t first = rxmsg.data8[0];
+    const size_t count = (rxmsg.DLC >= 2 && rxmsg.data8[1] != 0U) ? rxmsg.data8[1] : 1U;
+    CANTxFrame txmsg = {};
+
+    txmsg.IDE = CAN_IDE_STD;
+    txmsg.RTR = CAN_RTR_DATA;
+    txmsg.SID = canCfg.nodeCanId(canCfg.getResponseId());
+    txmsg.DLC = 2;
+    txmsg.data8[0] = static_cast<uint8_t>(first);
+
+    if (count <= CAN_QUERY_MAX_SIGNALS && first + count <= CAN_SIGNAL_COUNT)
+    {
+        const canSnapshot snap = takeSnapshot(g_inputs);
+        const systime_t now = chVTGetSystemTimeX();
+        sysinterval_t age = 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const canSignal sig = static_cast<canSignal>(first + i);
+            age = std::max(age, chTimeDiffX(sampleTime(g_inputs, sig), now));
+            txmsg.data16[2 + i] = snap[first + i];
+        }
+        txmsg.data8[1] = static_cast<uint8_t>(count);
+        txmsg.data16[1] = static_cast<uint16_t>(std::min<uint32_t>(TIME_I2MS(age), 0xFFFFU));
+        txmsg.DLC = static_cast<uint8_t>(4 + count * 2);
+    }
+    queueQueryReply(txmsg);
+}
+
+/* ISO-TP requests carry the USB command byte: getCals is answered with the
+   calibration image, writeCals + image with the command and a status byte */
+static void handleIsotpRequest(systime_t now)
+{
+    const std::span<uint8_t> msg = isotp.buffer();
+    size_t len = 2;
+
+    if (msg[0] == static_cast<uint8_t>(apicommand::getCals) && isotp.length() == 1)
+    {
+        api::encodeCals(msg.subspan<0, CAL_IMAGE_SIZE>());
+        len = CAL_IMAGE_SIZE;
+    }
+    else if (msg[0] == static_cast<uint8_t>(apicommand::writeCals) && isotp.length() == 1 + CAL_IMAGE_SIZE)
+    {
+        // the new calibrations apply at once, the reply goes out once the save thread is done
+        const apistatus status = api::applyCals(msg.subspan<1, CAL_IMAGE_SIZE>(), false);
+        if (status == apistatus::ok)
+        {
+            calSavePending = true;
+            chEvtSignal(canSaveThread, CAN_SAVE_EVENT);
+            return;
+        }
+        msg[1] = static_cast<uint8_t>(status);
+    }
+    else
+    {
+        // negative response, same shape as UDS
+        msg[1] = msg[0];
+        msg[0] = 0x7F;
+    }
+    isotp.transmit(len, now);
+}
+
+/* The save of an ISO-TP calibration write is done, the request still sits
+   in the buffer and gets its status */
+static void finishCalSave(systime_t now)
+{
+    const std::span<uint8_t> msg = isotp.buffer();
+
+    msg[1] = static_cast<uint8_t>(calSaved ? apistatus::ok : apistatus::saveFailed);
+    calSavePending = false;
+    isotp.transmit(2, now);
+}
+
+static void handleJ1939Frame(const CANRxFrame &rxmsg, const configCan &canCfg)
+{
+    const uint32_t pgn = j1939Pgn(rxmsg.EID);
+    const uint8_t dest = j1939Dest(rxmsg.EID);
+
+    if (dest != J1939_GLOBAL_ADDRESS && dest != j1939.address())
+    {
+        return;
+    }
+
+    if (pgn == J1939_PGN_ADDRESS_CLAIMED)
+    {
+        j1939.handleAddressClaim(rxmsg);
+    }
+    else if (pgn == J1939_PGN_REQUEST && rxmsg.DLC >= 3)
+    {
+        const uint32_t requested = rxmsg.data8[0] | (rxmsg.data8[1] << 8) | (static_cast<uint32_t>(rxmsg.data8[2]) << 16);
+        const uint8_t frame = static_cast<uint8_t>((requested & 0xFF) - canCfg.getJ1939PgnBase());
+
+        if (requested == J1939_PGN_ADDRESS_CLAIMED)
+        {
+            j1939.answerClaimRequest();
+        }
+        else if ((requested & 0x3FF00) == J1939_PGN_PROPRIETARY_B && frame < CAN_MAP_FRAMES)
+        {
+            requestFrame(frame);
+        }
+        else if (dest != J1939_GLOBAL_ADDRESS)
+        {
+            // a request addressed to us alone needs an answer, a global one does not
+            j1939.sendNack(requested & 0x3FFFF, j1939Source(rxmsg.EID));
+        }
+    }
+}
+
+/* Periodic health frame: TEC, REC, bus load (0.1 %), TX drops,
+   RX overruns and bus-off count, the counters truncated to their field */
+static void sendDiagFrame(const configCan &canCfg)
+{
+    const canStatsSnapshot stats = getCanStats().snapshot();
+    CANTxFrame txmsg = {};
+
+    txmsg.RTR = CAN_RTR_DATA;
+    txmsg.DLC = 8;
+    txmsg.data8[0] = stats.tec;
+    txmsg.data8[1] = stats.rec;
+    txmsg.data16[1] = stats.busLoad;
+    txmsg.data16[2] = static_cast<uint16_t>(stats.txDropped);
+    txmsg.data8[6] = static_cast<uint8_t>(stats.rxOverruns);
+    txmsg.data8[7] = static_cast<uint8_t>(stats.busOff);
+
+    if (canCfg.getProtocol() == canProtocol::j1939)
+    {
+        const uint8_t source = j1939.onlineAddress();
+        if (source == J1939_NULL_ADDRESS)
+        {
+            return;
+        }
+        // first PGN after the data frames
+        txmsg.IDE = CAN_IDE_EXT;
+        txmsg.EID = j1939Id(J1939_DEFAULT_PRIORITY,
+                            J1939_PGN_PROPRIETARY_B | ((canCfg.getJ1939PgnBase() + CAN_MAP_FRAMES) & 0xFF),
+                            J1939_GLOBAL_ADDRESS, source);
+    }
+    else
+    {
+        txmsg.IDE = CAN_IDE_STD;
+        txmsg.SID = canCfg.nodeCanId(canCfg.getDiagId());
+    }
+    canSend(txmsg, TIME_IMMEDIATE);
+}
+
 static THD_WORKING_AREA(waCanRxThread, 1024);
 static void CanRxThread(void *arg)
 {
     (void)arg;
 
-    std::bitset<4> outputToggles;
-    CANRxFrame rxmsg = {};
-
-    event_listener_t el_can_rx;
-    chEvtRegister(&CAND1.rxfull_event, &el_can_rx, 1);
+    canRxStamped rx = {};
+    const CANRxFrame &rxmsg = rx.frame;
 
+    // received frames come from the ring filled by canRxFullCallback,
+    // error flags from canErrorCallback
     inputs &g_inputs = getInputs();
+    const config &g_config = getConfig();
+    canStatistics &stats = getCanStats();
+    systime_t lastDiag = chVTGetSystemTimeX();
+    const configCan &canCfg = rxCanCfg;
+    uint32_t cfgRevision = g_config.copyCanConfig(rxCanCfg);
+
+    isotp.setup(canCfg.nodeCanId(canCfg.getIsotpTxId()), canCfg.getIsotpBlockSize(), canCfg.getIsotpStMin());
 
     chRegSetThreadName("CAN RX Thread");
 
     while (true)
     {
-        eventmask_t em = chEvtWaitAnyTimeout(EVENT_MASK(1), TIME_MS2I(10));
-        if (em & EVENT_MASK(1))
+        // an ISO-TP transfer in progress may need us before the housekeeping tick
+        const sysinterval_t wait = std::min<sysinterval_t>(TIME_MS2I(10), isotp.idleTime(chVTGetSystemTimeX()));
+        eventmask_t em = chEvtWaitAnyTimeout(CAN_RX_EVENT | CAN_ERROR_EVENT | CAN_SAVED_EVENT, wait);
+        const systime_t now = chVTGetSystemTimeX();
+
+        if (g_config.getCanRevision() != cfgRevision)
+        {
+            cfgRevision = g_config.copyCanConfig(rxCanCfg);
+        }
+
+        if (em & CAN_ERROR_EVENT)
+        {
+            chSysLock();
+            const eventflags_t errors = canErrorFlags;
+            canErrorFlags = 0;
+            chSysUnlock();
+            stats.recordErrors(errors);
+        }
+        if (em & CAN_SAVED_EVENT)
+        {
+            finishCalSave(now);
+        }
+        stats.tick(now);
+        isotp.poll(now);
+        if (canCfg.getDiagPeriodMs() != 0U && chTimeDiffX(lastDiag, now) >= TIME_MS2I(canCfg.getDiagPeriodMs()))
+        {
+            lastDiag = now;
+            sendDiagFrame(canCfg);
+        }
+
+        if (em & CAN_RX_EVENT)
         {
-            while (canReceive(&CAND1, CAN_ANY_MAILBOX, &rxmsg, TIME_IMMEDIATE) == MSG_OK)
+            stats.recordRxOverruns(rxRing.takeDropped());
+            while (rxRing.pop(rx))
             {
-                for (size_t i = 0; i < 4; i++)
+                stats.recordRx(rxmsg);
+
+                if (rxmsg.IDE == CAN_IDE_EXT)
+                {
+                    if (canCfg.getProtocol() == canProtocol::j1939)
+                    {
+                        handleJ1939Frame(rxmsg, canCfg);
+                    }
+                    else if (isAddressClaim(rxmsg.EID))
+                    {
+                        nodeAddress.handleClaim(rxmsg);
+                    }
+                }
+                else if (rxmsg.SID == canCfg.getSyncId())
                 {
-                    if (i == 0)
+                    if (canCfg.getTrigger() == canTrigger::sync)
                     {
-                        outputToggles[i] = (rxmsg.data8[0] & (1U << i)) != 0;
+                        handleSyncFrame(rx.stamp);
                     }
-                    else
+                }
+                else if (canCfg.getTimeSyncId() != 0U && rxmsg.SID == canCfg.getTimeSyncId())
+                {
+                    timeSync.handleTimeFrame(rxmsg, rx.stamp, rx.exact);
+                }
+                else if (rxmsg.SID == canCfg.nodeCanId(canCfg.getIsotpRxId()))
+                {
+                    // one request at a time, the link is ignored until a pending save is answered
+                    if (canCfg.getProtocol() == canProtocol::raw11 && !calSavePending && isotp.receive(rxmsg, now))
+                    {
+                        handleIsotpRequest(now);
+                    }
+                }
+                else if (rxmsg.SID == canCfg.nodeCanId(canCfg.getQueryId()))
+                {
+                    if (canCfg.getProtocol() == canProtocol::raw11)
                     {
-                        g_inputs.setOutputDc(i, std::clamp(rxmsg.data8[i], static_cast<uint8_t>(0), static_cast<uint8_t>(100)));
+                        handleQueryFrame(rxmsg, g_inputs, canCfg);
                     }
                 }
-                for (size_t i = 0; i < 4; i++)
+                else if (rxmsg.FMI == CAN_OUTPUT_FILTER)
                 {
-                    g_inputs.toggleOutput(i, outputToggles[i]);
+                    handleOutputFrame(rxmsg, g_inputs);
                 }
             }
         }
     }
 }
 
+/* Saves calibrations written over ISO-TP. Below the RX thread, so a page
+   erase never keeps it from emptying the RX ring */
+static THD_WORKING_AREA(waCanSaveThread, 1024);
+static void CanSaveThread(void *arg)
+{
+    (void)arg;
+
+    config &g_config = getConfig();
+
+    chRegSetThreadName("CAN Save Thread");
+
+    while (true)
+    {
+        (void)chEvtWaitAny(CAN_SAVE_EVENT);
+        calSaved = g_config.save();
+        chEvtSignal(canRxThread, CAN_SAVED_EVENT);
+    }
+}
+
 static THD_WORKING_AREA(waCanTxThread, 1024);
 static void CanTxThread(void *arg)
 {
     (void)arg;
 
     chRegSetThreadName("CAN TX Thread");
-    CANTxFrame txmsg1 = {};
-    CANTxFrame txmsg2 = {};
-    CANTxFrame txmsg3 = {};
-    CANTxFrame txmsg4 = {};
-    txmsg1.IDE = CAN_IDE_STD;
-    txmsg1.RTR = CAN_RTR_DATA;
-    txmsg1.SID = 0xBA;
-    txmsg1.DLC = 8;
-    txmsg2.IDE = CAN_IDE_STD;
-    txmsg2.RTR = CAN_RTR_DATA;
-    txmsg2.SID = 0xBB;
-    txmsg2.DLC = 8;
-    txmsg3.IDE = CAN_IDE_STD;
-    txmsg3.RTR = CAN_RTR_DATA;
-    txmsg3.SID = 0xBC;
-    txmsg3.DLC = 8;
-    txmsg4.IDE = CAN_IDE_STD;
-    txmsg4.RTR = CAN_RTR_DATA;
-    txmsg4.SID = 0xAB;
-    txmsg4.DLC = 4;
-    txmsg4.data8[0] = 0b00001111;
-    txmsg4.data8[1] = 25U;
-    txmsg4.data8[2] = 50U;
-    txmsg4.data8[3] = 75U;
+    CANTxFrame txmsg = {};
+    CANTxFrame txmsgOut = {};
+    txmsg.RTR = CAN_RTR_DATA;
+    txmsgOut.IDE = CAN_IDE_STD;
+    txmsgOut.RTR = CAN_RTR_DATA;
+    txmsgOut.SID = CAN_OUTPUT_ID;
+    txmsgOut.DLC = 4;
+    txmsgOut.data8[0] = 0b00001111;
+    txmsgOut.data8[1] = 25U;
+    txmsgOut.data8[2] = 50U;
+    txmsgOut.data8[3] = 75U;
 
     inputs &g_inputs = getInputs();
+    const config &g_config = getConfig();
+
+    sendOnDelta delta;
+    std::array<frameHeartbeat, CAN_MAP_FRAMES> heartbeats;
+    frameHeartbeat outHeartbeat;
+    txBackoff backoff;
+    canPackProgram program;
+    const configCan &canCfg = txCanCfg;
+    uint32_t cfgRevision = g_config.copyCanConfig(txCanCfg);
+    systime_t lastCycle = chVTGetSystemTimeX();
+
+    program.compile(activeLayout(canCfg));
+
+    // Packs data frame f and queues it. In J1939 mode the frame id is
+    // replaced by the proprietary B PGN of the frame and our claimed address.
+    auto sendFrame = [&](size_t f, const canSnapshot &snap) -> bool
+    {
+        program.pack(f, snap, txmsg);
+        txmsg.SID = canCfg.nodeCanId(txmsg.SID);
+        txmsg.IDE = CAN_IDE_STD;
+        if (canCfg.getProtocol() == canProtocol::j1939)
+        {
+            const uint8_t source = j1939.onlineAddress();
+            if (source == J1939_NULL_ADDRESS)
+            {
+                return false;
+            }
+            txmsg.IDE = CAN_IDE_EXT;
+            txmsg.EID = j1939Id(J1939_DEFAULT_PRIORITY,
+                                J1939_PGN_PROPRIETARY_B | ((canCfg.getJ1939PgnBase() + f) & 0xFF),
+                                J1939_GLOBAL_ADDRESS, source);
+        }
+        return canSend(txmsg, TIME_IMMEDIATE) == MSG_OK;
+    };
 
     while (true)
     {
-        for (size_t i = 0; i < 4; i++)
+        if (g_config.getCanRevision() != cfgRevision)
+        {
+            cfgRevision = g_config.copyCanConfig(txCanCfg);
+            program.compile(activeLayout(canCfg));
+        }
+
+        const bool onChange = canCfg.getTxMode() == canTxMode::onChange;
+        const bool polled = canCfg.getTxMode() == canTxMode::polled;
+        const bool synced = canCfg.getTrigger() == canTrigger::sync;
+        canSnapshot snap;
+
+        sysinterval_t wait = TIME_MS2I(CAN_SYNC_TIMEOUT_MS);
+        if (polled)
+        {
+            // nothing to send on time, but a new TX mode or map has to be seen
+            wait = TIME_MS2I(CAN_TX_PERIOD_MS);
+        }
+        else if (!synced)
         {
-            txmsg1.data16[i] = g_inputs.getAnalogTempInputValue(i);
+            const sysinterval_t elapsed = chTimeDiffX(lastCycle, chVTGetSystemTimeX());
+            wait = (elapsed >= TIME_MS2I(CAN_TX_PERIOD_MS)) ? TIME_IMMEDIATE : TIME_MS2I(CAN_TX_PERIOD_MS) - elapsed;
         }
-        canTransmit(&CAND1, CAN_ANY_MAILBOX, &txmsg1, TIME_IMMEDIATE);
-        for (size_t i = 0; i < 6; i++)
+        const eventmask_t events = chEvtWaitAnyTimeout(CAN_SYNC_EVENT | CAN_REQUEST_EVENT, wait);
+
+        if (events & CAN_REQUEST_EVENT)
         {
-            if (i < 4)
+            std::array<CANTxFrame, CAN_QUERY_QUEUE> replies;
+
+            chSysLock();
+            const uint8_t requested = requestedFrames;
+            requestedFrames = 0;
+            const size_t replyCount = queryReplyCount;
+            std::copy_n(queryReplies.begin(), replyCount, replies.begin());
+            queryReplyCount = 0;
+            chSysUnlock();
+
+            // query replies first, the tester is waiting for them
+            for (size_t i = 0; i < replyCount; i++)
             {
-                txmsg2.data16[i] = g_inputs.getAnalogInputValue(i);
+                (void)canSend(replies[i], TIME_MS2I(CAN_QUERY_TX_TIMEOUT_MS));
             }
-            else
+
+            // polled frames go out right away with fresh data, whatever the deadband says
+            snap = takeSnapshot(g_inputs);
+            for (size_t f = 0; f < program.frameCount(); f++)
             {
-                txmsg3.data16[i - 4] = g_inputs.getAnalogInputValue(i);
+                if ((requested & (1U << f)) && sendFrame(f, snap))
+                {
+                    heartbeats[f].mark(chVTGetSystemTimeX());
+                    for (const packOp &op : program.frameOps(f))
+                    {
+                        delta.commit(op.signal, snap[static_cast<size_t>(op.signal)]);
+                    }
+                }
             }
-            if (i == 5)
+        }
+
+        if (polled)
+        {
+            continue;
+        }
+        else if (synced && (events & CAN_SYNC_EVENT))
+        {
+            chSysLock();
+            snap = syncSnapshot;
+            const systime_t latched = syncTime;
+            chSysUnlock();
+
+            // every node answers the same SYNC in its own slot, so the bus
+            // sees an ordered train of frames instead of a collision burst
+            const sysinterval_t slot = TIME_US2I(static_cast<uint32_t>(canCfg.getNodeId()) * canCfg.getSlotUs());
+            chThdSleepUntilWindowed(latched, chTimeAddX(latched, slot));
+        }
+        else if ((synced && events == 0) ||
+                 (!synced && chTimeDiffX(lastCycle, chVTGetSystemTimeX()) >= TIME_MS2I(CAN_TX_PERIOD_MS)))
+        {
+            snap = takeSnapshot(g_inputs);
+        }
+        else
+        {
+            continue;
+        }
+
+        const systime_t now = chVTGetSystemTimeX();
+        lastCycle = now;
+        backoff.update(now, canCfg);
+        for (size_t f = 0; f < program.frameCount(); f++)
+        {
+            bool moved = false;
+
+            for (const packOp &op : program.frameOps(f))
             {
-                for (size_t j = 0; j < 4; j++)
+                moved |= delta.signalMoved(op.signal, snap[static_cast<size_t>(op.signal)], canCfg);
+            }
+
+            // a frame that did not make it into a mailbox keeps its old reference
+            // values, so the change is retried on the next cycle
+            // a throttled frame stays due and goes out on its next allowed cycle
+            if ((!onChange || moved || heartbeats[f].expired(now, canCfg.getHeartbeatMs())) &&
+                backoff.allowed(f, canCfg) && sendFrame(f, snap))
+            {
+                heartbeats[f].mark(now);
+                for (const packOp &op : program.frameOps(f))
                 {
-                    txmsg3.data8[i - 1 + j] = g_inputs.getDigitalInputState(j);
+                    delta.commit(op.signal, snap[static_cast<size_t>(op.signal)]);
                 }
             }
         }
-        canTransmit(&CAND1, CAN_ANY_MAILBOX, &txmsg2, TIME_IMMEDIATE);
-        canTransmit(&CAND1, CAN_ANY_MAILBOX, &txmsg3, TIME_IMMEDIATE);
-        canTransmit(&CAND1, CAN_ANY_MAILBOX, &txmsg4, TIME_IMMEDIATE);
-        chThdSleepMilliseconds(20);
+        // the output command frame never changes, so it only rides the heartbeat;
+        // it is an 11 bit frame and has no place on a J1939 network
+        if (canCfg.getProtocol() == canProtocol::raw11 &&
+            (!onChange || outHeartbeat.expired(now, canCfg.getHeartbeatMs())) &&
+            backoff.allowed(CAN_OUTPUT_BACKOFF_SLOT, canCfg))
+        {
+            txmsgOut.SID = canCfg.nodeCanId(CAN_OUTPUT_ID);
+            if (canSend(txmsgOut, TIME_IMMEDIATE) == MSG_OK)
+            {
+                outHeartbeat.mark(now);
+            }
+        }
+        delta.prime();
+        backoff.nextCycle();
     }
 }
 
@@ -124,8 +743,89 @@ void startCanThreads()
                       PAL_STM32_OTYPE_PUSHPULL |
                       PAL_STM32_OSPEED_HIGHEST);
 
-    canSTM32SetFilters(&CAND1, 0, 1, &filter);
+    config &g_config = getConfig();
+
+    // the node id has to be known before the filters are, so arbitration runs
+    // on its own with only the claim filter; a new id is stored right away
+    if (g_config.getCanConfig().getAutoAddress() && g_config.getCanConfig().getProtocol() == canProtocol::raw11)
+    {
+        const CANFilter claimFilter = addressClaimFilter(0);
+        canSTM32SetFilters(&CAND1, 0, 1, &claimFilter);
+        canStart(&CAND1, &cancfg);
+        const uint8_t nodeId = nodeAddress.arbitrate(g_config.getCanConfig().getNodeId());
+        canStop(&CAND1);
+
+        if (nodeId != g_config.getCanConfig().getNodeId())
+        {
+            auto edit = [&]()
+            {
+                configCan cfg = g_config.getCanConfig();
+                cfg.setNodeId(nodeId);
+                g_config.setCanConfig(cfg);
+            };
+            // a failed save leaves the new id to this run only
+            (void)g_config.update(edit);
+        }
+    }
+
+    // the SYNC and query ids, node id and protocol are read once, changes take effect after reboot
+    // the RX thread's copy serves until the thread starts, the main stack is small
+    const configCan &canCfg = rxCanCfg;
+    (void)g_config.copyCanConfig(rxCanCfg);
+    std::array<CANFilter, 8> filters;
+    uint32_t filterCount = 0;
+
+    // one 32 bit mask bank per filter, so the bank number is the FMI
+    auto addFilter = [&](CANFilter f)
+    {
+        f.filter = filterCount;
+        filters[filterCount] = f;
+        filterCount++;
+    };
+
+    addFilter(exactStdFilter(0, canCfg.nodeCanId(CAN_OUTPUT_ID)));
+    addFilter(exactStdFilter(0, canCfg.getSyncId()));
+    syncRxId = canCfg.getSyncId();
+    if (canCfg.getTimeSyncId() != 0U)
+    {
+        addFilter(exactStdFilter(0, canCfg.getTimeSyncId()));
+    }
+    if (canCfg.getProtocol() == canProtocol::j1939)
+    {
+        addFilter(j1939PfFilter(0, J1939_PGN_REQUEST >> 8));
+        addFilter(j1939PfFilter(0, J1939_PGN_ADDRESS_CLAIMED >> 8));
+    }
+    else
+    {
+        addFilter(exactStdFilter(0, canCfg.nodeCanId(canCfg.getQueryId())));
+        addFilter(exactStdFilter(0, canCfg.nodeCanId(canCfg.getIsotpRxId())));
+        if (canCfg.getAutoAddress())
+        {
+            addFilter(addressClaimFilter(0));
+        }
+    }
+
+    // bus monitoring and the adaptive backoff need to see every frame for the
+    // load estimate, so does the USB adapter; SLCAN switches the bank on while
+    // its channel is open. The RX thread drops what it has no handler for
+    acceptAllPinned = canCfg.getBusMonitor() || canCfg.getAdaptive() || USE_GS_USB;
+    acceptAllBank = filterCount;
+    addFilter(acceptAllFilter(0));
+
+    canSTM32SetFilters(&CAND1, 0, filterCount, filters.data());
+    // from here on frames are stamped in the RX interrupt, canReceive no longer sees them
+    CAND1.rxfull_cb = canRxFullCallback;
+    CAND1.error_cb = canErrorCallback;
+#if USE_GS_USB
+    CAND1.txempty_cb = gsUsbCanTxEmpty;
+#endif
     canStart(&CAND1, &cancfg);
-    chThdCreateStatic(waCanRxThread, sizeof(waCanRxThread), NORMALPRIO - 4, CanRxThread, nullptr);
-    chThdCreateStatic(waCanTxThread, sizeof(waCanTxThread), NORMALPRIO - 2, CanTxThread, nullptr);
+    canAcceptAll(false);
+    if (canCfg.getProtocol() == canProtocol::j1939)
+    {
+        j1939.start(canCfg.getJ1939Address());
+    }
+    canTxThread = chThdCreateStatic(waCanTxThread, sizeof(waCanTxThread), NORMALPRIO - 2, CanTxThread, nullptr);
+    canSaveThread = chThdCreateStatic(waCanSaveThread, sizeof(waCanSaveThread), NORMALPRIO - 5, CanSaveThread, nullptr);
+    canRxThread = chThdCreateStatic(waCanRxThread, sizeof(waCanRxThread), NORMALPRIO - 4, CanRxThread, nullptr);
 }
\ No newline at end of file
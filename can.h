@@ -2,23 +2,66 @@
 #include "hal.h"
 #include "ch.h"
 
+/* Loopback for bench work without a bus: the node gets its own frames back
+   and ignores CANRX, so nothing sent by other units ever arrives (SYNC,
+   claims, queries, ISO-TP, time sync, the USB adapters). Set with
+   -DCAN_LOOPBACK=TRUE in UDEFS. */
+#ifndef CAN_LOOPBACK
+#define CAN_LOOPBACK FALSE
+#endif
+
 inline constexpr CANConfig cancfg =
     {
         CAN_MCR_ABOM | CAN_MCR_AWUM | CAN_MCR_TXFP,
         /*
          For 48MHz http://www.bittiming.can-wiki.info/ gives us Pre-scaler=6, Seq 1=13 and Seq 2=2. Subtract '1' for register values
         */
-        CAN_BTR_SJW(0) | CAN_BTR_BRP(5) | CAN_BTR_TS1(12) | CAN_BTR_TS2(1) | CAN_BTR_LBKM
+        CAN_BTR_SJW(0) | CAN_BTR_BRP(5) | CAN_BTR_TS1(12) | CAN_BTR_TS2(1) | (CAN_LOOPBACK ? CAN_BTR_LBKM : 0U)
 
 };
 
-inline constexpr CANFilter filter = {
-    .filter = 0,
-    .mode = 0,
-    .scale = 1,
-    .assignment = 0,
-    .register1 = ((uint32_t)0xABU << 21),
-    .register2 = ((uint32_t)0xABU << 21) | (1U << 2)
-};
+// the bus timing of cancfg, decoded back from the BTR value
+constexpr uint32_t CAN_BRP = (cancfg.btr & 0x3FFU) + 1U;
+constexpr uint32_t CAN_TSEG1 = ((cancfg.btr >> 16) & 0xFU) + 1U;
+constexpr uint32_t CAN_TSEG2 = ((cancfg.btr >> 20) & 0x7U) + 1U;
+constexpr uint32_t CAN_SJW = ((cancfg.btr >> 24) & 0x3U) + 1U;
+constexpr uint32_t CAN_BITRATE = STM32_PCLK / (CAN_BRP * (1U + CAN_TSEG1 + CAN_TSEG2));
+static_assert(CAN_BITRATE * CAN_BRP * (1U + CAN_TSEG1 + CAN_TSEG2) == STM32_PCLK, "cancfg does not divide PCLK evenly");
+
+/* Exact match on one standard id */
+constexpr CANFilter exactStdFilter(uint32_t bank, uint32_t sid)
+{
+    return CANFilter{
+        .filter = bank,
+        .mode = 0,
+        .scale = 1,
+        .assignment = 0,
+        .register1 = (sid << 21),
+        .register2 = (0x7FFU << 21) | (1U << 2)};
+}
+
+/* Mask of zero, standard and extended frames alike */
+constexpr CANFilter acceptAllFilter(uint32_t bank)
+{
+    return CANFilter{
+        .filter = bank,
+        .mode = 0,
+        .scale = 1,
+        .assignment = 0,
+        .register1 = 0,
+        .register2 = 0};
+}
+
+/* canTransmit with TX statistics, use for every frame this node sends */
+msg_t canSend(const CANTxFrame &frame, sysinterval_t timeout);
+
+/* Lets every frame through the acceptance filters while on, for the SLCAN
+   bridge; stays on when bus monitoring or the USB adapter need it anyway */
+void canAcceptAll(bool on);
+
+/* Silent mode for the SLCAN listen-only channel: frames are still received
+   but no bit reaches the bus, not even an ACK. False if the controller did
+   not get to initialization mode to take it */
+bool canSilent(bool on);
 
 void startCanThreads();
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include "can_address.h"
+#include "util.h"
+#include "can.h"
+#include <bitset>
+
+canAddress::canAddress()
+{
+    m_hash = getUidHash();
+    m_nodeId = 0;
+    m_settled = false;
+}
+
+void canAddress::sendClaim()
+{
+    CANTxFrame txmsg = {};
+    txmsg.IDE = CAN_IDE_EXT;
+    txmsg.RTR = CAN_RTR_DATA;
+    txmsg.DLC = 6;
+    txmsg.EID = (CAN_CLAIM_TAG << 24) | (m_hash & 0xFFFFFF);
+    txmsg.data8[0] = m_nodeId;
+    txmsg.data8[1] = m_settled ? CAN_CLAIM_SETTLED : 0U;
+    txmsg.data8[2] = m_hash & 0xFF;
+    txmsg.data8[3] = (m_hash >> 8) & 0xFF;
+    txmsg.data8[4] = (m_hash >> 16) & 0xFF;
+    txmsg.data8[5] = (m_hash >> 24) & 0xFF;
+
+    canSend(txmsg, TIME_MS2I(10));
+}
+
+uint8_t canAddress::arbitrate(uint8_t preferred)
+{
+    std::bitset<CAN_MAX_NODES> taken;
+    CANRxFrame rxmsg = {};
+
+    // a stored id is tried first so addresses stay put across reboots
+    m_nodeId = (preferred < CAN_MAX_NODES) ? preferred : m_hash % CAN_MAX_NODES;
+    m_settled = false;
+    sendClaim();
+
+    systime_t windowStart = chVTGetSystemTimeX();
+    while (true)
+    {
+        const sysinterval_t elapsed = chTimeDiffX(windowStart, chVTGetSystemTimeX());
+        if (elapsed >= TIME_MS2I(CAN_CLAIM_WINDOW_MS))
+        {
+            break;
+        }
+        if (canReceive(&CAND1, CAN_ANY_MAILBOX, &rxmsg, TIME_MS2I(CAN_CLAIM_WINDOW_MS) - elapsed) != MSG_OK)
+        {
+            continue;
+        }
+
+        const uint32_t theirHash = rxmsg.data8[2] | (rxmsg.data8[3] << 8) | (rxmsg.data8[4] << 16) |
+                                   (static_cast<uint32_t>(rxmsg.data8[5]) << 24);
+        if (rxmsg.IDE != CAN_IDE_EXT || !isAddressClaim(rxmsg.EID) || rxmsg.DLC < 6 || theirHash == m_hash ||
+            rxmsg.data8[0] >= CAN_MAX_NODES)
+        {
+            continue;
+        }
+
+        taken.set(rxmsg.data8[0]);
+        if (rxmsg.data8[0] != m_nodeId)
+        {
+            continue;
+        }
+        if ((rxmsg.data8[1] & CAN_CLAIM_SETTLED) || theirHash < m_hash)
+        {
+            if (taken.all())
+            {
+                break;
+            }
+            while (taken.test(m_nodeId))
+            {
+                m_nodeId = (m_nodeId + 1) % CAN_MAX_NODES;
+            }
+        }
+        // either our new id or a defence of the old one, the window starts over
+        sendClaim();
+        windowStart = chVTGetSystemTimeX();
+    }
+
+    m_settled = true;
+    return m_nodeId;
+}
+
+void canAddress::handleClaim(const CANRxFrame &rxmsg)
+{
+    if (!m_settled || rxmsg.DLC < 6 || rxmsg.data8[0] != m_nodeId ||
+        (rxmsg.EID & 0xFFFFFF) == (m_hash & 0xFFFFFF))
+    {
+        return;
+    }
+    sendClaim();
+}
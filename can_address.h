@@ -0,0 +1,45 @@
+#pragma once
+#include "hal.h"
+#include "ch.h"
+#include <cstdint>
+
+constexpr uint8_t CAN_MAX_NODES = 64;
+constexpr uint32_t CAN_CLAIM_TAG = 0x1E;         // top 5 bits of the 29 bit claim id
+constexpr uint32_t CAN_CLAIM_WINDOW_MS = 250;    // silence that settles an address
+constexpr uint8_t CAN_CLAIM_SETTLED = 0x01;
+
+constexpr bool isAddressClaim(uint32_t eid) { return (eid >> 24) == CAN_CLAIM_TAG; }
+
+/* Extended mask filter on the claim tag */
+constexpr CANFilter addressClaimFilter(uint32_t bank)
+{
+    return CANFilter{
+        .filter = bank,
+        .mode = 0,
+        .scale = 1,
+        .assignment = 0,
+        .register1 = (CAN_CLAIM_TAG << 27) | (1U << 2),
+        .register2 = (0x1FU << 27) | (1U << 2)};
+}
+
+/* Node id arbitration for identical units on one raw 11 bit bus.
+   Claims go out as extended frames whose id carries the low 24 bits of
+   the UID hash, so two claims never collide on the wire. Data: [0] node
+   id, [1] flags, [2..5] UID hash. While starting, the lower hash keeps a
+   contested id; once settled a node defends its id against newcomers. */
+class canAddress
+{
+private:
+    uint32_t m_hash;
+    uint8_t m_nodeId;
+    bool m_settled;
+
+    void sendClaim();
+
+public:
+    canAddress();
+    // blocks for at least one claim window, CAN must be running with the claim filter
+    uint8_t arbitrate(uint8_t preferred);
+    void handleClaim(const CANRxFrame &rxmsg);
+    uint8_t nodeId() const { return m_nodeId; };
+};
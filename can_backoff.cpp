@@ -0,0 +1,65 @@
+#include "can_backoff.h"
+
+txBackoff::txBackoff()
+{
+    m_factor = 1;
+    m_cycle = 0;
+    m_lastDropped = 0;
+    m_lastEval = 0;
+    m_lastStretch = 0;
+}
+
+void txBackoff::update(systime_t now, const configCan &cfg)
+{
+    if (chTimeDiffX(m_lastEval, now) < TIME_MS2I(CAN_BACKOFF_EVAL_MS))
+    {
+        return;
+    }
+    m_lastEval = now;
+
+    canStatistics &stats = getCanStats();
+    const canStatsSnapshot snap = stats.snapshot();
+    const bool dropped = snap.txDropped != m_lastDropped;
+    m_lastDropped = snap.txDropped;
+
+    if (!cfg.getAdaptive())
+    {
+        m_factor = 1;
+        stats.recordBackoff(m_factor, canBackoffDecision::none);
+        return;
+    }
+
+    const bool congested = snap.busLoad >= cfg.getLoadHigh() || snap.tec >= CAN_ERROR_PASSIVE_TEC || dropped;
+    const bool recovered = snap.busLoad <= cfg.getLoadLow() && snap.tec < CAN_ERROR_WARNING_TEC;
+
+    if (congested && m_factor < cfg.getMaxStretch())
+    {
+        m_factor = (m_factor * 2U > cfg.getMaxStretch()) ? cfg.getMaxStretch() : m_factor * 2U;
+        m_lastStretch = now;
+        stats.recordBackoff(m_factor, canBackoffDecision::stretch);
+    }
+    else if (congested)
+    {
+        m_lastStretch = now;
+    }
+    else if (recovered && m_factor > 1 && chTimeDiffX(m_lastStretch, now) >= TIME_MS2I(CAN_BACKOFF_HOLD_MS))
+    {
+        m_factor /= 2U;
+        m_lastStretch = now;
+        stats.recordBackoff(m_factor, canBackoffDecision::recover);
+    }
+}
+
+bool txBackoff::allowed(size_t frame, const configCan &cfg) const
+{
+    if (m_factor <= 1 || !(cfg.getStretchMask() & (1U << frame)))
+    {
+        return true;
+    }
+    const bool allowed = (m_cycle % m_factor) == 0;
+    if (!allowed)
+    {
+        getCanStats().recordThrottled();
+    }
+    return allowed;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "ch.h"
+#include "config.h"
+#include "can_stats.h"
+
+constexpr uint32_t CAN_BACKOFF_EVAL_MS = 100;
+constexpr uint32_t CAN_BACKOFF_HOLD_MS = 1000; // quiet time before each recovery step
+constexpr uint8_t CAN_ERROR_PASSIVE_TEC = 128;
+constexpr uint8_t CAN_ERROR_WARNING_TEC = 96;
+
+/* Load-adaptive TX throttling. Frames marked in the stretch mask are only
+   sent on every n-th TX cycle, n doubling while the bus is congested or
+   we are error passive, and halving back to 1 once it has recovered. */
+class txBackoff
+{
+private:
+    uint8_t m_factor;
+    uint32_t m_cycle;
+    uint32_t m_lastDropped;
+    systime_t m_lastEval;
+    systime_t m_lastStretch;
+
+public:
+    txBackoff();
+    void update(systime_t now, const configCan &cfg);
+    void nextCycle() { m_cycle++; };
+    bool allowed(size_t frame, const configCan &cfg) const;
+    uint8_t factor() const { return m_factor; };
+};
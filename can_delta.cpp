@@ -0,0 +1,50 @@
+#include "can_delta.h"
+
+bool outsideDeadband(uint16_t value, uint16_t reference, const canDeadband &db)
+{
+    const uint32_t diff = (value > reference) ? value - reference : reference - value;
+    const uint32_t relBand = (static_cast<uint32_t>(reference) * db.relative) / 1000U;
+    const uint32_t band = (db.absolute > relBand) ? db.absolute : relBand;
+
+    // a zero band means "any change"
+    return diff > band;
+}
+
+sendOnDelta::sendOnDelta()
+{
+    m_sent.fill(0);
+    m_primed = false;
+}
+
+bool sendOnDelta::signalMoved(canSignal sig, uint16_t value, const configCan &cfg) const
+{
+    const size_t idx = static_cast<size_t>(sig);
+
+    if (!m_primed)
+    {
+        return true;
+    }
+    if (isDigital(sig))
+    {
+        return m_sent[idx] != value;
+    }
+    // timestamps always move, they ride along with whatever else changed
+    if (isTimestamp(sig))
+    {
+        return false;
+    }
+    if (isVoltage(sig))
+    {
+        return outsideDeadband(value, m_sent[idx], cfg.getVoltDeadband(deadbandIndex(sig)));
+    }
+    return outsideDeadband(value, m_sent[idx], cfg.getDeadband(deadbandIndex(sig)));
+}
+
+bool frameHeartbeat::expired(systime_t now, uint16_t heartbeatMs) const
+{
+    if (!m_sent)
+    {
+        return true;
+    }
+    return chTimeDiffX(m_lastTx, now) >= TIME_MS2I(heartbeatMs);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "ch.h"
+#include "config.h"
+#include "can_layout.h"
+#include <array>
+
+bool outsideDeadband(uint16_t value, uint16_t reference, const canDeadband &db);
+
+/* Remembers what was last put on the bus so the TX thread can skip frames
+   whose signals are still inside their deadband. */
+class sendOnDelta
+{
+private:
+    canSnapshot m_sent;
+    bool m_primed;
+
+public:
+    sendOnDelta();
+    bool signalMoved(canSignal sig, uint16_t value, const configCan &cfg) const;
+    void commit(canSignal sig, uint16_t value) { m_sent[static_cast<size_t>(sig)] = value; };
+    void prime() { m_primed = true; };
+};
+
+/* Per-frame heartbeat: a frame is due when its data moved or it has been
+   silent for longer than the configured heartbeat. */
+class frameHeartbeat
+{
+private:
+    systime_t m_lastTx;
+    bool m_sent;
+
+public:
+    frameHeartbeat() : m_lastTx(0), m_sent(false) {};
+    bool expired(systime_t now, uint16_t heartbeatMs) const;
+    void mark(systime_t now)
+    {
+        m_lastTx = now;
+        m_sent = true;
+    };
+};
@@ -0,0 +1,72 @@
+#include "can_layout.h"
+
+canSnapshot readSnapshot(const inputs &in)
+{
+    canSnapshot snap{};
+
+    for (size_t i = 0; i < 6; i++)
+    {
+        snap[static_cast<size_t>(canSignal::analog0) + i] = in.getAnalogInputValue(i);
+        snap[static_cast<size_t>(canSignal::analogVolt0) + i] = in.getAnalogVolt(i);
+    }
+    for (size_t i = 0; i < 4; i++)
+    {
+        snap[static_cast<size_t>(canSignal::ntc0) + i] = in.getAnalogTempInputValue(i);
+        snap[static_cast<size_t>(canSignal::ntcVolt0) + i] = in.getAnalogTempVolt(i);
+        snap[static_cast<size_t>(canSignal::digital0) + i] = in.getDigitalInputState(i);
+    }
+    return snap;
+}
+
+void canPackProgram::compile(const canLayout &layout)
+{
+    const size_t frames = (layout.ids.size() < CAN_MAP_FRAMES) ? layout.ids.size() : CAN_MAP_FRAMES;
+    size_t op = 0;
+
+    m_frames = 0;
+    for (size_t f = 0; f < frames; f++)
+    {
+        // an id of zero ends the frame list of a custom map
+        if (layout.ids[f] == 0U)
+        {
+            break;
+        }
+
+        uint8_t topBit = 0;
+        m_frameStart[f] = op;
+        for (const canField &field : layout.fields)
+        {
+            if (field.frame != f || !fieldValid(field, frames) || op >= m_ops.size())
+            {
+                continue;
+            }
+            m_ops[op].signal = field.signal;
+            m_ops[op].shift = field.shift;
+            m_ops[op].bitOffset = field.bitOffset;
+            m_ops[op].max = static_cast<uint16_t>((1UL << field.bitLength) - 1U);
+            op++;
+            if (field.bitOffset + field.bitLength > topBit)
+            {
+                topBit = field.bitOffset + field.bitLength;
+            }
+        }
+        m_ids[f] = layout.ids[f] & 0x7FF;
+        m_dlc[f] = (topBit + 7U) / 8U;
+        m_frames++;
+    }
+    m_frameStart[m_frames] = op;
+}
+
+void canPackProgram::pack(size_t f, const canSnapshot &snap, CANTxFrame &frame) const
+{
+    uint64_t data = 0;
+
+    for (const packOp &op : frameOps(f))
+    {
+        const uint16_t value = snap[static_cast<size_t>(op.signal)] >> op.shift;
+        data |= static_cast<uint64_t>((value > op.max) ? op.max : value) << op.bitOffset;
+    }
+    frame.SID = m_ids[f];
+    frame.DLC = m_dlc[f];
+    frame.data64[0] = data;
+}
@@ -0,0 +1,236 @@
+#pragma once
+#include "hal.h"
+#include "ch.h"
+#include "io.h"
+#include <algorithm>
+#include <array>
+#include <span>
+#include <cstdint>
+
+enum class canSignal : uint8_t
+{
+    analog0 = 0,
+    analog1,
+    analog2,
+    analog3,
+    analog4,
+    analog5,
+    ntc0,
+    ntc1,
+    ntc2,
+    ntc3,
+    digital0,
+    digital1,
+    digital2,
+    digital3,
+    analogVolt0,
+    analogVolt1,
+    analogVolt2,
+    analogVolt3,
+    analogVolt4,
+    analogVolt5,
+    ntcVolt0,
+    ntcVolt1,
+    ntcVolt2,
+    ntcVolt3,
+    busTimeLow, // analog sample time in bus microseconds, bits 0..15
+    busTimeHigh // and bits 16..31
+};
+
+constexpr size_t CAN_SIGNAL_COUNT = 26;
+constexpr size_t CAN_ANALOG_SIGNALS = 10; // analog 0..5, then NTC 0..3
+
+constexpr bool isDigital(canSignal sig) { return sig >= canSignal::digital0 && sig <= canSignal::digital3; }
+constexpr bool isVoltage(canSignal sig) { return sig >= canSignal::analogVolt0 && sig <= canSignal::ntcVolt3; }
+constexpr bool isTimestamp(canSignal sig) { return sig >= canSignal::busTimeLow; }
+constexpr bool isTemperature(canSignal sig) { return sig >= canSignal::ntc0 && sig <= canSignal::ntc3; }
+
+/* Largest value of a signal where the hardware bounds it. Analog values
+   follow the calibration and can use all 16 bits. */
+constexpr uint32_t signalMax(canSignal sig)
+{
+    if (isDigital(sig))
+        return 1U;
+    if (isVoltage(sig))
+        return ANALOG_FULL_SCALE_MV;
+    return 0xFFFFU;
+}
+
+/* Deadband slot of a signal: voltages share the relative band of their
+   channel, their absolute band is a separate one in mV */
+constexpr size_t deadbandIndex(canSignal sig)
+{
+    return isVoltage(sig) ? static_cast<size_t>(sig) - static_cast<size_t>(canSignal::analogVolt0)
+                          : static_cast<size_t>(sig);
+}
+
+/* One signal placed in a frame, Intel (little-endian) bit order.
+   Also the persisted entry of the custom mapping table. */
+struct canField
+{
+    uint8_t frame;     // index into the layout's frame id list
+    uint8_t bitOffset; // 0 = LSB of data8[0]
+    uint8_t bitLength; // values above the field range saturate, 0 = unused entry
+    canSignal signal;
+    uint8_t shift;     // value is divided by 2^shift before packing
+};
+
+struct canLayout
+{
+    std::span<const uint16_t> ids;
+    std::span<const canField> fields;
+};
+
+/* Latest value of every signal, taken once per TX cycle */
+using canSnapshot = std::array<uint16_t, CAN_SIGNAL_COUNT>;
+
+canSnapshot readSnapshot(const inputs &in);
+
+/* Fills the timestamp signals, busTime is when the analog values were sampled */
+inline void stampSnapshot(canSnapshot &snap, uint32_t busTime)
+{
+    snap[static_cast<size_t>(canSignal::busTimeLow)] = busTime & 0xFFFF;
+    snap[static_cast<size_t>(canSignal::busTimeHigh)] = busTime >> 16;
+}
+
+/* When the value of a signal was last refreshed by its sampling thread */
+inline systime_t sampleTime(const inputs &in, canSignal sig)
+{
+    return isDigital(sig) ? in.getDigitalSampleTime() : in.getAnalogSampleTime();
+}
+
+constexpr size_t CAN_MAP_FRAMES = 4;
+constexpr size_t CAN_MAP_ENTRIES = 24;
+
+constexpr bool fieldValid(const canField &f, size_t frames)
+{
+    return f.frame < frames && f.bitLength != 0 && f.bitLength <= 16 && f.bitOffset + f.bitLength <= 64 &&
+           static_cast<size_t>(f.signal) < CAN_SIGNAL_COUNT && f.shift < 16;
+}
+
+// the whole range of the signal fits the field, nothing ever saturates
+constexpr bool fieldLossless(const canField &f)
+{
+    return (signalMax(f.signal) >> f.shift) < (1UL << f.bitLength);
+}
+
+constexpr bool fieldsOverlap(const canField &a, const canField &b)
+{
+    return a.frame == b.frame && a.bitOffset < b.bitOffset + b.bitLength && b.bitOffset < a.bitOffset + a.bitLength;
+}
+
+template <size_t F, size_t N>
+constexpr bool layoutValid(const std::array<uint16_t, F> &, const std::array<canField, N> &fields)
+{
+    for (size_t i = 0; i < N; i++)
+    {
+        const canField &a = fields[i];
+        if (!fieldValid(a, F))
+            return false;
+        for (size_t j = i + 1; j < N; j++)
+        {
+            if (fieldsOverlap(a, fields[j]))
+                return false;
+        }
+    }
+    return true;
+}
+
+/* The custom map: unused entries (bit length 0) are skipped, every other
+   entry has to be valid and keep clear of the rest */
+constexpr bool mapValid(std::span<const canField> fields)
+{
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        const canField &a = fields[i];
+        if (a.bitLength == 0U)
+            continue;
+        if (!fieldValid(a, CAN_MAP_FRAMES))
+            return false;
+        for (size_t j = i + 1; j < fields.size(); j++)
+        {
+            if (fields[j].bitLength != 0U && fieldsOverlap(a, fields[j]))
+                return false;
+        }
+    }
+    return true;
+}
+
+/* Original layout: full 16 bit slots, one byte per digital state */
+inline constexpr std::array<uint16_t, 3> legacyIds = {0xBA, 0xBB, 0xBC};
+inline constexpr auto legacyFields = std::to_array<canField>({
+    {0, 0, 16, canSignal::ntc0, 0},
+    {0, 16, 16, canSignal::ntc1, 0},
+    {0, 32, 16, canSignal::ntc2, 0},
+    {0, 48, 16, canSignal::ntc3, 0},
+    {1, 0, 16, canSignal::analog0, 0},
+    {1, 16, 16, canSignal::analog1, 0},
+    {1, 32, 16, canSignal::analog2, 0},
+    {1, 48, 16, canSignal::analog3, 0},
+    {2, 0, 16, canSignal::analog4, 0},
+    {2, 16, 16, canSignal::analog5, 0},
+    {2, 32, 8, canSignal::digital0, 0},
+    {2, 40, 8, canSignal::digital1, 0},
+    {2, 48, 8, canSignal::digital2, 0},
+    {2, 56, 8, canSignal::digital3, 0},
+});
+static_assert(layoutValid(legacyIds, legacyFields));
+
+/* Packed layout: 12 bit fields and one bit per digital, everything fits in
+   two frames. The calibrated analog values need 16 bits, so the analog
+   inputs go out as pin voltage in 2 mV steps. NTCs stay temperatures
+   (degC + 100), which 12 bits hold up to 3995 degC. */
+inline constexpr std::array<uint16_t, 2> packedIds = {0xB8, 0xB9};
+inline constexpr auto packedFields = std::to_array<canField>({
+    {0, 0, 12, canSignal::analogVolt0, 1},
+    {0, 12, 12, canSignal::analogVolt1, 1},
+    {0, 24, 12, canSignal::analogVolt2, 1},
+    {0, 36, 12, canSignal::analogVolt3, 1},
+    {0, 48, 12, canSignal::analogVolt4, 1},
+    {1, 0, 12, canSignal::analogVolt5, 1},
+    {1, 12, 12, canSignal::ntc0, 0},
+    {1, 24, 12, canSignal::ntc1, 0},
+    {1, 36, 12, canSignal::ntc2, 0},
+    {1, 48, 12, canSignal::ntc3, 0},
+    {1, 60, 1, canSignal::digital0, 0},
+    {1, 61, 1, canSignal::digital1, 0},
+    {1, 62, 1, canSignal::digital2, 0},
+    {1, 63, 1, canSignal::digital3, 0},
+});
+static_assert(layoutValid(packedIds, packedFields));
+static_assert(std::ranges::all_of(packedFields, [](const canField &f) { return isTemperature(f.signal) || fieldLossless(f); }));
+
+inline constexpr canLayout legacyLayout = {legacyIds, legacyFields};
+inline constexpr canLayout packedLayout = {packedIds, packedFields};
+
+/* One step of a compiled pack program */
+struct packOp
+{
+    canSignal signal;
+    uint8_t shift;
+    uint8_t bitOffset;
+    uint16_t max;
+};
+
+/* Flat, frame-ordered form of a layout. Compiled once whenever the CAN
+   settings change so the TX path only walks a contiguous op list. */
+class canPackProgram
+{
+private:
+    std::array<packOp, CAN_MAP_ENTRIES> m_ops;
+    std::array<uint8_t, CAN_MAP_FRAMES + 1> m_frameStart;
+    std::array<uint16_t, CAN_MAP_FRAMES> m_ids;
+    std::array<uint8_t, CAN_MAP_FRAMES> m_dlc;
+    uint8_t m_frames;
+
+public:
+    canPackProgram() : m_ops{}, m_frameStart{}, m_ids{}, m_dlc{}, m_frames(0) {};
+    void compile(const canLayout &layout);
+    size_t frameCount() const { return m_frames; };
+    uint16_t frameId(size_t f) const { return m_ids[f]; };
+    std::span<const packOp> frameOps(size_t f) const
+    {
+        return std::span<const packOp>(m_ops).subspan(m_frameStart[f], m_frameStart[f + 1] - m_frameStart[f]);
+    };
+    void pack(size_t f, const canSnapshot &snap, CANTxFrame &frame) const;
+};
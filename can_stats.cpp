@@ -0,0 +1,120 @@
+#include "can_stats.h"
+
+canStatistics::canStatistics()
+{
+    m_stats = {};
+    m_stats.backoffFactor = 1;
+    m_bucketBits.fill(0);
+    m_bucket = 0;
+    m_bucketStart = 0;
+}
+
+void canStatistics::recordTx(const CANTxFrame &frame, msg_t result)
+{
+    chSysLock();
+    if (result == MSG_OK)
+    {
+        m_stats.txFrames++;
+        m_bucketBits[m_bucket] += canFrameBits(frame.IDE == CAN_IDE_EXT, frame.DLC);
+    }
+    else
+    {
+        m_stats.txDropped++;
+    }
+    chSysUnlock();
+}
+
+void canStatistics::recordRx(const CANRxFrame &frame)
+{
+    chSysLock();
+    m_stats.rxFrames++;
+    m_bucketBits[m_bucket] += canFrameBits(frame.IDE == CAN_IDE_EXT, frame.DLC);
+    chSysUnlock();
+}
+
+void canStatistics::recordRxOverruns(uint32_t count)
+{
+    chSysLock();
+    m_stats.rxOverruns += count;
+    chSysUnlock();
+}
+
+void canStatistics::recordErrors(eventflags_t flags)
+{
+    chSysLock();
+    if (flags & CAN_OVERFLOW_ERROR)
+        m_stats.rxOverruns++;
+    if (flags & CAN_BUS_OFF_ERROR)
+        m_stats.busOff++;
+    if (flags & CAN_LIMIT_ERROR)
+        m_stats.errorPassive++;
+    if (flags & CAN_LIMIT_WARNING)
+        m_stats.errorWarning++;
+    chSysUnlock();
+}
+
+void canStatistics::recordBackoff(uint8_t factor, canBackoffDecision decision)
+{
+    chSysLock();
+    m_stats.backoffFactor = factor;
+    if (decision == canBackoffDecision::stretch)
+        m_stats.backoffStretches++;
+    if (decision == canBackoffDecision::recover)
+        m_stats.backoffRecoveries++;
+    chSysUnlock();
+}
+
+void canStatistics::recordThrottled()
+{
+    chSysLock();
+    m_stats.throttledFrames++;
+    chSysUnlock();
+}
+
+/* Samples the bxCAN error counters and rolls the load window, called
+   periodically from the RX thread */
+void canStatistics::tick(systime_t now)
+{
+    if (chTimeDiffX(m_bucketStart, now) < TIME_MS2I(CAN_LOAD_BUCKET_MS))
+    {
+        return;
+    }
+
+    const uint32_t esr = CAND1.can->ESR;
+
+    chSysLock();
+    m_stats.tec = (esr & CAN_ESR_TEC) >> CAN_ESR_TEC_Pos;
+    m_stats.rec = (esr & CAN_ESR_REC) >> CAN_ESR_REC_Pos;
+    m_stats.lastErrorCode = (esr & CAN_ESR_LEC) >> 4;
+
+    uint32_t bits = 0;
+    for (uint32_t b : m_bucketBits)
+    {
+        bits += b;
+    }
+    constexpr uint32_t windowBits = CAN_BITRATE / 1000U * CAN_LOAD_BUCKET_MS * CAN_LOAD_BUCKETS;
+    m_stats.busLoad = static_cast<uint16_t>((static_cast<uint64_t>(bits) * 1000U) / windowBits);
+    if (m_stats.busLoad > m_stats.peakBusLoad)
+    {
+        m_stats.peakBusLoad = m_stats.busLoad;
+    }
+
+    m_bucket = (m_bucket + 1) % CAN_LOAD_BUCKETS;
+    m_bucketBits[m_bucket] = 0;
+    m_bucketStart = now;
+    chSysUnlock();
+}
+
+canStatsSnapshot canStatistics::snapshot() const
+{
+    chSysLock();
+    const canStatsSnapshot copy = m_stats;
+    chSysUnlock();
+    return copy;
+}
+
+canStatistics &getCanStats()
+{
+    static canStatistics instance;
+    return instance;
+}
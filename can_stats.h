@@ -0,0 +1,66 @@
+#pragma once
+#include "hal.h"
+#include "ch.h"
+#include "can.h"
+#include <array>
+#include <cstdint>
+
+constexpr uint32_t CAN_LOAD_BUCKET_MS = 100;
+constexpr size_t CAN_LOAD_BUCKETS = 10; // 1 s sliding window
+
+enum class canBackoffDecision : uint8_t
+{
+    none = 0,
+    stretch,
+    recover
+};
+
+struct canStatsSnapshot
+{
+    uint32_t txFrames;
+    uint32_t txDropped;    // canTransmit found no free mailbox in time
+    uint32_t rxFrames;
+    uint32_t rxOverruns;   // RX FIFO overflow interrupts
+    uint32_t busOff;
+    uint32_t errorPassive;
+    uint32_t errorWarning;
+    uint8_t tec;
+    uint8_t rec;
+    uint8_t lastErrorCode;
+    uint16_t busLoad;      // 0.1 % over the last window
+    uint16_t peakBusLoad;
+    uint32_t backoffStretches; // adaptive TX decisions
+    uint32_t backoffRecoveries;
+    uint32_t throttledFrames;  // due frames held back by the backoff
+    uint8_t backoffFactor;
+};
+
+/* Nominal bit count of a data frame and the interframe space, no stuff
+   bits: the worst case stuffing counted a full bus at well under 100 %,
+   real traffic stuffs a few percent */
+constexpr uint32_t canFrameBits(bool extended, uint8_t dlc)
+{
+    return (extended ? 67U : 47U) + 8U * dlc;
+}
+
+class canStatistics
+{
+private:
+    canStatsSnapshot m_stats;
+    std::array<uint32_t, CAN_LOAD_BUCKETS> m_bucketBits;
+    size_t m_bucket;
+    systime_t m_bucketStart;
+
+public:
+    canStatistics();
+    void recordTx(const CANTxFrame &frame, msg_t result);
+    void recordRx(const CANRxFrame &frame);
+    void recordRxOverruns(uint32_t count);
+    void recordErrors(eventflags_t flags);
+    void recordBackoff(uint8_t factor, canBackoffDecision decision);
+    void recordThrottled();
+    void tick(systime_t now);
+    canStatsSnapshot snapshot() const;
+};
+
+canStatistics &getCanStats();
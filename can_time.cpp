@@ -0,0 +1,40 @@
+#include "can_time.h"
+
+busClock::busClock()
+{
+    m_offset = 0;
+    m_syncStamp = 0;
+    m_sequence = 0;
+    m_syncSeen = false;
+    m_synced = false;
+    m_lastUpdate = 0;
+}
+
+void busClock::handleTimeFrame(const CANRxFrame &frame, uint32_t stamp, bool exact)
+{
+    if (frame.DLC >= 2 && frame.data8[0] == CAN_TIME_SYNC)
+    {
+        // a sync that shared its interrupt with other frames may carry their
+        // stamp; it is skipped, and so is its follow-up
+        m_syncStamp = stamp;
+        m_sequence = frame.data8[1];
+        m_syncSeen = exact;
+    }
+    else if (frame.DLC >= 6 && frame.data8[0] == CAN_TIME_FOLLOW_UP && m_syncSeen && frame.data8[1] == m_sequence)
+    {
+        const uint32_t masterTime = frame.data8[2] | (frame.data8[3] << 8) | (frame.data8[4] << 16) |
+                                    (static_cast<uint32_t>(frame.data8[5]) << 24);
+        // the master stamps the end of its sync frame, we stamp the interrupt
+        // that frame raised alone; so the offset needs no correction for the
+        // frame length, only our interrupt latency stays in it
+        m_offset = static_cast<int32_t>(masterTime - m_syncStamp);
+        m_syncSeen = false;
+        m_synced = true;
+        m_lastUpdate = chVTGetSystemTimeX();
+    }
+}
+
+bool busClock::synced() const
+{
+    return m_synced && chTimeDiffX(m_lastUpdate, chVTGetSystemTimeX()) < TIME_MS2I(CAN_TIME_VALID_MS);
+}
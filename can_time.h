@@ -0,0 +1,93 @@
+#pragma once
+#include "hal.h"
+#include "ch.h"
+#include <array>
+#include <cstdint>
+
+// systime doubles as the local microsecond clock, see CH_CFG_ST_FREQUENCY
+static_assert(CH_CFG_ST_FREQUENCY == 1000000, "CAN timestamps expect a 1 MHz system timer");
+
+constexpr uint8_t CAN_TIME_SYNC = 0;      // [0] type, [1] sequence
+constexpr uint8_t CAN_TIME_FOLLOW_UP = 1; // [0] type, [1] sequence, [2..5] master time of the sync in us
+constexpr uint32_t CAN_TIME_VALID_MS = 3000;
+constexpr size_t CAN_RX_RING_SIZE = 8;
+
+/* A received frame and the local time its FIFO interrupt was taken */
+struct canRxStamped
+{
+    CANRxFrame frame;
+    uint32_t stamp;
+    bool exact; // the only frame its interrupt drained, so the stamp is its own
+};
+
+/* ISR to thread hand-over of stamped frames, single producer/consumer */
+template <size_t Size = CAN_RX_RING_SIZE>
+class canRxRing
+{
+private:
+    std::array<canRxStamped, Size> m_entries;
+    size_t m_head;
+    size_t m_tail;
+    uint32_t m_dropped;
+
+public:
+    canRxRing() : m_head(0), m_tail(0), m_dropped(0) {};
+
+    void pushI(const CANRxFrame &frame, uint32_t stamp, bool exact = false)
+    {
+        const size_t next = (m_head + 1) % m_entries.size();
+
+        if (next == m_tail)
+        {
+            m_dropped++;
+            return;
+        }
+        m_entries[m_head].frame = frame;
+        m_entries[m_head].stamp = stamp;
+        m_entries[m_head].exact = exact;
+        m_head = next;
+    };
+
+    bool pop(canRxStamped &out)
+    {
+        chSysLock();
+        const bool empty = m_tail == m_head;
+        if (!empty)
+        {
+            out = m_entries[m_tail];
+            m_tail = (m_tail + 1) % m_entries.size();
+        }
+        chSysUnlock();
+        return !empty;
+    };
+
+    uint32_t takeDropped()
+    {
+        chSysLock();
+        const uint32_t dropped = m_dropped;
+        m_dropped = 0;
+        chSysUnlock();
+        return dropped;
+    };
+};
+
+/* Two step time sync slave: the master broadcasts a sync frame, then a
+   follow-up carrying the time at which that sync went out. The difference
+   to our RX stamp of the sync is the offset of our clock to bus time. */
+class busClock
+{
+private:
+    int32_t m_offset;
+    uint32_t m_syncStamp;
+    uint8_t m_sequence;
+    bool m_syncSeen;
+    bool m_synced;
+    systime_t m_lastUpdate;
+
+public:
+    busClock();
+    void handleTimeFrame(const CANRxFrame &frame, uint32_t stamp, bool exact);
+    uint32_t toBusTime(systime_t local) const { return static_cast<uint32_t>(local) + m_offset; };
+    bool synced() const;
+    int32_t offset() const { return m_offset; };
+};
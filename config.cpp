@@ -1,8 +1,11 @@
 // config.cpp
 #include "config.h"
 #include "flash.h"
+#include "config_store.h"
+#include "crc.h"
 #include <cstring>
 #include <cstdint>
+#include <cstddef>
 
 pullup::pullup(ioportid_t port, iopadid_t pad) : m_port(port), m_pad(pad)
 {
@@ -39,32 +42,51 @@ void pullupsStore::setPullup(size_t idx, pullupVolt pu)
 
 static pullupsStore puStore;
 
-/* Same address you already use */
-constexpr uintptr_t CFG_ADDR = 0x0801F800; // last page start
+/* Before the log store the one image lived at the start of the last page */
+constexpr uintptr_t CFG_LEGACY_ADDR = 0x0801F800;
+constexpr uintptr_t CFG_STORE_ADDR = 0x08000000 + CFG_STORE_FIRST_PAGE * FLASH_PAGE_SIZE;
 constexpr uint32_t CFG_MAGIC = 0x43464731; // 'CFG1'
-constexpr uint16_t CFG_VERSION = 1;
+constexpr uint16_t CFG_VERSION = 13;
+constexpr size_t CFG_V12_RECORD_SIZE = 376; // the log store's records before version 13
 
-/* Small CRC32 (standard polynomial 0xEDB88320). Good enough for config. */
-static uint32_t crc32(const uint8_t *data, size_t len)
+/* Everything after the header is covered by size and CRC */
+constexpr size_t CFG_PAYLOAD_OFFSET = offsetof(ConfigFlashImage, analog);
+constexpr size_t CFG_PAYLOAD_SIZE = sizeof(ConfigFlashImage) - CFG_PAYLOAD_OFFSET;
+
+static uint32_t payloadCrc(const ConfigFlashImage &img)
 {
-    uint32_t crc = 0xFFFFFFFFu;
-    for (size_t i = 0; i < len; i++)
-    {
-        crc ^= data[i];
-        for (int b = 0; b < 8; b++)
-        {
-            uint32_t mask = -(crc & 1u);
-            crc = (crc >> 1) ^ (0xEDB88320u & mask);
-        }
-    }
-    return ~crc;
+    return crc32(reinterpret_cast<const uint8_t *>(&img) + CFG_PAYLOAD_OFFSET, CFG_PAYLOAD_SIZE);
 }
 
-static const ConfigFlashImage *flashImage()
+static bool imageValid(const ConfigFlashImage &img)
 {
-    return reinterpret_cast<const ConfigFlashImage *>(CFG_ADDR);
+    if (img.magic != CFG_MAGIC)
+        return false;
+    if (img.version != CFG_VERSION)
+        return false;
+    if (img.size != CFG_PAYLOAD_SIZE)
+        return false;
+
+    return (payloadCrc(img) == img.crc);
 }
 
+/* An image of an older version. The calibrations have kept their layout
+   and lead the payload since version 1 (which stored nothing else), the
+   CAN settings have changed with nearly every version. */
+static bool olderImageValid(const ConfigFlashImage &img)
+{
+    if (img.magic != CFG_MAGIC)
+        return false;
+    if (img.version == 0U || img.version >= CFG_VERSION)
+        return false;
+    if (img.size < sizeof(configAnalog) || img.size > FLASH_PAGE_SIZE - CFG_PAYLOAD_OFFSET)
+        return false;
+
+    return crc32(reinterpret_cast<const uint8_t *>(&img) + CFG_PAYLOAD_OFFSET, img.size) == img.crc;
+}
+
+static configStore store(CFG_STORE_ADDR, CFG_STORE_FIRST_PAGE);
+
 configAnalog::configAnalog()
 {
     for (auto &cal : m_analogCals)
@@ -90,76 +112,171 @@ configAnalog::configAnalog()
     }
 }
 
-bool config::isFlashValid() const
+configCan::configCan()
 {
-    const ConfigFlashImage *img = flashImage();
+    m_txMode = canTxMode::periodic;
+    m_layout = canLayoutMode::legacy;
+    m_heartbeatMs = 1000U;
+    for (auto &db : m_deadbands)
+    {
+        db.absolute = 0U;
+        db.relative = 0U;
+    }
+    m_trigger = canTrigger::freeRunning;
+    m_nodeId = 0U;
+    m_syncId = 0x080U; // CANopen SYNC
+    m_slotUs = 1000U;
 
-    if (img->magic != CFG_MAGIC)
-        return false;
-    if (img->version != CFG_VERSION)
-        return false;
-    if (img->size != sizeof(configAnalog))
-        return false;
+    // the custom map starts out as a copy of the legacy layout
+    m_mapIds.fill(0);
+    for (size_t f = 0; f < legacyIds.size(); f++)
+    {
+        m_mapIds[f] = legacyIds[f];
+    }
+    m_mapFields = {};
+    for (size_t i = 0; i < legacyFields.size(); i++)
+    {
+        m_mapFields[i] = legacyFields[i];
+    }
+
+    m_protocol = canProtocol::raw11;
+    m_j1939Address = 0x80U;
+    m_j1939PgnBase = 0x10U;
+    m_diagId = 0x7F0U;
+    m_diagPeriodMs = 1000U;
+    m_busMonitor = 0U;
+    m_adaptive = 0U;
+    m_maxStretch = 8U;
+    m_stretchMask = 0b1110; // frame 0 keeps its nominal rate
+    m_loadHigh = 700U;
+    m_loadLow = 500U;
+    m_queryId = 0x7E0;
+    m_responseId = 0x7E8;
+    m_isotpRxId = 0x6F0;
+    m_isotpTxId = 0x6F8;
+    m_isotpBlockSize = 8U;
+    m_isotpStMin = 0U;
+    m_autoAddress = 0U;
+    m_idStride = 0U;
+    m_timeSyncId = 0U;
+    m_voltDeadbands.fill(0);
+}
 
-    const uint32_t calc = crc32(reinterpret_cast<const uint8_t *>(&img->analog), sizeof(configAnalog));
-    return (calc == img->crc);
+bool config::isFlashValid() const
+{
+    return store.current() != nullptr;
 }
 
-void config::writeImageToFlash(const configAnalog &cfg)
+bool config::writeImageToFlash()
 {
     ConfigFlashImage img{};
     img.magic = CFG_MAGIC;
     img.version = CFG_VERSION;
-    img.size = sizeof(configAnalog);
-    img.analog = cfg;
-    img.crc = crc32(reinterpret_cast<const uint8_t *>(&img.analog), sizeof(configAnalog));
+    img.size = CFG_PAYLOAD_SIZE;
+    chMtxLock(&m_lock);
+    img.analog = m_analogConfig;
+    img.can = m_canConfig;
+    chMtxUnlock(&m_lock);
+    img.crc = payloadCrc(img);
 
-    Flash::ErasePage(63);
-    Flash::Write(CFG_ADDR, reinterpret_cast<uint8_t *>(&img), sizeof(img));
+    // a full store keeps the previous record, RAM still has the new values
+    const bool saved = store.append(img);
 
     for (size_t i = 0; i < 4; i++)
     {
-        puStore.setPullup(i, m_analogConfig.getDigitalPullup(i));
+        puStore.setPullup(i, img.analog.getDigitalPullup(i));
     }
+    return saved;
 }
 
 void config::loadConfigFromFlash()
 {
     // only call this if isFlashValid() is true
-    m_analogConfig = flashImage()->analog;
+    loadImage(*store.current());
+}
+
+void config::loadImage(const ConfigFlashImage &img)
+{
+    m_analogConfig = img.analog;
+    m_canConfig = img.can;
+    m_canRevision++;
     for (size_t i = 0; i < 4; i++)
     {
         puStore.setPullup(i, m_analogConfig.getDigitalPullup(i));
     }
 }
 
-void config::save()
+uint32_t config::copyCanConfig(configCan &cfg) const
 {
-    writeImageToFlash(m_analogConfig);
+    chMtxLock(&m_lock);
+    cfg = m_canConfig;
+    const uint32_t revision = m_canRevision;
+    chMtxUnlock(&m_lock);
+    return revision;
+}
+
+bool config::save()
+{
+    chMtxLock(&m_saveLock);
+    const bool saved = writeImageToFlash();
+    chMtxUnlock(&m_saveLock);
     // re-read from flash if you want to be 100% sure it matches:
     // loadConfigFromFlash();
+    return saved;
 }
 
-void config::factoryReset()
+bool config::factoryReset()
 {
-    configAnalog defaults; // ctor sets your defaults
-    m_analogConfig = defaults;
-    writeImageToFlash(m_analogConfig);
+    auto edit = [&]()
+    {
+        configAnalog defaults; // ctor sets your defaults
+        m_analogConfig = defaults;
+        m_canConfig = configCan();
+        m_canRevision++;
+    };
+    return update(edit);
 }
 
-config::config()
+config::config() : m_canRevision(0)
 {
+    chMtxObjectInit(&m_lock);
+    chMtxObjectInit(&m_saveLock);
+    const ConfigFlashImage *legacy = reinterpret_cast<const ConfigFlashImage *>(CFG_LEGACY_ADDR);
+
+    store.scan(imageValid);
+    // calibrations of an older version come from the log, or else from before the log
+    const ConfigFlashImage *older = isFlashValid() ? nullptr : store.findOlder(olderImageValid, CFG_V12_RECORD_SIZE);
+    if (older == nullptr && olderImageValid(*legacy))
+    {
+        older = legacy;
+    }
+
     if (isFlashValid())
     {
         loadConfigFromFlash();
     }
+    else if (imageValid(*legacy))
+    {
+        // first boot after the update to the log store: carry the old image over
+        loadImage(*legacy);
+        writeImageToFlash();
+    }
+    else if (older != nullptr)
+    {
+        // keep the calibrations, the CAN settings start over from the defaults
+        m_analogConfig = older->analog;
+        m_canConfig = configCan();
+        m_canRevision++;
+        writeImageToFlash();
+    }
     else
     {
         // FIRST BOOT AFTER PROGRAMMING (or after struct/version change):
         // create defaults in RAM and persist ONCE
         configAnalog defaults;
         m_analogConfig = defaults;
-        writeImageToFlash(m_analogConfig);
+        m_canConfig = configCan();
+        writeImageToFlash();
     }
 }
 
@@ -4,6 +4,7 @@
 #include "ch.h"
 #include <array>
 #include <cstdint>
+#include "can_layout.h"
 
 enum class scaling : uint8_t
 {
@@ -40,6 +41,7 @@ struct ntcCal
     int16_t t3;
 };
 
+// read back from the images of every older version, do not change the layout
 class configAnalog
 {
 private:
@@ -57,30 +59,199 @@ public:
     const pullupVolt& getDigitalPullup(size_t idx) const { return m_digitalPullups[idx]; };
 };
 
+enum class canTxMode : uint8_t
+{
+    periodic = 0, // every frame on every TX cycle
+    onChange,     // send-on-delta, heartbeat keeps silent frames alive
+    polled        // no periodic data frames, only query and request answers
+};
+
+enum class canLayoutMode : uint8_t
+{
+    legacy = 0, // 0xBA/0xBB/0xBC, 16 bit slots
+    packed,     // 0xB8/0xB9, 12 bit values and bit-packed digitals
+    custom      // persisted mapping table below
+};
+
+enum class canTrigger : uint8_t
+{
+    freeRunning = 0, // own 20 ms cycle
+    sync             // sample on SYNC, send in the node's slot
+};
+
+enum class canProtocol : uint8_t
+{
+    raw11 = 0, // 11 bit ids from the layout
+    j1939      // 29 bit ids, proprietary B PGNs, address claim
+};
+
+/* Deadband a channel must leave before its frame is resent.
+   The effective band is max(absolute, relative * last sent value). */
+struct canDeadband
+{
+    uint16_t absolute; // in channel units (raw output value), mV for voltages
+    uint16_t relative; // in 0.1 % of the last sent value
+};
+
+class configCan
+{
+private:
+    canTxMode m_txMode;
+    canLayoutMode m_layout;
+    uint16_t m_heartbeatMs;                 // max silence per frame in onChange mode
+    std::array<canDeadband, 10> m_deadbands; // analog 0..5, then NTC 0..3
+    canTrigger m_trigger;
+    uint8_t m_nodeId;
+    uint16_t m_syncId;
+    uint16_t m_slotUs;                      // TX slot width per node id after SYNC
+    std::array<uint16_t, CAN_MAP_FRAMES> m_mapIds;   // 0 = frame unused
+    std::array<canField, CAN_MAP_ENTRIES> m_mapFields;
+    canProtocol m_protocol;
+    uint8_t m_j1939Address;                 // preferred source address
+    uint8_t m_j1939PgnBase;                 // frame n goes out as PGN 0xFF00 + base + n
+    uint16_t m_diagId;
+    uint16_t m_diagPeriodMs;                // 0 = no diagnostic frame
+    uint8_t m_busMonitor;                   // accept every frame to measure bus load
+    uint8_t m_adaptive;                     // load-adaptive TX backoff
+    uint8_t m_maxStretch;                   // longest period as a multiple of nominal
+    uint8_t m_stretchMask;                  // data frames that may be slowed down
+    uint16_t m_loadHigh;                    // 0.1 %, start stretching
+    uint16_t m_loadLow;                     // 0.1 %, step back towards nominal
+    uint16_t m_queryId;                     // single signal read requests
+    uint16_t m_responseId;
+    uint16_t m_isotpRxId;                   // ISO-TP calibration channel
+    uint16_t m_isotpTxId;
+    uint8_t m_isotpBlockSize;               // granted to the tester, 0 = no further flow control
+    uint8_t m_isotpStMin;                   // ISO 15765-2 STmin byte
+    uint8_t m_autoAddress;                  // arbitrate the node id at startup
+    uint16_t m_idStride;                    // per node offset of our 11 bit ids
+    uint16_t m_timeSyncId;                  // time master sync/follow-up frames, 0 = off
+    std::array<uint16_t, CAN_ANALOG_SIGNALS> m_voltDeadbands; // absolute band of the voltages in mV
+
+public:
+    configCan();
+    canTxMode getTxMode() const { return m_txMode; };
+    canLayoutMode getLayout() const { return m_layout; };
+    uint16_t getHeartbeatMs() const { return m_heartbeatMs; };
+    const canDeadband& getDeadband(size_t idx) const { return m_deadbands[idx]; };
+    // band of a voltage signal: its own absolute one, the relative one of its channel
+    canDeadband getVoltDeadband(size_t idx) const { return {m_voltDeadbands[idx], m_deadbands[idx].relative}; };
+    canTrigger getTrigger() const { return m_trigger; };
+    uint8_t getNodeId() const { return m_nodeId; };
+    uint16_t getSyncId() const { return m_syncId; };
+    uint16_t getSlotUs() const { return m_slotUs; };
+    uint16_t getMapId(size_t frame) const { return m_mapIds[frame]; };
+    const canField& getMapField(size_t idx) const { return m_mapFields[idx]; };
+    canLayout getCustomLayout() const { return {m_mapIds, m_mapFields}; };
+    canProtocol getProtocol() const { return m_protocol; };
+    uint8_t getJ1939Address() const { return m_j1939Address; };
+    uint8_t getJ1939PgnBase() const { return m_j1939PgnBase; };
+    uint16_t getDiagId() const { return m_diagId; };
+    uint16_t getDiagPeriodMs() const { return m_diagPeriodMs; };
+    bool getBusMonitor() const { return m_busMonitor != 0U; };
+    bool getAdaptive() const { return m_adaptive != 0U; };
+    uint8_t getMaxStretch() const { return m_maxStretch; };
+    uint8_t getStretchMask() const { return m_stretchMask; };
+    uint16_t getLoadHigh() const { return m_loadHigh; };
+    uint16_t getLoadLow() const { return m_loadLow; };
+    uint16_t getQueryId() const { return m_queryId; };
+    uint16_t getResponseId() const { return m_responseId; };
+    uint16_t getIsotpRxId() const { return m_isotpRxId; };
+    uint16_t getIsotpTxId() const { return m_isotpTxId; };
+    uint8_t getIsotpBlockSize() const { return m_isotpBlockSize; };
+    uint8_t getIsotpStMin() const { return m_isotpStMin; };
+    bool getAutoAddress() const { return m_autoAddress != 0U; };
+    uint16_t getIdStride() const { return m_idStride; };
+    uint16_t getTimeSyncId() const { return m_timeSyncId; };
+    // an 11 bit id of this node, moved out of the way of the other nodes
+    uint16_t nodeCanId(uint16_t base) const { return (base + m_nodeId * m_idStride) & 0x7FF; };
+    void setTxMode(canTxMode mode) { m_txMode = mode; };
+    void setLayout(canLayoutMode layout) { m_layout = layout; };
+    void setHeartbeatMs(uint16_t ms) { m_heartbeatMs = ms; };
+    canDeadband& writeDeadband(size_t idx) { return m_deadbands[idx]; };
+    void setVoltDeadband(size_t idx, uint16_t mv) { m_voltDeadbands[idx] = mv; };
+    void setTrigger(canTrigger trigger) { m_trigger = trigger; };
+    void setNodeId(uint8_t id) { m_nodeId = id; };
+    void setSyncId(uint16_t id) { m_syncId = id; };
+    void setSlotUs(uint16_t us) { m_slotUs = us; };
+    void setMapId(size_t frame, uint16_t id) { m_mapIds[frame] = id; };
+    canField& writeMapField(size_t idx) { return m_mapFields[idx]; };
+    void setProtocol(canProtocol protocol) { m_protocol = protocol; };
+    void setJ1939Address(uint8_t address) { m_j1939Address = address; };
+    void setJ1939PgnBase(uint8_t base) { m_j1939PgnBase = base; };
+    void setDiagId(uint16_t id) { m_diagId = id; };
+    void setDiagPeriodMs(uint16_t ms) { m_diagPeriodMs = ms; };
+    void setBusMonitor(bool on) { m_busMonitor = on ? 1U : 0U; };
+    void setAdaptive(bool on) { m_adaptive = on ? 1U : 0U; };
+    void setMaxStretch(uint8_t factor) { m_maxStretch = factor; };
+    void setStretchMask(uint8_t mask) { m_stretchMask = mask; };
+    void setLoadHigh(uint16_t load) { m_loadHigh = load; };
+    void setLoadLow(uint16_t load) { m_loadLow = load; };
+    void setQueryId(uint16_t id) { m_queryId = id; };
+    void setResponseId(uint16_t id) { m_responseId = id; };
+    void setIsotpRxId(uint16_t id) { m_isotpRxId = id; };
+    void setIsotpTxId(uint16_t id) { m_isotpTxId = id; };
+    void setIsotpBlockSize(uint8_t bs) { m_isotpBlockSize = bs; };
+    void setIsotpStMin(uint8_t st) { m_isotpStMin = st; };
+    void setAutoAddress(bool on) { m_autoAddress = on ? 1U : 0U; };
+    void setIdStride(uint16_t stride) { m_idStride = stride; };
+    void setTimeSyncId(uint16_t id) { m_timeSyncId = id; };
+};
+
 /* ---- NEW: flash format wrapper ---- */
 struct ConfigFlashImage
 {
     uint32_t magic;     // identifies valid config
     uint16_t version;   // bump when struct meaning changes
-    uint16_t size;      // sizeof(configAnalog)
-    uint32_t crc;       // CRC32 of configAnalog bytes
+    uint16_t size;      // payload size (analog + can)
+    uint32_t crc;       // CRC32 of the payload bytes
     configAnalog analog;
+    configCan can;
 };
 
 class config
 {
 private:
     configAnalog m_analogConfig;
+    configCan m_canConfig;
+    uint32_t m_canRevision; // bumped whenever m_canConfig is replaced
+    mutable mutex_t m_lock; // the config in RAM, only held to change or copy it
+    mutex_t m_saveLock;     // one save at a time, taken before m_lock
 
     bool isFlashValid() const;
-    void writeImageToFlash(const configAnalog& cfg);
+    bool writeImageToFlash(); // caller holds m_saveLock
+    void loadImage(const ConfigFlashImage &img);
 
 public:
     config();
 
     void loadConfigFromFlash();
-    void save();          // saves current m_analogConfig
-    void factoryReset();  // write defaults once on request
+    bool save();          // saves current m_analogConfig, false if flash did not take it
+    bool factoryReset();  // write defaults once on request
+
+    /* Runs edit, which changes the config through the setters, and saves the
+       result. The save lock is held throughout, so a save from another thread
+       can neither interleave with the store nor catch half the changes; the
+       config itself is only locked while edit runs and the image is copied */
+    template <typename Edit>
+    bool update(Edit &&edit)
+    {
+        chMtxLock(&m_saveLock);
+        apply(edit);
+        const bool saved = writeImageToFlash();
+        chMtxUnlock(&m_saveLock);
+        return saved;
+    }
+
+    /* Runs edit without saving, for threads that must not wait for the
+       flash; a later save() stores the result */
+    template <typename Edit>
+    void apply(Edit &&edit)
+    {
+        chMtxLock(&m_lock);
+        edit();
+        chMtxUnlock(&m_lock);
+    }
 
     const analogCal& getAnalogConfig(size_t idx) const { return m_analogConfig.getAnalogCal(idx); }
     const ntcCal& getNtcConfig(size_t idx) const { return m_analogConfig.getNtcCal(idx); }
@@ -88,6 +259,16 @@ public:
     void setAnalogConfig(size_t idx, const analogCal& cal) { m_analogConfig.writeAnalogCal(idx) = cal; };
     void setNtcConfig(size_t idx, const ntcCal& cal) { m_analogConfig.writeNtcCal(idx) = cal; };
     void setDigitalPullup(size_t idx, pullupVolt pu) { m_analogConfig.writePullup(idx, pu); };
+    // unlocked, for the thread that changes the CAN config; the CAN threads copy it
+    const configCan& getCanConfig() const { return m_canConfig; };
+    uint32_t getCanRevision() const { return m_canRevision; };
+    // a consistent copy, returns its revision
+    uint32_t copyCanConfig(configCan &cfg) const;
+    void setCanConfig(const configCan& cfg)
+    {
+        m_canConfig = cfg;
+        m_canRevision++;
+    };
 };
 
 config &getConfig();
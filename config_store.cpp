@@ -0,0 +1,131 @@
+#include "config_store.h"
+#include <cstring>
+
+constexpr uint32_t CFG_SEQUENCE_ERASED = 0xFFFFFFFFU;
+constexpr uint16_t CFG_COMMITTED = 0x0000;
+
+configStore::configStore(flashaddr_t base, uint8_t firstPage)
+{
+    m_base = base;
+    m_firstPage = firstPage;
+    m_current = nullptr;
+    m_next = 0;
+    m_sequence = 0;
+    m_erases = 0;
+}
+
+const configRecord *configStore::slot(size_t idx) const
+{
+    const size_t page = idx / CFG_SLOTS_PER_PAGE;
+    const size_t offset = (idx % CFG_SLOTS_PER_PAGE) * sizeof(configRecord);
+    return reinterpret_cast<const configRecord *>(m_base + page * FLASH_PAGE_SIZE + offset);
+}
+
+bool configStore::blank(flashaddr_t address, size_t size) const
+{
+    const uint32_t *p = reinterpret_cast<const uint32_t *>(address);
+
+    for (size_t i = 0; i < size / sizeof(uint32_t); i++)
+    {
+        if (p[i] != 0xFFFFFFFFU)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void configStore::scan(configValidator valid)
+{
+    size_t currentIdx = 0;
+
+    m_current = nullptr;
+    m_sequence = 0;
+    for (size_t idx = 0; idx < CFG_STORE_SLOTS; idx++)
+    {
+        const configRecord *rec = slot(idx);
+
+        // cheap checks first, the CRC only for a record that would win
+        if (rec->commit != CFG_COMMITTED || rec->sequence == CFG_SEQUENCE_ERASED ||
+            (m_current != nullptr && rec->sequence <= m_sequence) || !valid(rec->image))
+        {
+            continue;
+        }
+        m_current = rec;
+        m_sequence = rec->sequence;
+        currentIdx = idx;
+    }
+    m_next = (m_current != nullptr) ? (currentIdx + 1) % CFG_STORE_SLOTS : 0;
+}
+
+const ConfigFlashImage *configStore::findOlder(configValidator valid, size_t recordSize) const
+{
+    const ConfigFlashImage *newest = nullptr;
+    uint32_t newestSequence = 0;
+
+    for (size_t page = 0; page < CFG_STORE_PAGES; page++)
+    {
+        for (size_t i = 0; i < FLASH_PAGE_SIZE / recordSize; i++)
+        {
+            // same layout as configRecord, only the commit halfword moves with the size
+            const flashaddr_t address = m_base + page * FLASH_PAGE_SIZE + i * recordSize;
+            const uint32_t sequence = *reinterpret_cast<const uint32_t *>(address);
+            const uint16_t commit = *reinterpret_cast<const uint16_t *>(address + recordSize - 4);
+            const ConfigFlashImage *image = reinterpret_cast<const ConfigFlashImage *>(address + offsetof(configRecord, image));
+
+            if (commit != CFG_COMMITTED || sequence == CFG_SEQUENCE_ERASED ||
+                (newest != nullptr && sequence <= newestSequence) || !valid(*image))
+            {
+                continue;
+            }
+            newest = image;
+            newestSequence = sequence;
+        }
+    }
+    return newest;
+}
+
+bool configStore::append(const ConfigFlashImage &image)
+{
+    // commit and reserved stay erased until the record is complete
+    const configRecord rec{m_sequence + 1, image, 0xFFFF, 0xFFFF};
+
+    for (size_t tries = 0; tries < CFG_STORE_SLOTS; tries++)
+    {
+        const size_t idx = m_next;
+        const size_t page = idx / CFG_SLOTS_PER_PAGE;
+        const flashaddr_t address = reinterpret_cast<flashaddr_t>(slot(idx));
+        const flashaddr_t pageAddress = m_base + page * FLASH_PAGE_SIZE;
+        m_next = (idx + 1) % CFG_STORE_SLOTS;
+
+        // coming round to a page: everything in it is older than the
+        // current record, unless every other slot failed and it is the
+        // current record's own page
+        if (idx % CFG_SLOTS_PER_PAGE == 0 && !blank(pageAddress, FLASH_PAGE_SIZE))
+        {
+            if (m_current != nullptr && reinterpret_cast<flashaddr_t>(m_current) - pageAddress < FLASH_PAGE_SIZE)
+            {
+                continue;
+            }
+            Flash::ErasePage(static_cast<uint8_t>(m_firstPage + page));
+            m_erases++;
+        }
+        if (!blank(address, sizeof(configRecord)))
+        {
+            continue;
+        }
+
+        Flash::Write(address, reinterpret_cast<const uint8_t *>(&rec), offsetof(configRecord, commit));
+        if (std::memcmp(reinterpret_cast<const void *>(address), &rec, offsetof(configRecord, commit)) != 0)
+        {
+            continue; // worn or disturbed cell, the slot stays uncommitted
+        }
+        const uint16_t commit = CFG_COMMITTED;
+        Flash::Write(address + offsetof(configRecord, commit), reinterpret_cast<const uint8_t *>(&commit), sizeof(commit));
+
+        m_current = slot(idx);
+        m_sequence = rec.sequence;
+        return true;
+    }
+    return false;
+}
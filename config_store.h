@@ -0,0 +1,61 @@
+#pragma once
+#include "flash.h"
+#include "config.h"
+#include <cstdint>
+#include <cstddef>
+
+// pages 60..63, the top 8 KB of the 128 KB flash; the linker script
+// (cfg/STM32F072xB_cfgstore.ld) keeps the firmware below them
+constexpr uint8_t CFG_STORE_FIRST_PAGE = 60;
+constexpr size_t CFG_STORE_PAGES = 4;
+
+/* One saved config in the log. The commit halfword is programmed last, a
+   record without it was cut short and never counts. */
+struct configRecord
+{
+    uint32_t sequence; // counts saves, the highest valid record is the config
+    ConfigFlashImage image;
+    uint16_t commit;   // 0 once the record is complete
+    uint16_t reserved;
+};
+static_assert(sizeof(configRecord) % sizeof(flashdata_t) == 0);
+static_assert(offsetof(configRecord, commit) == sizeof(configRecord) - 4, "commit and reserved end the record");
+
+constexpr size_t CFG_SLOTS_PER_PAGE = FLASH_PAGE_SIZE / sizeof(configRecord);
+constexpr size_t CFG_STORE_SLOTS = CFG_SLOTS_PER_PAGE * CFG_STORE_PAGES;
+static_assert(CFG_SLOTS_PER_PAGE >= 2, "config record too large for the log store");
+
+using configValidator = bool (*)(const ConfigFlashImage &image);
+
+/* Append-only config log. Every save programs the next free slot, the
+   pages form a ring and a page is only erased when the log comes round to
+   it again, which drops records older than the current one and nothing
+   else. So only every CFG_SLOTS_PER_PAGE-th save pays for an erase, and the
+   erases rotate over all pages. A slot left half written by a reset is
+   skipped until its page is erased. */
+class configStore
+{
+private:
+    flashaddr_t m_base; // address of the first page
+    uint8_t m_firstPage;
+    const configRecord *m_current;
+    size_t m_next;      // slot the next record goes to
+    uint32_t m_sequence;
+    uint32_t m_erases;  // since boot
+
+    const configRecord *slot(size_t idx) const;
+    bool blank(flashaddr_t address, size_t size) const;
+
+public:
+    configStore(flashaddr_t base, uint8_t firstPage);
+    // finds the newest valid record, call once before anything else
+    void scan(configValidator valid);
+    // newest valid image, nullptr if the store holds none
+    const ConfigFlashImage *current() const { return m_current != nullptr ? &m_current->image : nullptr; };
+    // false if no slot could take the record, the current one stays
+    bool append(const ConfigFlashImage &image);
+    // newest image valid accepts in a log written with records of another
+    // size, so a bigger config can still carry over what the old one held
+    const ConfigFlashImage *findOlder(configValidator valid, size_t recordSize) const;
+    uint32_t erases() const { return m_erases; };
+};
@@ -0,0 +1,85 @@
+#include "crc.h"
+#include "hal.h"
+
+uint16_t crc16(const uint8_t *data, size_t len, uint16_t crc)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= static_cast<uint16_t>(data[i] << 8);
+        for (int b = 0; b < 8; b++)
+        {
+            crc = (crc & 0x8000u) ? static_cast<uint16_t>((crc << 1) ^ 0x1021u) : static_cast<uint16_t>(crc << 1);
+        }
+    }
+    return crc;
+}
+
+#if CRC_USE_HARDWARE
+#include "ch.h"
+
+// 0xEDB88320 unreflected, the unit shifts MSB first
+constexpr uint32_t CRC32_POLYNOMIAL = 0x04C11DB7u;
+
+static MUTEX_DECL(crcLock);
+
+static uint32_t reverseBits(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+    v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+/* The unit keeps the register unreflected: input bits are reversed per
+   byte, the output per word, and the running value goes in reversed as
+   well. Words are packed first byte on top since it is shifted in first. */
+uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc)
+{
+    chMtxLock(&crcLock);
+    rccEnableCRC(false);
+    CRC->POL = CRC32_POLYNOMIAL;
+    CRC->INIT = reverseBits(~crc);
+    CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET;
+
+    for (; len >= 4; len -= 4, data += 4)
+    {
+        CRC->DR = (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) |
+                  (static_cast<uint32_t>(data[2]) << 8) | data[3];
+    }
+    for (; len > 0; len--)
+    {
+        *reinterpret_cast<volatile uint8_t *>(&CRC->DR) = *data++;
+    }
+    crc = ~CRC->DR;
+    chMtxUnlock(&crcLock);
+    return crc;
+}
+#else
+#include <array>
+
+static constexpr std::array<uint32_t, 256> crc32Table = []
+{
+    std::array<uint32_t, 256> table = {};
+    for (uint32_t i = 0; i < table.size(); i++)
+    {
+        uint32_t c = i;
+        for (int b = 0; b < 8; b++)
+        {
+            c = (c & 1u) ? (c >> 1) ^ 0xEDB88320u : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}();
+
+uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = crc32Table[(crc ^ data[i]) & 0xFFu] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+#endif
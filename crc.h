@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+/* crc32 runs on the STM32F0 CRC unit. Set -DCRC_USE_HARDWARE=FALSE in
+   UDEFS for the table driven version, e.g. on a part without one. */
+#ifndef CRC_USE_HARDWARE
+#define CRC_USE_HARDWARE TRUE
+#endif
+
+/* CRC-16/CCITT-FALSE (polynomial 0x1021, init 0xFFFF, no reflection).
+   Pass the previous result as crc to continue over split buffers. */
+uint16_t crc16(const uint8_t *data, size_t len, uint16_t crc = 0xFFFF);
+
+/* CRC-32 as in zlib and Ethernet (reflected polynomial 0xEDB88320, init
+   and final xor 0xFFFFFFFF). Pass the previous result as crc to continue
+   over split buffers, 0 starts a new one. Thread context only, the
+   hardware version shares the CRC unit under a mutex. */
+uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc = 0);
@@ -1,15 +1,74 @@
 #include "flash.h"
 #include "hal.h"
+#include "ch.hpp"
+
+/* Copied to RAM with .data by the ChibiOS startup code, so these keep
+   running while the flash is busy instead of stalling on their own fetch.
+   They must not call anything that lives in flash. */
+#define FLASH_RAMFUNC __attribute__((section(".ramtext"), noinline, long_call))
+
+constexpr uint32_t FLASH_IRQ_PRIORITY = 3;
+constexpr uint32_t FLASH_SR_ERRORS = FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+
+static flashEngine engine;
+static MUTEX_DECL(flashOwner);
+static chibios_rt::BinarySemaphore flashDone(/* taken =*/true);
+
+flashEngine &getFlashEngine()
+{
+    return engine;
+}
 
 /**
  * @brief Wait for the flash operation to finish.
  */
-static void flashWaitWhileBusy()
+FLASH_RAMFUNC static void flashWaitWhileBusy()
 {
     while (FLASH->SR & FLASH_SR_BSY)
         ;
 }
 
+FLASH_RAMFUNC static void flashEraseRam(flashaddr_t address)
+{
+    // page erase mode
+    FLASH->CR |= FLASH_CR_PER;
+
+    // Set page address
+    FLASH->AR = address;
+
+    // Start the erase operation
+    FLASH->CR |= FLASH_CR_STRT;
+
+    // Must wait at least one cycle before reading FLASH_SR_BSY
+    __asm__ __volatile__("nop");
+
+    while (FLASH->SR & FLASH_SR_BSY)
+        ;
+
+    // clear page erase bit
+    FLASH->CR &= ~FLASH_CR_PER;
+}
+
+FLASH_RAMFUNC static void flashProgramRam(flashaddr_t address, const uint8_t *buffer, size_t count)
+{
+    /* Enter flash programming mode */
+    FLASH->CR |= FLASH_CR_PG;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        // byte wise, the buffer need not be halfword aligned
+        *(volatile flashdata_t *)address = static_cast<flashdata_t>(buffer[0] | (buffer[1] << 8));
+        address += sizeof(flashdata_t);
+        buffer += sizeof(flashdata_t);
+
+        while (FLASH->SR & FLASH_SR_BSY)
+            ;
+    }
+
+    /* Exit flash programming mode */
+    FLASH->CR &= ~FLASH_CR_PG;
+}
+
 static void flashUnlock()
 {
     /* Check if unlock is really needed */
@@ -26,67 +85,207 @@ static void flashLock()
     FLASH->CR |= FLASH_CR_LOCK;
 }
 
-void Flash::ErasePage(uint8_t pageIdx)
+static flashaddr_t pageAddress(uint8_t pageIdx)
 {
-    flashUnlock();
+    return static_cast<flashaddr_t>(pageIdx) * FLASH_PAGE_SIZE;
+}
 
-    // Wait for flash to be not busy
-    flashWaitWhileBusy();
+flashEngine::flashEngine()
+{
+    m_op = flashOp::idle;
+    m_page = 0;
+    m_address = 0;
+    m_data = nullptr;
+    m_left = 0;
+    m_done = nullptr;
+    m_context = nullptr;
+    m_started = false;
+}
 
-    // page erase mode
-    FLASH->CR |= FLASH_CR_PER;
+void flashEngine::start()
+{
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_ERRORS;
+    nvicEnableVector(FLASH_IRQn, FLASH_IRQ_PRIORITY);
+    m_started = true;
+}
 
-    // Set page number
-    FLASH->AR = pageIdx * 2048;
+bool flashEngine::erasePage(uint8_t page, flashCallback done, void *context)
+{
+    chSysLock();
+    if (m_op != flashOp::idle)
+    {
+        chSysUnlock();
+        return false;
+    }
+    m_page = page;
+    m_done = done;
+    m_context = context;
+    m_op = flashOp::erasePending;
+    chSysUnlock();
+    return true;
+}
 
-    // Start the erase operation
-    FLASH->CR |= FLASH_CR_STRT;
+bool flashEngine::program(flashaddr_t address, const uint8_t *data, size_t size, flashCallback done, void *context)
+{
+    chSysLock();
+    if (m_op != flashOp::idle)
+    {
+        chSysUnlock();
+        return false;
+    }
+    m_address = address;
+    m_data = data;
+    m_left = size / sizeof(flashdata_t);
+    m_done = done;
+    m_context = context;
+    m_op = flashOp::program;
+    flashUnlock();
+    FLASH->CR |= FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+    programNextI();
+    // an empty write is already done and may have woken someone
+    chSchRescheduleS();
+    chSysUnlock();
+    return true;
+}
 
-    // Must wait at least one cycle before reading FLASH_SR_BSY
-    __asm__ __volatile__("nop");
+void flashEngine::slot()
+{
+    chSysLock();
+    if (m_op == flashOp::erasePending)
+    {
+        startEraseI();
+    }
+    chSysUnlock();
+}
 
-    // Wait for flash to be not busy
-    flashWaitWhileBusy();
+void flashEngine::startEraseI()
+{
+    m_op = flashOp::erase;
+    flashUnlock();
+    FLASH->CR |= FLASH_CR_EOPIE | FLASH_CR_ERRIE | FLASH_CR_PER;
+    FLASH->AR = pageAddress(m_page);
+    FLASH->CR |= FLASH_CR_STRT;
+}
 
-    // clear page erase bit
-    FLASH->CR &= ~FLASH_CR_PER;
+// one halfword per interrupt, the CPU is free again between them
+void flashEngine::programNextI()
+{
+    if (m_left == 0U)
+    {
+        finishI(true);
+        return;
+    }
+    const flashdata_t value = static_cast<flashdata_t>(m_data[0] | (m_data[1] << 8));
+    FLASH->CR |= FLASH_CR_PG;
+    *(volatile flashdata_t *)m_address = value;
+    m_address += sizeof(flashdata_t);
+    m_data += sizeof(flashdata_t);
+    m_left--;
+}
 
-    // Relock flash
+void flashEngine::finishI(bool ok)
+{
+    FLASH->CR &= ~(FLASH_CR_PG | FLASH_CR_PER | FLASH_CR_EOPIE | FLASH_CR_ERRIE);
     flashLock();
+
+    const flashCallback done = m_done;
+    m_done = nullptr;
+    m_op = flashOp::idle;
+    if (done != nullptr)
+    {
+        done(ok, m_context);
+    }
 }
 
-static void flashWriteData(flashaddr_t address, const flashdata_t data)
+void flashEngine::interruptI()
 {
-    /* Enter flash programming mode */
-    FLASH->CR |= FLASH_CR_PG;
+    const uint32_t sr = FLASH->SR;
 
-    /* Write the data */
-    *(flashdata_t *)address = data;
+    // write one to clear
+    FLASH->SR = sr & (FLASH_SR_EOP | FLASH_SR_ERRORS);
+    if (sr & FLASH_SR_ERRORS)
+    {
+        finishI(false);
+        return;
+    }
+    if (!(sr & FLASH_SR_EOP))
+    {
+        return;
+    }
+    switch (m_op)
+    {
+    case flashOp::erase:
+        finishI(true);
+        break;
+    case flashOp::program:
+        programNextI();
+        break;
+    default:
+        break;
+    }
+}
 
-    /* Wait for completion */
-    flashWaitWhileBusy();
+extern "C"
+{
+    OSAL_IRQ_HANDLER(Vector4C)
+    {
+        OSAL_IRQ_PROLOGUE();
 
-    /* Exit flash programming mode */
-    FLASH->CR &= ~FLASH_CR_PG;
+        chSysLockFromISR();
+        engine.interruptI();
+        chSysUnlockFromISR();
+
+        OSAL_IRQ_EPILOGUE();
+    }
 }
 
-void Flash::Write(flashaddr_t address, const uint8_t *buffer, size_t size)
+void startFlash()
 {
-    /* Unlock flash for write access */
-    flashUnlock();
+    engine.start();
+}
 
-    /* Wait for any busy flags */
-    flashWaitWhileBusy();
+static void flashWaitDone(bool ok, void *context)
+{
+    (void)ok;
+    (void)context;
+    flashDone.signalI();
+}
 
-    // Copy data directly from buffer's data to flash
-    while (size >= sizeof(flashdata_t))
+void Flash::ErasePage(uint8_t pageIdx)
+{
+    if (!engine.started())
     {
-        flashWriteData(address, *(const flashdata_t *)buffer);
-        address += sizeof(flashdata_t);
-        buffer += sizeof(flashdata_t);
-        size -= sizeof(flashdata_t);
+        flashUnlock();
+        flashWaitWhileBusy();
+        flashEraseRam(pageAddress(pageIdx));
+        flashLock();
+        return;
     }
 
-    /* Lock flash again */
-    flashLock();
-}
\ No newline at end of file
+    chMtxLock(&flashOwner);
+    (void)engine.erasePage(pageIdx, flashWaitDone, nullptr);
+    // nobody hands out slots while sampling is stopped
+    if (flashDone.wait(TIME_MS2I(FLASH_SLOT_TIMEOUT_MS)) == MSG_TIMEOUT)
+    {
+        engine.slot();
+        flashDone.wait(TIME_INFINITE);
+    }
+    chMtxUnlock(&flashOwner);
+}
+
+void Flash::Write(flashaddr_t address, const uint8_t *buffer, size_t size)
+{
+    if (!engine.started())
+    {
+        flashUnlock();
+        flashWaitWhileBusy();
+        flashProgramRam(address, buffer, size / sizeof(flashdata_t));
+        flashLock();
+        return;
+    }
+
+    chMtxLock(&flashOwner);
+    (void)engine.program(address, buffer, size, flashWaitDone, nullptr);
+    flashDone.wait(TIME_INFINITE);
+    chMtxUnlock(&flashOwner);
+}
@@ -8,8 +8,67 @@ using flashaddr_t = uintptr_t;
 // f0 has only 16 bit program width
 using flashdata_t = uint16_t;
 
+constexpr size_t FLASH_PAGE_SIZE = 2048;
+// how long a queued erase waits for a sampling slot before it starts anyway
+constexpr uint32_t FLASH_SLOT_TIMEOUT_MS = 50;
+
+// ok is false on a programming or write protection error; called from the
+// flash interrupt, system locked
+using flashCallback = void (*)(bool ok, void *context);
+
+/* Interrupt driven erase and program. An operation is started here and
+   every further step runs from the end of operation interrupt, so the
+   caller never spins on BSY. The F0 has a single flash bank though: any
+   fetch from flash stalls until the flash is idle again, whatever waits
+   on it. So an erase, the one long stall, is held until the analog thread
+   reports a slot right after it restarted the ADC, and the DMA keeps
+   sampling through it. Programming only ever stalls for one halfword. */
+class flashEngine
+{
+private:
+    enum class flashOp : uint8_t
+    {
+        idle,
+        erasePending, // waiting for slot()
+        erase,
+        program
+    };
+
+    volatile flashOp m_op;
+    uint8_t m_page;
+    flashaddr_t m_address;
+    const uint8_t *m_data;
+    size_t m_left; // halfwords still to program
+    flashCallback m_done;
+    void *m_context;
+    bool m_started;
+
+    void startEraseI();
+    void programNextI();
+    void finishI(bool ok);
+
+public:
+    flashEngine();
+    void start();
+    bool started() const { return m_started; };
+    bool busy() const { return m_op != flashOp::idle; };
+    // false while another operation is running; done runs once it finished
+    bool erasePage(uint8_t page, flashCallback done, void *context);
+    // data has to stay valid until done runs
+    bool program(flashaddr_t address, const uint8_t *data, size_t size, flashCallback done, void *context);
+    // analog thread: a queued erase may stall the CPU now
+    void slot();
+    // flash interrupt
+    void interruptI();
+};
+
+flashEngine &getFlashEngine();
+void startFlash();
+
+/* Blocking erase and write for the config store: they run on the engine
+   and sleep until it is done, before startFlash they poll from RAM */
 struct Flash
 {
     static void ErasePage(uint8_t pageIndex);
     static void Write(flashaddr_t address, const uint8_t *buffer, size_t size);
-};
\ No newline at end of file
+};
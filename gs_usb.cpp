@@ -0,0 +1,349 @@
+#include "gs_usb.h"
+
+#if USE_GS_USB
+#include "can.h"
+#include <algorithm>
+#include <cstring>
+
+// endpoints and interface as laid out in usbcfg.c
+constexpr usbep_t GS_USB_IN_EP = 1;
+constexpr usbep_t GS_USB_OUT_EP = 2;
+constexpr size_t GS_USB_FRAME_SIZE = offsetof(gsHostFrame, timestamp);
+constexpr size_t GS_USB_FRAME_SIZE_TS = sizeof(gsHostFrame);
+
+// vendor requests of the Linux driver
+enum class gsRequest : uint8_t
+{
+    hostFormat = 0,
+    bittiming = 1,
+    mode = 2,
+    berr = 3,
+    btConst = 4,
+    deviceConfig = 5,
+    timestamp = 6,
+    identify = 7
+};
+
+constexpr uint32_t GS_CAN_MODE_START = 1;
+constexpr uint32_t GS_CAN_FEATURE_HW_TIMESTAMP = 1U << 4;
+constexpr uint32_t GS_CAN_FLAG_OVERFLOW = 1U << 0;
+constexpr uint32_t GS_CAN_EFF_FLAG = 0x80000000U;
+constexpr uint32_t GS_CAN_RTR_FLAG = 0x40000000U;
+constexpr uint32_t GS_CAN_ERR_FLAG = 0x20000000U;
+
+/* gs_device_bt_const: every range collapses to the one configured timing,
+   so the host's bit timing calculation fails for any other bitrate instead
+   of the adapter silently running at the wrong one */
+static const uint32_t btConst[10] = {
+    GS_CAN_FEATURE_HW_TIMESTAMP,
+    STM32_PCLK,
+    CAN_TSEG1, CAN_TSEG1,
+    CAN_TSEG2, CAN_TSEG2,
+    CAN_SJW,
+    CAN_BRP, CAN_BRP,
+    1};
+
+// gs_device_config: one channel, software and hardware version
+static const uint8_t deviceConfig[12] = {0, 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0};
+
+static gsUsbAdapter gsUsb;
+
+gsUsbAdapter &getGsUsb()
+{
+    return gsUsb;
+}
+
+static uint32_t getU32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void gsUsbControlDone(USBDriver *usbp)
+{
+    (void)usbp;
+    gsUsb.controlDone();
+}
+
+gsUsbAdapter::gsUsbAdapter()
+{
+    m_head = 0;
+    m_tail = 0;
+    m_used = 0;
+    m_out.fill(0);
+    m_control.fill(0);
+    m_timestamp = 0;
+    m_usbp = nullptr;
+    m_request = 0;
+    m_inBusy = false;
+    m_outArmed = false;
+    m_pending = false;
+    m_started = false;
+    m_timestamps = false;
+    m_timingOk = true;
+    m_overflow = false;
+}
+
+/* Control requests run in the USB interrupt without the lock, they only
+   point the driver at a buffer; OUT data is looked at in controlDone */
+bool gsUsbAdapter::request(USBDriver *usbp)
+{
+    if ((usbp->setup[0] & USB_RTYPE_TYPE_MASK) != USB_RTYPE_TYPE_VENDOR)
+    {
+        return false;
+    }
+    const size_t length = usbp->setup[6] | (usbp->setup[7] << 8);
+    m_request = usbp->setup[1];
+
+    switch (static_cast<gsRequest>(m_request))
+    {
+    case gsRequest::hostFormat:
+    case gsRequest::bittiming:
+    case gsRequest::mode:
+    case gsRequest::berr:
+    case gsRequest::identify:
+        usbSetupTransfer(usbp, m_control.data(), std::min(length, m_control.size()), gsUsbControlDone);
+        return true;
+    case gsRequest::btConst:
+        usbSetupTransfer(usbp, (uint8_t *)btConst, std::min(length, sizeof(btConst)), nullptr);
+        return true;
+    case gsRequest::deviceConfig:
+        usbSetupTransfer(usbp, (uint8_t *)deviceConfig, std::min(length, sizeof(deviceConfig)), nullptr);
+        return true;
+    case gsRequest::timestamp:
+        m_timestamp = chVTGetSystemTimeX();
+        usbSetupTransfer(usbp, (uint8_t *)&m_timestamp, std::min(length, sizeof(m_timestamp)), nullptr);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void gsUsbAdapter::controlDone()
+{
+    const uint8_t *data = m_control.data();
+
+    switch (static_cast<gsRequest>(m_request))
+    {
+    case gsRequest::bittiming:
+        // gs_device_bittiming: prop_seg, phase_seg1, phase_seg2, sjw, brp
+        m_timingOk = getU32(data) + getU32(data + 4) == CAN_TSEG1 &&
+                     getU32(data + 8) == CAN_TSEG2 && getU32(data + 16) == CAN_BRP;
+        break;
+    case gsRequest::mode:
+        // gs_device_mode: mode, flags
+        chSysLockFromISR();
+        m_started = getU32(data) == GS_CAN_MODE_START && m_timingOk;
+        m_timestamps = (getU32(data + 4) & GS_CAN_FEATURE_HW_TIMESTAMP) != 0U;
+        m_overflow = false;
+        m_pending = m_pending && m_started;
+        armOutI();
+        chSysUnlockFromISR();
+        break;
+    default:
+        break;
+    }
+}
+
+void gsUsbAdapter::configureI(USBDriver *usbp)
+{
+    m_usbp = usbp;
+    m_head = 0;
+    m_tail = 0;
+    m_used = 0;
+    m_inBusy = false;
+    m_outArmed = false;
+    m_pending = false;
+    m_started = false;
+    armOutI();
+}
+
+void gsUsbAdapter::suspendI()
+{
+    m_usbp = nullptr;
+    m_started = false;
+    m_inBusy = false;
+    m_outArmed = false;
+    m_pending = false;
+}
+
+gsHostFrame *gsUsbAdapter::pushI()
+{
+    if (m_used >= m_queue.size())
+    {
+        return nullptr;
+    }
+    gsHostFrame *f = &m_queue[m_head];
+    m_head = (m_head + 1) % m_queue.size();
+    m_used++;
+    return f;
+}
+
+void gsUsbAdapter::kickI()
+{
+    if (m_inBusy || m_used == 0U || m_usbp == nullptr || usbGetDriverStateI(m_usbp) != USB_ACTIVE)
+    {
+        return;
+    }
+    m_inBusy = true;
+    usbStartTransmitI(m_usbp, GS_USB_IN_EP, reinterpret_cast<const uint8_t *>(&m_queue[m_tail]),
+                      m_timestamps ? GS_USB_FRAME_SIZE_TS : GS_USB_FRAME_SIZE);
+}
+
+void gsUsbAdapter::armOutI()
+{
+    if (m_outArmed || m_pending || m_used >= m_queue.size() || m_usbp == nullptr ||
+        usbGetDriverStateI(m_usbp) != USB_ACTIVE)
+    {
+        return;
+    }
+    m_outArmed = true;
+    usbStartReceiveI(m_usbp, GS_USB_OUT_EP, m_out.data(), m_out.size());
+}
+
+void gsUsbAdapter::transmittedI()
+{
+    m_inBusy = false;
+    if (m_used > 0U)
+    {
+        m_tail = (m_tail + 1) % m_queue.size();
+        m_used--;
+    }
+    kickI();
+    armOutI();
+}
+
+void gsUsbAdapter::receivedI()
+{
+    m_outArmed = false;
+    if (m_started && m_usbp != nullptr && usbGetReceiveTransactionSizeX(m_usbp, GS_USB_OUT_EP) >= GS_USB_FRAME_SIZE)
+    {
+        m_pending = true;
+        transmitPendingI();
+    }
+    armOutI();
+}
+
+/* Host frame into a mailbox, echoed back as soon as it is queued there */
+void gsUsbAdapter::transmitPendingI()
+{
+    gsHostFrame host;
+    CANTxFrame tx = {};
+
+    memcpy(&host, m_out.data(), GS_USB_FRAME_SIZE);
+    if (host.canId & GS_CAN_ERR_FLAG)
+    {
+        m_pending = false;
+        return;
+    }
+    tx.IDE = (host.canId & GS_CAN_EFF_FLAG) ? CAN_IDE_EXT : CAN_IDE_STD;
+    tx.RTR = (host.canId & GS_CAN_RTR_FLAG) ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+    if (tx.IDE == CAN_IDE_EXT)
+    {
+        tx.EID = host.canId & 0x1FFFFFFFU;
+    }
+    else
+    {
+        tx.SID = host.canId & 0x7FFU;
+    }
+    tx.DLC = std::min<uint8_t>(host.dlc, 8);
+    memcpy(tx.data8, host.data, sizeof(host.data));
+
+    if (canTryTransmitI(&CAND1, CAN_ANY_MAILBOX, &tx))
+    {
+        return; // mailboxes full, canTxEmptyI tries again
+    }
+    m_pending = false;
+
+    gsHostFrame *echo = pushI();
+    if (echo != nullptr)
+    {
+        *echo = host;
+        echo->flags = 0;
+        echo->timestamp = chVTGetSystemTimeX();
+        kickI();
+    }
+}
+
+void gsUsbAdapter::canRxI(const CANRxFrame &frame, uint32_t stamp)
+{
+    if (!m_started)
+    {
+        return;
+    }
+    // the last slot belongs to the echo of the host frame in flight, OUT
+    // is only armed while a slot is free so that echo always finds room
+    if (m_used + 1U >= m_queue.size())
+    {
+        m_overflow = true;
+        return;
+    }
+    gsHostFrame *f = pushI();
+
+    f->echoId = GS_USB_ECHO_ID_RX;
+    f->canId = (frame.IDE == CAN_IDE_EXT) ? (frame.EID | GS_CAN_EFF_FLAG) : frame.SID;
+    f->canId |= (frame.RTR == CAN_RTR_REMOTE) ? GS_CAN_RTR_FLAG : 0U;
+    f->dlc = frame.DLC;
+    f->channel = 0;
+    f->flags = m_overflow ? GS_CAN_FLAG_OVERFLOW : 0U;
+    f->reserved = 0;
+    memcpy(f->data, frame.data8, sizeof(f->data));
+    f->timestamp = stamp;
+    m_overflow = false;
+    kickI();
+}
+
+void gsUsbAdapter::canTxEmptyI()
+{
+    if (m_pending)
+    {
+        transmitPendingI();
+        armOutI();
+    }
+}
+
+void gsUsbCanTxEmpty(CANDriver *canp, uint32_t flags)
+{
+    (void)canp;
+    (void)flags;
+
+    chSysLockFromISR();
+    gsUsb.canTxEmptyI();
+    chSysUnlockFromISR();
+}
+
+bool gsUsbRequestsHook(USBDriver *usbp)
+{
+    return gsUsb.request(usbp);
+}
+
+void gsUsbConfigureHookI(USBDriver *usbp)
+{
+    gsUsb.configureI(usbp);
+}
+
+void gsUsbSuspendHookI(USBDriver *usbp)
+{
+    (void)usbp;
+    gsUsb.suspendI();
+}
+
+void gsUsbDataTransmitted(USBDriver *usbp, usbep_t ep)
+{
+    (void)usbp;
+    (void)ep;
+
+    chSysLockFromISR();
+    gsUsb.transmittedI();
+    chSysUnlockFromISR();
+}
+
+void gsUsbDataReceived(USBDriver *usbp, usbep_t ep)
+{
+    (void)usbp;
+    (void)ep;
+
+    chSysLockFromISR();
+    gsUsb.receivedI();
+    chSysUnlockFromISR();
+}
+#endif
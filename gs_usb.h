@@ -0,0 +1,94 @@
+#pragma once
+#include "hal.h"
+#include "ch.h"
+#include "usbcfg.h"
+
+/* USB to CAN adapter speaking the gs_usb protocol (Linux gs_usb driver,
+   candleLight and friends), so the expander shows up as can0 next to its
+   CDC ports. Only built with USE_GS_USB, see usbcfg.h. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Hooks for usbcfg.c, called from the USB interrupt */
+bool gsUsbRequestsHook(USBDriver *usbp);
+void gsUsbConfigureHookI(USBDriver *usbp);
+void gsUsbSuspendHookI(USBDriver *usbp);
+void gsUsbDataTransmitted(USBDriver *usbp, usbep_t ep);
+void gsUsbDataReceived(USBDriver *usbp, usbep_t ep);
+
+#ifdef __cplusplus
+} /* extern "C" */
+
+#include <array>
+#include <cstdint>
+
+// frames buffered towards the host, one bulk transfer each
+constexpr size_t GS_USB_QUEUE_SIZE = 32;
+constexpr uint32_t GS_USB_ECHO_ID_RX = 0xFFFFFFFFU;
+
+/* gs_host_frame of the Linux driver, classic CAN. The timestamp is only
+   sent once the host asked for hardware timestamps. */
+struct gsHostFrame
+{
+    uint32_t echoId;
+    uint32_t canId; // SocketCAN id with the EFF/RTR/ERR flags
+    uint8_t dlc;
+    uint8_t channel;
+    uint8_t flags;
+    uint8_t reserved;
+    uint8_t data[8];
+    uint32_t timestamp; // us, the systime of the RX interrupt
+};
+static_assert(sizeof(gsHostFrame) == 24);
+
+/* Every received frame goes to the host with its RX stamp, frames from the
+   host go straight into a free mailbox and come back as echoes once they
+   are queued. Frames are queued back to back in the IN direction so the
+   endpoint never idles while there is traffic; the Linux driver takes one
+   frame per transfer, so that queue is all the batching there can be.
+   Runs entirely in the CAN and USB interrupts, all methods expect the
+   system locked. */
+class gsUsbAdapter
+{
+private:
+    std::array<gsHostFrame, GS_USB_QUEUE_SIZE> m_queue;
+    size_t m_head;  // next free slot
+    size_t m_tail;  // frame on the IN endpoint or next to go
+    size_t m_used;
+    std::array<uint8_t, 64> m_out; // one OUT packet, a host frame
+    std::array<uint8_t, 20> m_control;
+    uint32_t m_timestamp;
+    USBDriver *m_usbp;
+    uint8_t m_request;
+    bool m_inBusy;
+    bool m_outArmed;
+    bool m_pending; // host frame in m_out waiting for a mailbox
+    bool m_started;
+    bool m_timestamps;
+    bool m_timingOk;
+    bool m_overflow; // RX frames were dropped since the last one sent
+
+    gsHostFrame *pushI();
+    void kickI();
+    void armOutI();
+    void transmitPendingI();
+
+public:
+    gsUsbAdapter();
+    bool request(USBDriver *usbp);
+    void controlDone();
+    void configureI(USBDriver *usbp);
+    void suspendI();
+    void transmittedI();
+    void receivedI();
+    void canRxI(const CANRxFrame &frame, uint32_t stamp);
+    void canTxEmptyI();
+};
+
+gsUsbAdapter &getGsUsb();
+
+/* CAN driver callback, a mailbox became free */
+void gsUsbCanTxEmpty(CANDriver *canp, uint32_t flags);
+#endif
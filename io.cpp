@@ -107,7 +107,9 @@ inputs::inputs()
     : m_digitalInputs{{{GPIOB, 7}, {GPIOC, 13}, {GPIOC, 14}, {GPIOC, 15}}},
       m_analogInputs{{{GPIOA, 0}, {GPIOA, 1}, {GPIOA, 2}, {GPIOA, 3}, {GPIOA, 4}, {GPIOA, 5}}},
       m_analogTempInputs{{{GPIOA, 6}, {GPIOA, 7}, {GPIOB, 0}, {GPIOB, 1}}},
-      m_outputs{{{GPIOB, 15, 0}, {GPIOB, 14, 1}, {GPIOB, 13, 2}, {GPIOB, 12, 3}}}
+      m_outputs{{{GPIOB, 15, 0}, {GPIOB, 14, 1}, {GPIOB, 13, 2}, {GPIOB, 12, 3}}},
+      m_analogSampled(0),
+      m_digitalSampled(0)
 {
 }
 
@@ -117,6 +119,7 @@ void inputs::checkDigitalStates()
     {
         dig.checkState();
     }
+    m_digitalSampled = chVTGetSystemTimeX();
 }
 
 inputs &getInputs()
@@ -11,6 +11,10 @@ enum class scaleType : uint8_t
     x10000
 };
 
+// highest pin voltage the inputs can report: 3.3 V full scale behind the
+// 5k6/10k dividers
+constexpr uint16_t ANALOG_FULL_SCALE_MV = 5148;
+
 class digitalInput
 {
 private:
@@ -85,6 +89,8 @@ private:
     std::array<analogInput, 6> m_analogInputs;
     std::array<analogTempInput, 4> m_analogTempInputs;
     std::array<output, 4> m_outputs;
+    systime_t m_analogSampled;
+    systime_t m_digitalSampled;
 
 public:
     inputs();
@@ -100,6 +106,9 @@ public:
     void toggleOutput(uint8_t index, bool state) { m_outputs[index].toggleOutput(state); };
     bool getDigitalInputState(uint8_t index) const { return m_digitalInputs[index].getState(); };
     void checkDigitalStates();
+    void markAnalogSampled() { m_analogSampled = chVTGetSystemTimeX(); };
+    systime_t getAnalogSampleTime() const { return m_analogSampled; };
+    systime_t getDigitalSampleTime() const { return m_digitalSampled; };
 };
 
 inputs &getInputs();
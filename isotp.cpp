@@ -0,0 +1,265 @@
+#include "isotp.h"
+#include "can.h"
+#include <algorithm>
+
+isotpLink::isotpLink()
+{
+    m_buffer.fill(0);
+    m_state = isotpState::idle;
+    m_length = 0;
+    m_offset = 0;
+    m_sequence = 0;
+    m_blockLeft = 0;
+    m_blockSize = 0;
+    m_stMin = 0;
+    m_peerStMin = 0;
+    m_peerBlockSize = 0;
+    m_txId = 0;
+    m_deadline = 0;
+}
+
+void isotpLink::setup(uint16_t txId, uint8_t blockSize, uint8_t stMin)
+{
+    m_txId = txId;
+    m_blockSize = blockSize;
+    m_stMin = stMin;
+}
+
+// the deadline counts as reached for a while after it, so systime wrap is harmless
+bool isotpLink::due(systime_t now) const
+{
+    return chTimeIsInRangeX(now, m_deadline, chTimeAddX(m_deadline, TIME_MS2I(ISOTP_TIMEOUT_MS)));
+}
+
+bool isotpLink::sendFrame(const uint8_t *data, size_t len)
+{
+    CANTxFrame txmsg = {};
+
+    txmsg.IDE = CAN_IDE_STD;
+    txmsg.RTR = CAN_RTR_DATA;
+    txmsg.SID = m_txId;
+    txmsg.DLC = 8;
+    std::fill(std::begin(txmsg.data8), std::end(txmsg.data8), ISOTP_PADDING);
+    std::copy(data, data + len, txmsg.data8);
+    return canSend(txmsg, TIME_IMMEDIATE) == MSG_OK;
+}
+
+void isotpLink::sendFlowControl(isotpFlow flow)
+{
+    const uint8_t fc[] = {static_cast<uint8_t>((static_cast<uint8_t>(isotpFrame::flowControl) << 4) | static_cast<uint8_t>(flow)),
+                          m_blockSize, m_stMin};
+    sendFrame(fc, sizeof(fc));
+}
+
+bool isotpLink::receive(const CANRxFrame &rxmsg, systime_t now)
+{
+    if (rxmsg.DLC < 1)
+    {
+        return false;
+    }
+
+    switch (static_cast<isotpFrame>(rxmsg.data8[0] >> 4))
+    {
+    case isotpFrame::single:
+    {
+        const size_t len = rxmsg.data8[0] & 0x0F;
+        if (len == 0 || len > 7U || len + 1U > rxmsg.DLC)
+        {
+            return false;
+        }
+        std::copy(rxmsg.data8 + 1, rxmsg.data8 + 1 + len, m_buffer.begin());
+        m_length = len;
+        m_state = isotpState::idle;
+        return true;
+    }
+    case isotpFrame::first:
+    {
+        if (rxmsg.DLC < 8)
+        {
+            return false;
+        }
+        m_length = ((rxmsg.data8[0] & 0x0F) << 8) | rxmsg.data8[1];
+        if (m_length > m_buffer.size())
+        {
+            sendFlowControl(isotpFlow::overflow);
+            m_state = isotpState::idle;
+            return false;
+        }
+        std::copy(rxmsg.data8 + 2, rxmsg.data8 + 8, m_buffer.begin());
+        m_offset = 6;
+        m_sequence = 1;
+        m_blockLeft = m_blockSize;
+        m_state = isotpState::receiving;
+        m_deadline = chTimeAddX(now, TIME_MS2I(ISOTP_TIMEOUT_MS));
+        sendFlowControl(isotpFlow::continueToSend);
+        return false;
+    }
+    case isotpFrame::consecutive:
+    {
+        if (m_state != isotpState::receiving)
+        {
+            return false;
+        }
+        if ((rxmsg.data8[0] & 0x0F) != m_sequence)
+        {
+            // lost a frame, the tester has to start over
+            m_state = isotpState::idle;
+            return false;
+        }
+        const size_t chunk = std::min<size_t>(7, m_length - m_offset);
+        std::copy(rxmsg.data8 + 1, rxmsg.data8 + 1 + chunk, m_buffer.begin() + m_offset);
+        m_offset += chunk;
+        m_sequence = (m_sequence + 1) & 0x0F;
+        m_deadline = chTimeAddX(now, TIME_MS2I(ISOTP_TIMEOUT_MS));
+
+        if (m_offset >= m_length)
+        {
+            m_state = isotpState::idle;
+            return true;
+        }
+        if (m_blockSize != 0U && --m_blockLeft == 0U)
+        {
+            m_blockLeft = m_blockSize;
+            sendFlowControl(isotpFlow::continueToSend);
+        }
+        return false;
+    }
+    case isotpFrame::flowControl:
+    {
+        if (m_state != isotpState::waitFlowControl || rxmsg.DLC < 3)
+        {
+            return false;
+        }
+        switch (static_cast<isotpFlow>(rxmsg.data8[0] & 0x0F))
+        {
+        case isotpFlow::continueToSend:
+            m_peerBlockSize = rxmsg.data8[1];
+            m_peerStMin = isotpStMin(rxmsg.data8[2]);
+            m_blockLeft = m_peerBlockSize;
+            m_state = isotpState::sending;
+            m_deadline = now;
+            break;
+        case isotpFlow::wait:
+            m_deadline = chTimeAddX(now, TIME_MS2I(ISOTP_TIMEOUT_MS));
+            break;
+        default:
+            m_state = isotpState::idle;
+            break;
+        }
+        return false;
+    }
+    default:
+        return false;
+    }
+}
+
+void isotpLink::transmit(size_t len, systime_t now)
+{
+    m_length = std::min(len, m_buffer.size());
+
+    if (m_length <= 7U)
+    {
+        uint8_t sf[8];
+        sf[0] = static_cast<uint8_t>(m_length);
+        std::copy(m_buffer.begin(), m_buffer.begin() + m_length, sf + 1);
+        sendFrame(sf, m_length + 1);
+        m_state = isotpState::idle;
+        return;
+    }
+
+    uint8_t ff[8];
+    ff[0] = static_cast<uint8_t>((static_cast<uint8_t>(isotpFrame::first) << 4) | (m_length >> 8));
+    ff[1] = m_length & 0xFF;
+    std::copy(m_buffer.begin(), m_buffer.begin() + 6, ff + 2);
+    if (!sendFrame(ff, sizeof(ff)))
+    {
+        m_state = isotpState::idle;
+        return;
+    }
+    m_offset = 6;
+    m_sequence = 1;
+    m_state = isotpState::waitFlowControl;
+    m_deadline = chTimeAddX(now, TIME_MS2I(ISOTP_TIMEOUT_MS));
+}
+
+/* Consecutive frames go out as long as the peer's STmin allows and a mailbox
+   is free, a full mailbox just moves the next attempt to the following tick
+   rather than counting as a TX drop. The CAN TX thread can still take the
+   last mailbox between the look and the send, then the frame is retried
+   the same way. */
+void isotpLink::sendConsecutive(systime_t now)
+{
+    while (m_state == isotpState::sending)
+    {
+        chSysLock();
+        const bool mailboxFree = can_lld_is_tx_empty(&CAND1, CAN_ANY_MAILBOX);
+        chSysUnlock();
+        if (!mailboxFree)
+        {
+            m_deadline = chTimeAddX(now, 1);
+            return;
+        }
+
+        uint8_t cf[8];
+        const size_t chunk = std::min<size_t>(7, m_length - m_offset);
+        cf[0] = static_cast<uint8_t>((static_cast<uint8_t>(isotpFrame::consecutive) << 4) | m_sequence);
+        std::copy(m_buffer.begin() + m_offset, m_buffer.begin() + m_offset + chunk, cf + 1);
+        if (!sendFrame(cf, chunk + 1))
+        {
+            m_deadline = chTimeAddX(now, 1);
+            return;
+        }
+        m_offset += chunk;
+        m_sequence = (m_sequence + 1) & 0x0F;
+
+        if (m_offset >= m_length)
+        {
+            m_state = isotpState::idle;
+        }
+        else if (m_peerBlockSize != 0U && --m_blockLeft == 0U)
+        {
+            m_state = isotpState::waitFlowControl;
+            m_deadline = chTimeAddX(now, TIME_MS2I(ISOTP_TIMEOUT_MS));
+        }
+        else if (m_peerStMin != 0)
+        {
+            m_deadline = chTimeAddX(now, m_peerStMin);
+            return;
+        }
+    }
+}
+
+void isotpLink::poll(systime_t now)
+{
+    switch (m_state)
+    {
+    case isotpState::sending:
+        if (due(now))
+        {
+            sendConsecutive(now);
+        }
+        break;
+    case isotpState::receiving:
+    case isotpState::waitFlowControl:
+        if (due(now))
+        {
+            m_state = isotpState::idle;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+sysinterval_t isotpLink::idleTime(systime_t now) const
+{
+    if (m_state == isotpState::idle)
+    {
+        return TIME_INFINITE;
+    }
+    if (due(now))
+    {
+        return TIME_IMMEDIATE;
+    }
+    return chTimeDiffX(now, m_deadline);
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include "hal.h"
+#include "ch.h"
+#include <array>
+#include <span>
+#include <cstdint>
+
+constexpr size_t ISOTP_MAX_PAYLOAD = 160;   // one command byte + the calibration image
+constexpr uint32_t ISOTP_TIMEOUT_MS = 1000; // N_Bs / N_Cr
+constexpr uint8_t ISOTP_PADDING = 0xCC;
+
+enum class isotpFrame : uint8_t
+{
+    single = 0x0,
+    first = 0x1,
+    consecutive = 0x2,
+    flowControl = 0x3
+};
+
+enum class isotpFlow : uint8_t
+{
+    continueToSend = 0,
+    wait,
+    overflow
+};
+
+enum class isotpState : uint8_t
+{
+    idle = 0,
+    receiving,
+    waitFlowControl,
+    sending
+};
+
+/* STmin byte (ISO 15765-2): 0..127 ms, 0xF1..0xF9 100..900 us, anything else is 127 ms */
+constexpr sysinterval_t isotpStMin(uint8_t st)
+{
+    if (st <= 0x7F)
+    {
+        return TIME_MS2I(st);
+    }
+    if (st >= 0xF1 && st <= 0xF9)
+    {
+        return TIME_US2I((st - 0xF0) * 100U);
+    }
+    return TIME_MS2I(0x7F);
+}
+
+/* Half duplex ISO-TP link with normal 11 bit addressing. The request and its
+   response share one buffer, a new first frame aborts whatever is going on. */
+class isotpLink
+{
+private:
+    std::array<uint8_t, ISOTP_MAX_PAYLOAD> m_buffer;
+    isotpState m_state;
+    size_t m_length;
+    size_t m_offset;
+    uint8_t m_sequence;
+    uint8_t m_blockLeft;       // consecutive frames until the next flow control
+    uint8_t m_blockSize;       // what we grant the sender
+    uint8_t m_stMin;
+    sysinterval_t m_peerStMin; // what the receiver asked of us
+    uint8_t m_peerBlockSize;
+    uint16_t m_txId;
+    systime_t m_deadline;      // next consecutive frame or timeout
+
+    bool due(systime_t now) const;
+    bool sendFrame(const uint8_t *data, size_t len);
+    void sendFlowControl(isotpFlow flow);
+    void sendConsecutive(systime_t now);
+
+public:
+    isotpLink();
+    void setup(uint16_t txId, uint8_t blockSize, uint8_t stMin);
+    // true once a complete message sits in the buffer
+    bool receive(const CANRxFrame &rxmsg, systime_t now);
+    // send the first len bytes of the buffer
+    void transmit(size_t len, systime_t now);
+    void poll(systime_t now);
+    // how long the owner may block before poll() has work to do
+    sysinterval_t idleTime(systime_t now) const;
+    std::span<uint8_t> buffer() { return m_buffer; };
+    size_t length() const { return m_length; };
+    bool busy() const { return m_state != isotpState::idle; };
+};
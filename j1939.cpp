@@ -0,0 +1,116 @@
+#include "j1939.h"
+#include "util.h"
+#include "can.h"
+
+constexpr uint32_t J1939_CLAIM_WAIT_MS = 250;
+constexpr uint8_t J1939_DYNAMIC_FIRST = 128;
+constexpr uint8_t J1939_DYNAMIC_LAST = 247;
+
+/* NAME fields other than the identity number. No SAE manufacturer code
+   is assigned to us, so that field stays zero. */
+constexpr uint64_t J1939_NAME_FUNCTION = 0xFF;   // not specified
+constexpr uint64_t J1939_NAME_INDUSTRY_GROUP = 0; // global
+constexpr uint64_t J1939_NAME_ARBITRARY_ADDRESS = 1;
+
+j1939Node::j1939Node()
+{
+    const uint64_t identity = getUidHash() & 0x1FFFFF;
+
+    m_name = identity |
+             (J1939_NAME_FUNCTION << 40) |
+             (J1939_NAME_INDUSTRY_GROUP << 60) |
+             (J1939_NAME_ARBITRARY_ADDRESS << 63);
+    m_address = J1939_NULL_ADDRESS;
+    m_attempts = 0;
+    m_state = j1939State::idle;
+    m_claimTime = 0;
+}
+
+void j1939Node::sendClaim()
+{
+    CANTxFrame txmsg = {};
+    txmsg.IDE = CAN_IDE_EXT;
+    txmsg.RTR = CAN_RTR_DATA;
+    txmsg.DLC = 8;
+    txmsg.EID = j1939Id(J1939_DEFAULT_PRIORITY, J1939_PGN_ADDRESS_CLAIMED, J1939_GLOBAL_ADDRESS, m_address);
+    txmsg.data64[0] = m_name;
+
+    canSend(txmsg, TIME_MS2I(10));
+}
+
+/* J1939-21: the acknowledgment goes to the global address and names the
+   requester and the PGN it asked for */
+void j1939Node::sendNack(uint32_t pgn, uint8_t requester)
+{
+    CANTxFrame txmsg = {};
+    txmsg.IDE = CAN_IDE_EXT;
+    txmsg.RTR = CAN_RTR_DATA;
+    txmsg.DLC = 8;
+    txmsg.EID = j1939Id(J1939_DEFAULT_PRIORITY, J1939_PGN_ACKNOWLEDGMENT, J1939_GLOBAL_ADDRESS, m_address);
+    txmsg.data8[0] = J1939_NACK;
+    txmsg.data8[1] = 0xFF; // group function
+    txmsg.data8[2] = 0xFF;
+    txmsg.data8[3] = 0xFF;
+    txmsg.data8[4] = requester;
+    txmsg.data8[5] = pgn & 0xFF;
+    txmsg.data8[6] = (pgn >> 8) & 0xFF;
+    txmsg.data8[7] = (pgn >> 16) & 0x03;
+
+    canSend(txmsg, TIME_MS2I(10));
+}
+
+void j1939Node::start(uint8_t preferred)
+{
+    chSysLock();
+    m_address = (preferred < J1939_NULL_ADDRESS) ? preferred : J1939_DYNAMIC_FIRST;
+    m_attempts = 0;
+    m_state = j1939State::claimed;
+    m_claimTime = chVTGetSystemTimeX();
+    chSysUnlock();
+    sendClaim();
+}
+
+void j1939Node::handleAddressClaim(const CANRxFrame &rxmsg)
+{
+    if (m_state != j1939State::claimed || j1939Source(rxmsg.EID) != m_address || rxmsg.DLC < 8)
+    {
+        return;
+    }
+
+    const uint64_t theirs = rxmsg.data64[0];
+    if (theirs == m_name)
+    {
+        return;
+    }
+
+    // the lower NAME keeps the address
+    if (m_name < theirs)
+    {
+        sendClaim();
+        return;
+    }
+
+    chSysLock();
+    if (++m_attempts > (J1939_DYNAMIC_LAST - J1939_DYNAMIC_FIRST))
+    {
+        m_state = j1939State::cannotClaim;
+        m_address = J1939_NULL_ADDRESS;
+    }
+    else
+    {
+        m_address = (m_address >= J1939_DYNAMIC_FIRST && m_address < J1939_DYNAMIC_LAST) ? m_address + 1 : J1939_DYNAMIC_FIRST;
+        m_claimTime = chVTGetSystemTimeX();
+    }
+    chSysUnlock();
+    sendClaim();
+}
+
+uint8_t j1939Node::onlineAddress() const
+{
+    chSysLock();
+    const bool online = m_state == j1939State::claimed &&
+                        chTimeDiffX(m_claimTime, chVTGetSystemTimeX()) >= TIME_MS2I(J1939_CLAIM_WAIT_MS);
+    const uint8_t address = m_address;
+    chSysUnlock();
+    return online ? address : J1939_NULL_ADDRESS;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include "hal.h"
+#include "ch.h"
+#include <cstdint>
+
+constexpr uint32_t J1939_PGN_ACKNOWLEDGMENT = 0xE800;
+constexpr uint32_t J1939_PGN_REQUEST = 0xEA00;
+constexpr uint32_t J1939_PGN_ADDRESS_CLAIMED = 0xEE00;
+constexpr uint32_t J1939_PGN_PROPRIETARY_B = 0xFF00;
+constexpr uint8_t J1939_NULL_ADDRESS = 0xFE;
+constexpr uint8_t J1939_GLOBAL_ADDRESS = 0xFF;
+constexpr uint8_t J1939_DEFAULT_PRIORITY = 6;
+constexpr uint8_t J1939_NACK = 1; // acknowledgment control byte
+
+constexpr bool j1939IsPdu1(uint32_t pgn) { return ((pgn >> 8) & 0xFF) < 240; }
+
+/* 29 bit identifier: priority | DP | PF | PS (destination for PDU1) | SA */
+constexpr uint32_t j1939Id(uint8_t priority, uint32_t pgn, uint8_t dest, uint8_t source)
+{
+    if (j1939IsPdu1(pgn))
+    {
+        pgn = (pgn & 0x3FF00) | dest;
+    }
+    return (static_cast<uint32_t>(priority & 0x7) << 26) | ((pgn & 0x3FFFF) << 8) | source;
+}
+
+constexpr uint32_t j1939Pgn(uint32_t eid)
+{
+    const uint32_t pgn = (eid >> 8) & 0x3FFFF;
+    return j1939IsPdu1(pgn) ? (pgn & 0x3FF00) : pgn;
+}
+
+constexpr uint8_t j1939Source(uint32_t eid) { return eid & 0xFF; }
+
+constexpr uint8_t j1939Dest(uint32_t eid)
+{
+    return j1939IsPdu1((eid >> 8) & 0x3FFFF) ? ((eid >> 8) & 0xFF) : J1939_GLOBAL_ADDRESS;
+}
+
+/* Mask filter on the PF byte of extended frames */
+constexpr CANFilter j1939PfFilter(uint32_t bank, uint8_t pf)
+{
+    return CANFilter{
+        .filter = bank,
+        .mode = 0,
+        .scale = 1,
+        .assignment = 0,
+        .register1 = (static_cast<uint32_t>(pf) << 19) | (1U << 2),
+        .register2 = (0xFFU << 19) | (1U << 2)};
+}
+
+enum class j1939State : uint8_t
+{
+    idle = 0,
+    claimed,
+    cannotClaim
+};
+
+/* Address claim (J1939-81) for one arbitrary address capable ECU. start()
+   runs before the CAN threads, after that only the RX thread changes the
+   claim; it does so locked, so onlineAddress() is safe from other threads. */
+class j1939Node
+{
+private:
+    uint64_t m_name;
+    uint8_t m_address;
+    uint8_t m_attempts;
+    j1939State m_state;
+    systime_t m_claimTime;
+
+    void sendClaim();
+
+public:
+    j1939Node();
+    void start(uint8_t preferred);
+    void handleAddressClaim(const CANRxFrame &rxmsg);
+    void answerClaimRequest() { sendClaim(); };
+    // negative acknowledgment of a request for a PGN we do not send
+    void sendNack(uint32_t pgn, uint8_t requester);
+    // our address once the claim has stood, J1939_NULL_ADDRESS before
+    uint8_t onlineAddress() const;
+    // RX thread only
+    uint8_t address() const { return m_address; };
+};
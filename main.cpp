@@ -6,6 +6,7 @@
 #include "digitals.h"
 #include "usb_config.h"
 #include "config.h"
+#include "flash.h"
 
 int main(void) {
   halInit();
@@ -14,13 +15,15 @@ int main(void) {
 
   (void)getConfig();
   (void)getInputs();
+  // boot time flash writes above poll, everything later goes through the engine
+  startFlash();
 
 
   startAnalogSampling();
   startDigitals();
-  startCanThreads();
-
+  // USB first, CAN auto-addressing may hold startCanThreads for a while
   startUsb();
+  startCanThreads();
 
   while (true) {
     palTogglePad(GPIOA, 15);
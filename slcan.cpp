@@ -0,0 +1,443 @@
+#include "slcan.h"
+#include "usb_response.h"
+#include "usbcfg.h"
+#include "can.h"
+#include "api.h"
+#include "can_stats.h"
+#include <span>
+#include <algorithm>
+
+constexpr eventmask_t SLCAN_RX_EVENT = EVENT_MASK(0);
+constexpr char SLCAN_OK = '\r';
+constexpr char SLCAN_ERROR = '\a';
+// S0..S8
+constexpr std::array<uint32_t, 9> SLCAN_BITRATES = {10000, 20000, 50000, 100000, 125000,
+                                                     250000, 500000, 800000, 1000000};
+// status flag of the F command: frames were lost on the way to the host
+constexpr uint8_t SLCAN_FLAG_OVERRUN = 1U << 3;
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+static bool parseHex(const char *text, size_t digits, uint32_t &value)
+{
+    value = 0;
+    for (size_t i = 0; i < digits; i++)
+    {
+        const char c = text[i];
+        uint32_t nibble;
+        if (c >= '0' && c <= '9')
+        {
+            nibble = static_cast<uint32_t>(c - '0');
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            nibble = static_cast<uint32_t>(c - 'A' + 10);
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            nibble = static_cast<uint32_t>(c - 'a' + 10);
+        }
+        else
+        {
+            return false;
+        }
+        value = (value << 4) | nibble;
+    }
+    return true;
+}
+
+static size_t putHex(char *out, uint32_t value, size_t digits)
+{
+    for (size_t i = 0; i < digits; i++)
+    {
+        out[i] = hexDigits[(value >> (4 * (digits - 1 - i))) & 0xFU];
+    }
+    return digits;
+}
+
+static void reply(std::span<const char> text)
+{
+    usbResponse resp(&SDU1);
+    resp.bytes(std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(text.data()), text.size()));
+    resp.send();
+}
+
+static void reply(char c)
+{
+    reply(std::span<const char>(&c, 1));
+}
+
+slcanBridge::slcanBridge()
+{
+    m_line.fill(0);
+    m_lineFill = 0;
+    m_lineOverrun = false;
+    m_active = false;
+    m_open = false;
+    m_listenOnly = false;
+    m_timestamps = false;
+    m_thread = nullptr;
+}
+
+bool slcanBridge::isCommandStart(uint8_t byte)
+{
+    switch (byte)
+    {
+    case 'C':
+    case 'O':
+    case 'L':
+    case 'S':
+    case 'V':
+    case 'v':
+    case 'N':
+    case 'F':
+    case 'Z':
+        return true;
+    default:
+        return false;
+    }
+}
+
+void slcanBridge::enter()
+{
+    m_lineFill = 0;
+    m_lineOverrun = false;
+    m_timestamps = false;
+    m_active = true;
+}
+
+void slcanBridge::leave()
+{
+    close();
+    m_lineFill = 0;
+    m_active = false;
+}
+
+// what slcand and the usual tools send to set up a session
+bool slcanBridge::isSessionLine() const
+{
+    switch (m_line[0])
+    {
+    case 'C':
+    case 'O':
+    case 'L':
+    case 'V':
+    case 'v':
+    case 'N':
+    case 'F':
+        return m_lineFill == 1;
+    case 'S':
+    case 'Z':
+        return m_lineFill == 2;
+    default:
+        return false;
+    }
+}
+
+/* The line is collected on the side and only switches the port once its CR
+   arrives; a byte that cannot be part of it (opcodes are not ASCII) drops
+   it and goes to the opcode parser. */
+bool slcanBridge::sniff(uint8_t byte)
+{
+    if (m_lineFill == 0U && !isCommandStart(byte))
+    {
+        return false;
+    }
+    if (byte == '\r')
+    {
+        if (isSessionLine())
+        {
+            const size_t fill = m_lineFill;
+            enter();
+            m_lineFill = fill;
+            feed(byte);
+        }
+        m_lineFill = 0;
+        return true;
+    }
+    if (byte < 0x20U || byte > 0x7EU || m_lineFill == m_line.size())
+    {
+        m_lineFill = 0;
+        return false;
+    }
+    m_line[m_lineFill++] = static_cast<char>(byte);
+    return true;
+}
+
+bool slcanBridge::open(bool listenOnly)
+{
+    canRxStamped stale;
+
+    if (listenOnly && !canSilent(true))
+    {
+        return false;
+    }
+    while (m_rx.pop(stale))
+    {
+    }
+    m_rx.takeDropped();
+    m_listenOnly = listenOnly;
+    canAcceptAll(true);
+    chSysLock();
+    m_open = true;
+    chSysUnlock();
+    return true;
+}
+
+void slcanBridge::close()
+{
+    if (!m_open)
+    {
+        return;
+    }
+    chSysLock();
+    m_open = false;
+    chSysUnlock();
+    canAcceptAll(false);
+    if (m_listenOnly)
+    {
+        (void)canSilent(false);
+        m_listenOnly = false;
+    }
+}
+
+void slcanBridge::feed(uint8_t byte)
+{
+    // not ASCII, so it cannot be part of a Lawicel command
+    if (byte == static_cast<uint8_t>(apicommand::slcanMode))
+    {
+        leave();
+        return;
+    }
+    if (byte == '\r')
+    {
+        if (m_lineOverrun)
+        {
+            reply(SLCAN_ERROR);
+        }
+        else if (m_lineFill != 0U)
+        {
+            execute();
+        }
+        m_lineFill = 0;
+        m_lineOverrun = false;
+        return;
+    }
+    if (byte == '\n')
+    {
+        return;
+    }
+    if (m_lineFill < m_line.size())
+    {
+        m_line[m_lineFill++] = static_cast<char>(byte);
+    }
+    else
+    {
+        m_lineOverrun = true;
+    }
+}
+
+// t/T/r/R: id, length digit, data bytes for t/T
+bool slcanBridge::transmit()
+{
+    const char cmd = m_line[0];
+    const bool extended = cmd == 'T' || cmd == 'R';
+    const bool remote = cmd == 'r' || cmd == 'R';
+    const size_t idDigits = extended ? 8 : 3;
+    CANTxFrame tx = {};
+    uint32_t id = 0;
+    uint32_t dlc = 0;
+
+    if (!m_open || m_listenOnly || m_lineFill < 1 + idDigits + 1 ||
+        !parseHex(&m_line[1], idDigits, id) || !parseHex(&m_line[1 + idDigits], 1, dlc) || dlc > 8U)
+    {
+        return false;
+    }
+    const size_t dataDigits = remote ? 0U : dlc * 2;
+    if (m_lineFill != 1 + idDigits + 1 + dataDigits || id > (extended ? 0x1FFFFFFFU : 0x7FFU))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < dataDigits / 2; i++)
+    {
+        uint32_t b = 0;
+        if (!parseHex(&m_line[1 + idDigits + 1 + i * 2], 2, b))
+        {
+            return false;
+        }
+        tx.data8[i] = static_cast<uint8_t>(b);
+    }
+    tx.IDE = extended ? CAN_IDE_EXT : CAN_IDE_STD;
+    tx.RTR = remote ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+    if (extended)
+    {
+        tx.EID = id;
+    }
+    else
+    {
+        tx.SID = id;
+    }
+    tx.DLC = static_cast<uint8_t>(dlc);
+    return canSend(tx, TIME_IMMEDIATE) == MSG_OK;
+}
+
+void slcanBridge::execute()
+{
+    const char cmd = m_line[0];
+
+    switch (cmd)
+    {
+    case 'S':
+        // the bus runs at the firmware bit timing, only its code is accepted
+        if (!m_open && m_lineFill == 2 && m_line[1] >= '0' && m_line[1] <= '8' &&
+            SLCAN_BITRATES[static_cast<size_t>(m_line[1] - '0')] == CAN_BITRATE)
+        {
+            reply(SLCAN_OK);
+            return;
+        }
+        break;
+    case 'O':
+    case 'L':
+        if (!m_open && m_lineFill == 1 && open(cmd == 'L'))
+        {
+            reply(SLCAN_OK);
+            return;
+        }
+        break;
+    case 'C':
+        close();
+        reply(SLCAN_OK);
+        return;
+    case 't':
+    case 'r':
+    case 'T':
+    case 'R':
+        if (transmit())
+        {
+            reply(std::span<const char>(cmd == 't' || cmd == 'r' ? "z\r" : "Z\r", 2));
+            return;
+        }
+        break;
+    case 'Z':
+        if (m_lineFill == 2 && (m_line[1] == '0' || m_line[1] == '1'))
+        {
+            m_timestamps = m_line[1] == '1';
+            reply(SLCAN_OK);
+            return;
+        }
+        break;
+    case 'F':
+    {
+        const uint8_t flags = (m_rx.takeDropped() != 0U) ? SLCAN_FLAG_OVERRUN : 0U;
+        std::array<char, 4> text = {'F', hexDigits[flags >> 4], hexDigits[flags & 0xFU], SLCAN_OK};
+        reply(text);
+        return;
+    }
+    case 'V':
+    case 'v':
+        reply(std::span<const char>(cmd == 'V' ? "V1013\r" : "v1013\r", 6));
+        return;
+    case 'N':
+        reply(std::span<const char>("NIOEX\r", 6));
+        return;
+    case 'M':
+    case 'm':
+    case 'X':
+        // acceptance code/mask and auto poll: everything is forwarded anyway
+        reply(SLCAN_OK);
+        return;
+    default:
+        break;
+    }
+    reply(SLCAN_ERROR);
+}
+
+void slcanBridge::canRxI(const CANRxFrame &frame, uint32_t stamp)
+{
+    if (!m_open)
+    {
+        return;
+    }
+    m_rx.pushI(frame, stamp);
+    if (m_thread != nullptr)
+    {
+        chEvtSignalI(m_thread, SLCAN_RX_EVENT);
+    }
+}
+
+void slcanBridge::service()
+{
+    canRxStamped rx = {};
+    bool more = true;
+
+    while (more)
+    {
+        usbResponse resp(&SDU1, std::nullopt, TIME_MS2I(SLCAN_WRITE_TIMEOUT_MS));
+        if (!resp.valid())
+        {
+            // host not reading: keep the ring fresh rather than deliver old frames late
+            while (m_rx.pop(rx))
+            {
+            }
+            return;
+        }
+        // a full buffer means the ring may hold more for the next one
+        while (resp.room() >= SLCAN_MAX_FRAME_LINE)
+        {
+            if (!m_rx.pop(rx))
+            {
+                more = false;
+                break;
+            }
+            const CANRxFrame &f = rx.frame;
+            std::array<char, SLCAN_MAX_FRAME_LINE> line;
+            const bool extended = f.IDE == CAN_IDE_EXT;
+            const bool remote = f.RTR == CAN_RTR_REMOTE;
+            const size_t dlc = std::min<size_t>(f.DLC, 8);
+            size_t n = 0;
+
+            line[n++] = extended ? (remote ? 'R' : 'T') : (remote ? 'r' : 't');
+            n += extended ? putHex(&line[n], f.EID, 8) : putHex(&line[n], f.SID, 3);
+            line[n++] = hexDigits[dlc];
+            for (size_t i = 0; !remote && i < dlc; i++)
+            {
+                n += putHex(&line[n], f.data8[i], 2);
+            }
+            if (m_timestamps)
+            {
+                // Lawicel timestamps count milliseconds and wrap at 60 s
+                n += putHex(&line[n], (rx.stamp / 1000U) % 60000U, 4);
+            }
+            line[n++] = SLCAN_OK;
+            resp.bytes(std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(line.data()), n));
+        }
+        resp.send();
+    }
+}
+
+slcanBridge &getSlcan()
+{
+    static slcanBridge instance;
+    return instance;
+}
+
+static THD_WORKING_AREA(waSlcanThread, 512);
+static void SlcanThread(void *arg)
+{
+    (void)arg;
+    chRegSetThreadName("SLCAN Thread");
+
+    slcanBridge &bridge = getSlcan();
+
+    while (true)
+    {
+        chEvtWaitAny(SLCAN_RX_EVENT);
+        bridge.service();
+    }
+}
+
+void startSlcan()
+{
+    thread_t *thread = chThdCreateStatic(waSlcanThread, sizeof(waSlcanThread), NORMALPRIO + 1, SlcanThread, nullptr);
+    getSlcan().setThread(thread);
+}
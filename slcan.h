@@ -0,0 +1,63 @@
+#pragma once
+#include "ch.h"
+#include "hal.h"
+#include "can_time.h"
+#include <array>
+#include <cstdint>
+
+constexpr size_t SLCAN_RX_RING_SIZE = 32;
+// longest command: T, 8 id digits, length, 16 data digits
+constexpr size_t SLCAN_MAX_LINE = 1 + 8 + 1 + 16;
+// longest frame sent: the same, 4 timestamp digits and the CR
+constexpr size_t SLCAN_MAX_FRAME_LINE = SLCAN_MAX_LINE + 4 + 1;
+// how long a batch may wait for a free USB buffer before the ring is dropped
+constexpr uint32_t SLCAN_WRITE_TIMEOUT_MS = 50;
+
+/* Lawicel (SLCAN) ASCII protocol on the command port, so slcand and
+   friends can use the expander as a CAN adapter. The port switches over
+   on the slcanMode opcode or on a whole Lawicel command line seen where an
+   opcode is expected (they are all plain ASCII, opcodes are not), and
+   switches back on another slcanMode byte or when USB goes away. A stray
+   ASCII byte alone does not switch it.
+   Received frames are queued by the RX interrupt and written by the SLCAN
+   thread as many to a USB buffer as fit: whatever arrives while one
+   buffer is on the wire leaves together in the next. */
+class slcanBridge
+{
+private:
+    canRxRing<SLCAN_RX_RING_SIZE> m_rx;
+    std::array<char, SLCAN_MAX_LINE> m_line;
+    size_t m_lineFill;
+    bool m_lineOverrun;
+    bool m_active;  // the command port speaks SLCAN
+    bool m_open;    // channel open, received frames are forwarded
+    bool m_listenOnly;
+    bool m_timestamps;
+    thread_t *m_thread;
+
+    void execute();
+    bool transmit();
+    bool open(bool listenOnly);
+    void close();
+    bool isSessionLine() const;
+
+public:
+    slcanBridge();
+    // bytes that start a Lawicel command, recognised in place of an opcode
+    static bool isCommandStart(uint8_t byte);
+    bool active() const { return m_active; };
+    void enter();
+    void leave();
+    // USB thread, not active: one byte where an opcode is expected, false if it is not ours
+    bool sniff(uint8_t byte);
+    // USB thread: one byte of the command port
+    void feed(uint8_t byte);
+    // CAN RX interrupt, system locked
+    void canRxI(const CANRxFrame &frame, uint32_t stamp);
+    // SLCAN thread: writes the queued frames
+    void service();
+    void setThread(thread_t *thread) { m_thread = thread; };
+};
+
+slcanBridge &getSlcan();
+void startSlcan();
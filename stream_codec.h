@@ -0,0 +1,178 @@
+#pragma once
+#include <array>
+#include <span>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+
+/* Delta coding of the 0x14 stream packets. Kept free of ChibiOS so host
+   tools can include it for the reference decoder.
+
+   Packet: [0] 0x14, [1] record count, [2..5] channel mask, [6..7] sequence of
+   the record the first delta refers to, then the records. A record starts
+   with varint((sequence step << 1) | keyframe), the step counted from the
+   previous record. A keyframe holds the sample time and every value as
+   plain varints, a delta record the time step and the per-channel value
+   steps as zigzag varints. A keyframe is sent every N samples and after
+   any sample the host may not have seen. */
+constexpr size_t STREAM_CODEC_MAX_CHANNELS = 32;
+constexpr size_t STREAM_DELTA_HEADER = 1 + 1 + 4 + 2;
+
+inline size_t putVarint(uint8_t *out, uint32_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80U)
+    {
+        out[n++] = static_cast<uint8_t>(value | 0x80U);
+        value >>= 7;
+    }
+    out[n++] = static_cast<uint8_t>(value);
+    return n;
+}
+
+inline bool getVarint(std::span<const uint8_t> in, size_t &pos, uint32_t &value)
+{
+    value = 0;
+    for (unsigned shift = 0; shift < 35; shift += 7)
+    {
+        if (pos >= in.size())
+        {
+            return false;
+        }
+        const uint8_t byte = in[pos++];
+        value |= static_cast<uint32_t>(byte & 0x7FU) << shift;
+        if ((byte & 0x80U) == 0U)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+constexpr uint32_t zigzag(int32_t value)
+{
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+constexpr int32_t unzigzag(uint32_t value)
+{
+    return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1U);
+}
+
+class deltaEncoder
+{
+private:
+    std::array<uint16_t, STREAM_CODEC_MAX_CHANNELS> m_last;
+    uint32_t m_lastTime;
+    uint16_t m_lastSequence;
+    uint16_t m_sinceKey;
+    uint16_t m_keyInterval;
+    bool m_needKey;
+
+public:
+    // worst case record: header, time, 17-bit zigzag steps
+    static constexpr size_t maxRecord(size_t channels) { return 3 + 5 + 3 * channels; };
+
+    deltaEncoder() { reset(1); };
+    void reset(uint16_t keyInterval)
+    {
+        m_last.fill(0);
+        m_lastTime = 0;
+        m_lastSequence = 0;
+        m_sinceKey = 0;
+        m_keyInterval = (keyInterval == 0U) ? 1U : keyInterval;
+        m_needKey = true;
+    };
+    // the host missed something, the next record must stand on its own
+    void forceKey() { m_needKey = true; };
+    uint16_t lastSequence() const { return m_lastSequence; };
+
+    // writes one record to out (maxRecord bytes of room), returns its size
+    size_t encode(uint16_t sequence, uint32_t time, std::span<const uint16_t> values, uint8_t *out)
+    {
+        const bool key = m_needKey || m_sinceKey >= m_keyInterval;
+        const uint16_t step = static_cast<uint16_t>(sequence - m_lastSequence);
+        size_t n = putVarint(out, (static_cast<uint32_t>(step) << 1) | (key ? 1U : 0U));
+
+        n += putVarint(out + n, key ? time : time - m_lastTime);
+        for (size_t ch = 0; ch < values.size() && ch < STREAM_CODEC_MAX_CHANNELS; ch++)
+        {
+            n += putVarint(out + n, key ? values[ch] : zigzag(static_cast<int32_t>(values[ch]) - m_last[ch]));
+            m_last[ch] = values[ch];
+        }
+        m_lastTime = time;
+        m_lastSequence = sequence;
+        m_sinceKey = key ? 1U : static_cast<uint16_t>(m_sinceKey + 1U);
+        m_needKey = false;
+        return n;
+    };
+};
+
+/* Reference decoder for host tools. Records after a lost packet are
+   skipped until the next keyframe. */
+class deltaDecoder
+{
+private:
+    std::array<uint16_t, STREAM_CODEC_MAX_CHANNELS> m_last;
+    uint32_t m_lastTime;
+    uint16_t m_lastSequence;
+    bool m_synced;
+
+public:
+    deltaDecoder() : m_lastTime(0), m_lastSequence(0), m_synced(false) { m_last.fill(0); };
+
+    // calls sink(sequence, time, span<const uint16_t> values) per decoded record,
+    // false if the packet is malformed
+    template <typename Sink>
+    bool decode(std::span<const uint8_t> packet, Sink &&sink)
+    {
+        if (packet.size() < STREAM_DELTA_HEADER)
+        {
+            return false;
+        }
+        const size_t count = packet[1];
+        const uint32_t mask = packet[2] | (packet[3] << 8) | (packet[4] << 16) | (static_cast<uint32_t>(packet[5]) << 24);
+        const size_t channels = static_cast<size_t>(std::popcount(mask));
+        uint16_t sequence = static_cast<uint16_t>(packet[6] | (packet[7] << 8));
+        size_t pos = STREAM_DELTA_HEADER;
+
+        // the first delta only applies on top of the record it was coded against
+        if (sequence != m_lastSequence)
+        {
+            m_synced = false;
+        }
+        for (size_t r = 0; r < count; r++)
+        {
+            uint32_t head = 0;
+            uint32_t time = 0;
+            std::array<uint16_t, STREAM_CODEC_MAX_CHANNELS> values = {};
+
+            if (!getVarint(packet, pos, head) || !getVarint(packet, pos, time))
+            {
+                return false;
+            }
+            const bool key = (head & 1U) != 0U;
+            for (size_t ch = 0; ch < channels && ch < STREAM_CODEC_MAX_CHANNELS; ch++)
+            {
+                uint32_t v = 0;
+                if (!getVarint(packet, pos, v))
+                {
+                    return false;
+                }
+                values[ch] = key ? static_cast<uint16_t>(v) : static_cast<uint16_t>(m_last[ch] + unzigzag(v));
+            }
+            sequence = static_cast<uint16_t>(sequence + (head >> 1));
+            time = key ? time : m_lastTime + time;
+            m_synced = m_synced || key;
+
+            m_last = values;
+            m_lastTime = time;
+            m_lastSequence = sequence;
+            if (m_synced)
+            {
+                sink(sequence, time, std::span<const uint16_t>(values.data(), channels));
+            }
+        }
+        return pos == packet.size();
+    };
+};
@@ -0,0 +1,23 @@
+#pragma once
+/* Shared by the host tests: CHECK prints the condition that failed and
+   carries on, checkResult() gives main() its summary line and exit code. */
+#include <cstdio>
+#include <cstdlib>
+
+inline int failures = 0;
+
+#define CHECK(cond)                                                       \
+    do                                                                    \
+    {                                                                     \
+        if (!(cond))                                                      \
+        {                                                                 \
+            std::printf("%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+inline int checkResult(const char *name)
+{
+    std::printf("%s %s\n", name, failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,362 @@
+/* configStore against a RAM model of pages 60..63. The model programs like
+   the F0 (halfwords only, a programmed halfword can only be cleared to 0,
+   anything else is a PGERR) and can cut the power after any halfword.
+   Times are the datasheet worst cases: 40 ms a page erase, 70 us a
+   halfword. */
+#include "config_store.h"
+#include "check.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+constexpr uint32_t ERASE_US = 40000;
+constexpr uint32_t PROGRAM_US = 70;
+constexpr uint32_t TEST_MAGIC = 0x43464731;
+// the record up to the commit halfword, then the commit, reserved stays erased
+constexpr size_t SAVE_HALFWORDS = offsetof(configRecord, commit) / sizeof(flashdata_t) + 1;
+
+/* ---- flash model ---- */
+
+alignas(4) static uint8_t flashMem[CFG_STORE_PAGES * FLASH_PAGE_SIZE];
+static std::array<uint32_t, CFG_STORE_PAGES> pageErases;
+static uint32_t programmed;  // halfwords
+static uint32_t busyUs;      // flash time since the last reset of the counter
+static long powerCutAfter;   // halfwords until the supply fails, -1 never
+static bool powerLost;
+static bool programError;
+
+static flashaddr_t flashBase()
+{
+    return reinterpret_cast<flashaddr_t>(flashMem);
+}
+
+static void resetFlash(uint8_t fill)
+{
+    std::memset(flashMem, fill, sizeof(flashMem));
+    pageErases.fill(0);
+    programmed = 0;
+    busyUs = 0;
+    powerCutAfter = -1;
+    powerLost = false;
+    programError = false;
+}
+
+void Flash::ErasePage(uint8_t pageIndex)
+{
+    if (powerLost)
+    {
+        return;
+    }
+    const size_t page = pageIndex - CFG_STORE_FIRST_PAGE;
+    if (page >= CFG_STORE_PAGES)
+    {
+        programError = true;
+        return;
+    }
+    std::memset(flashMem + page * FLASH_PAGE_SIZE, 0xFF, FLASH_PAGE_SIZE);
+    pageErases[page]++;
+    busyUs += ERASE_US;
+}
+
+void Flash::Write(flashaddr_t address, const uint8_t *buffer, size_t size)
+{
+    for (size_t i = 0; i + 1 < size; i += 2)
+    {
+        if (powerLost || powerCutAfter == 0)
+        {
+            powerLost = true;
+            return;
+        }
+        if (powerCutAfter > 0)
+        {
+            powerCutAfter--;
+        }
+        flashdata_t *cell = reinterpret_cast<flashdata_t *>(address + i);
+        flashdata_t value;
+        std::memcpy(&value, buffer + i, sizeof(value));
+        if (*cell != 0xFFFF && value != 0)
+        {
+            programError = true;
+            continue;
+        }
+        *cell = value;
+        programmed++;
+        busyUs += PROGRAM_US;
+    }
+}
+
+/* ---- images ---- */
+
+// images are plain bytes here, the config constructors live in config.cpp
+struct testImage
+{
+    alignas(ConfigFlashImage) uint8_t raw[sizeof(ConfigFlashImage)];
+
+    const ConfigFlashImage &get() const { return *reinterpret_cast<const ConfigFlashImage *>(raw); }
+};
+
+static uint32_t payloadSum(const uint8_t *raw)
+{
+    uint32_t sum = 0;
+    for (size_t i = offsetof(ConfigFlashImage, analog); i < sizeof(ConfigFlashImage); i++)
+    {
+        sum = sum * 31U + raw[i];
+    }
+    return sum;
+}
+
+static testImage makeImage(uint32_t n)
+{
+    testImage img;
+    for (size_t i = 0; i < sizeof(img.raw); i++)
+    {
+        img.raw[i] = static_cast<uint8_t>(n * 13U + i);
+    }
+    const uint32_t magic = TEST_MAGIC;
+    std::memcpy(img.raw + offsetof(ConfigFlashImage, magic), &magic, sizeof(magic));
+    std::memcpy(img.raw + offsetof(ConfigFlashImage, version), &n, sizeof(uint16_t));
+    const uint32_t sum = payloadSum(img.raw);
+    std::memcpy(img.raw + offsetof(ConfigFlashImage, crc), &sum, sizeof(sum));
+    return img;
+}
+
+static bool imageValid(const ConfigFlashImage &image)
+{
+    const uint8_t *raw = reinterpret_cast<const uint8_t *>(&image);
+    uint32_t magic;
+    uint32_t sum;
+    std::memcpy(&magic, raw + offsetof(ConfigFlashImage, magic), sizeof(magic));
+    std::memcpy(&sum, raw + offsetof(ConfigFlashImage, crc), sizeof(sum));
+    return magic == TEST_MAGIC && sum == payloadSum(raw);
+}
+
+static uint16_t imageNumber(const ConfigFlashImage *image)
+{
+    uint16_t n;
+    std::memcpy(&n, reinterpret_cast<const uint8_t *>(image) + offsetof(ConfigFlashImage, version), sizeof(n));
+    return n;
+}
+
+// what a reboot sees
+static const ConfigFlashImage *rescan()
+{
+    configStore store(flashBase(), CFG_STORE_FIRST_PAGE);
+    store.scan(imageValid);
+    return store.current();
+}
+
+/* ---- tests ---- */
+
+static void testBlankStore()
+{
+    resetFlash(0xFF);
+    configStore store(flashBase(), CFG_STORE_FIRST_PAGE);
+    store.scan(imageValid);
+    CHECK(store.current() == nullptr);
+
+    const testImage img = makeImage(1);
+    CHECK(store.append(img.get()));
+    CHECK(store.current() != nullptr && imageNumber(store.current()) == 1);
+    CHECK(store.erases() == 0);
+    CHECK(rescan() != nullptr && imageNumber(rescan()) == 1);
+    CHECK(!programError);
+}
+
+// leftovers of an older firmware: every page has to be erased before use
+static void testJunkFlash()
+{
+    resetFlash(0xAB);
+    configStore store(flashBase(), CFG_STORE_FIRST_PAGE);
+    store.scan(imageValid);
+    CHECK(store.current() == nullptr);
+
+    for (uint32_t n = 1; n <= CFG_STORE_SLOTS; n++)
+    {
+        const testImage img = makeImage(n);
+        CHECK(store.append(img.get()));
+    }
+    CHECK(imageNumber(rescan()) == CFG_STORE_SLOTS);
+    for (uint32_t e : pageErases)
+    {
+        CHECK(e == 1);
+    }
+    CHECK(!programError);
+}
+
+// the ring wraps several times, sequence and reboot keep the newest record
+static void testWraparound()
+{
+    resetFlash(0xFF);
+    configStore store(flashBase(), CFG_STORE_FIRST_PAGE);
+    store.scan(imageValid);
+
+    for (uint32_t n = 1; n <= 3 * CFG_STORE_SLOTS + 2; n++)
+    {
+        const testImage img = makeImage(n);
+        CHECK(store.append(img.get()));
+        CHECK(imageNumber(rescan()) == n);
+
+        // a reboot in the middle of the ring continues where it left off
+        if (n == CFG_STORE_SLOTS + 3)
+        {
+            store = configStore(flashBase(), CFG_STORE_FIRST_PAGE);
+            store.scan(imageValid);
+            CHECK(imageNumber(store.current()) == n);
+        }
+    }
+    CHECK(!programError);
+}
+
+// erases spread evenly, one at most per save, and the cost of a save
+static void testWearAndLatency()
+{
+    constexpr uint32_t SAVES = 1000;
+
+    resetFlash(0xFF);
+    configStore store(flashBase(), CFG_STORE_FIRST_PAGE);
+    store.scan(imageValid);
+
+    uint32_t worstUs = 0;
+    uint32_t lastErases = 0;
+    for (uint32_t n = 1; n <= SAVES; n++)
+    {
+        const testImage img = makeImage(n);
+        busyUs = 0;
+        CHECK(store.append(img.get()));
+        worstUs = std::max(worstUs, busyUs);
+        CHECK(store.erases() - lastErases <= 1U);
+        lastErases = store.erases();
+    }
+
+    uint32_t total = 0;
+    for (uint32_t e : pageErases)
+    {
+        total += e;
+    }
+    // the first lap finds blank pages
+    CHECK(total == (SAVES - 1) / CFG_SLOTS_PER_PAGE - (CFG_STORE_PAGES - 1));
+    for (uint32_t e : pageErases)
+    {
+        CHECK(e + 1U >= total / CFG_STORE_PAGES && e <= total / CFG_STORE_PAGES + 1U);
+    }
+    CHECK(programmed == SAVES * SAVE_HALFWORDS);
+    CHECK(worstUs == ERASE_US + SAVE_HALFWORDS * PROGRAM_US);
+    CHECK(!programError);
+
+    std::printf("  %u saves: %u erases (%u %u %u %u), %zu halfwords a save, worst save %u us\n",
+                SAVES, total, pageErases[0], pageErases[1], pageErases[2], pageErases[3], SAVE_HALFWORDS,
+                worstUs);
+}
+
+// power lost after every possible halfword of a save, twice round the ring
+static void testTornRecords()
+{
+    resetFlash(0xFF);
+    uint32_t saved = 0;
+
+    for (size_t cut = 0; cut < 2 * CFG_STORE_SLOTS * 4; cut++)
+    {
+        configStore store(flashBase(), CFG_STORE_FIRST_PAGE);
+        store.scan(imageValid);
+        CHECK(saved == 0 || (store.current() != nullptr && imageNumber(store.current()) == saved));
+
+        // cut spread over the record, the commit halfword included
+        powerCutAfter = static_cast<long>((cut * 37) % (SAVE_HALFWORDS + 1));
+        const testImage img = makeImage(saved + 1);
+        const bool ok = store.append(img.get());
+        const bool lost = powerLost;
+        powerLost = false;
+        powerCutAfter = -1;
+
+        if (!lost)
+        {
+            CHECK(ok);
+            saved++;
+        }
+        const ConfigFlashImage *current = rescan();
+        CHECK(saved == 0 ? current == nullptr : current != nullptr && imageNumber(current) == saved);
+    }
+    CHECK(!programError);
+}
+
+// a committed record that no longer validates falls back to the one before
+static void testCorruptRecord()
+{
+    resetFlash(0xFF);
+    configStore store(flashBase(), CFG_STORE_FIRST_PAGE);
+    store.scan(imageValid);
+    for (uint32_t n = 1; n <= 3; n++)
+    {
+        const testImage img = makeImage(n);
+        CHECK(store.append(img.get()));
+    }
+
+    // a bit of the newest record's payload decays
+    uint8_t *newest = flashMem + 2 * sizeof(configRecord) + offsetof(configRecord, image) +
+                      offsetof(ConfigFlashImage, analog) + 5;
+    *newest ^= 0x01;
+    CHECK(imageNumber(rescan()) == 2);
+}
+
+// a log written with smaller records, as an older version would have left it
+static void testOlderRecords()
+{
+    constexpr size_t OLD_RECORD_SIZE = sizeof(configRecord) - 20;
+    constexpr size_t OLD_IMAGE_SIZE = OLD_RECORD_SIZE - offsetof(configRecord, image) - 4;
+    const size_t perPage = FLASH_PAGE_SIZE / OLD_RECORD_SIZE;
+
+    resetFlash(0xFF);
+    auto writeOld = [&](size_t idx, uint32_t sequence, uint32_t n, bool committed)
+    {
+        uint8_t *rec = flashMem + (idx / perPage) * FLASH_PAGE_SIZE + (idx % perPage) * OLD_RECORD_SIZE;
+        const testImage img = makeImage(n);
+        const uint16_t commit = committed ? 0x0000 : 0xFFFF;
+        std::memcpy(rec, &sequence, sizeof(sequence));
+        std::memcpy(rec + offsetof(configRecord, image), img.raw, OLD_IMAGE_SIZE);
+        std::memcpy(rec + OLD_RECORD_SIZE - 4, &commit, sizeof(commit));
+    };
+    // only the header is left to check in a cut-down image
+    auto oldValid = [](const ConfigFlashImage &image)
+    {
+        uint32_t magic;
+        std::memcpy(&magic, reinterpret_cast<const uint8_t *>(&image) + offsetof(ConfigFlashImage, magic), sizeof(magic));
+        return magic == TEST_MAGIC;
+    };
+
+    // the newest committed record wins, wherever it sits; 7 was cut short
+    for (uint32_t n = 1; n <= 7; n++)
+    {
+        writeOld(n - 1, n, n, n != 7);
+    }
+    writeOld(perPage * 2 + 1, 8, 8, true);
+
+    configStore store(flashBase(), CFG_STORE_FIRST_PAGE);
+    store.scan(imageValid);
+    CHECK(store.current() == nullptr);
+    const ConfigFlashImage *older = store.findOlder(oldValid, OLD_RECORD_SIZE);
+    CHECK(older != nullptr && imageNumber(older) == 8);
+
+    // the first record in the new size makes room for itself
+    const testImage img = makeImage(20);
+    CHECK(store.append(img.get()));
+    CHECK(imageNumber(rescan()) == 20);
+    CHECK(!programError);
+}
+
+int main()
+{
+    std::printf("record %zu bytes, %zu slots a page, %zu slots\n", sizeof(configRecord), CFG_SLOTS_PER_PAGE,
+                CFG_STORE_SLOTS);
+
+    testBlankStore();
+    testJunkFlash();
+    testWraparound();
+    testWearAndLatency();
+    testTornRecords();
+    testCorruptRecord();
+    testOlderRecords();
+
+    return checkResult("config_store_test");
+}
@@ -0,0 +1,157 @@
+/* crc32 bit for bit: the table version from crc.cpp (built with
+   CRC_USE_HARDWARE=FALSE), the bitwise loop config.cpp used before it and a
+   model of the F0 CRC unit fed the way the hardware version programs it.
+   Every length up to a few words, every split point for continuation. */
+#include "crc.h"
+#include "check.h"
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// the original config CRC
+static uint32_t crc32Bitwise(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int b = 0; b < 8; b++)
+        {
+            uint32_t mask = -(crc & 1u);
+            crc = (crc >> 1) ^ (0xEDB88320u & mask);
+        }
+    }
+    return ~crc;
+}
+
+static uint8_t reverse8(uint8_t v)
+{
+    uint8_t r = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        r |= ((v >> i) & 1u) << (7 - i);
+    }
+    return r;
+}
+
+static uint32_t reverse32(uint32_t v)
+{
+    uint32_t r = 0;
+    for (int i = 0; i < 32; i++)
+    {
+        r |= ((v >> i) & 1u) << (31 - i);
+    }
+    return r;
+}
+
+/* The F0 CRC unit as RM0091 describes it: an MSB first shift register,
+   REV_IN_0 reverses each input byte, REV_OUT the whole output word. A
+   32 bit DR write shifts its top byte in first, a byte write just the one. */
+class crcUnit
+{
+private:
+    uint32_t m_reg;
+    uint32_t m_poly;
+
+    void shift(uint32_t value, int bits)
+    {
+        for (int i = bits - 1; i >= 0; i--)
+        {
+            const uint32_t top = (m_reg >> 31) ^ ((value >> i) & 1u);
+            m_reg <<= 1;
+            if (top != 0u)
+            {
+                m_reg ^= m_poly;
+            }
+        }
+    }
+
+public:
+    crcUnit(uint32_t poly, uint32_t init) : m_reg(init), m_poly(poly) {}
+
+    void write32(uint32_t v)
+    {
+        uint32_t in = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            in |= static_cast<uint32_t>(reverse8(static_cast<uint8_t>(v >> (8 * k)))) << (8 * k);
+        }
+        shift(in, 32);
+    }
+    void write8(uint8_t v) { shift(reverse8(v), 8); }
+    uint32_t read() const { return reverse32(m_reg); }
+};
+
+// the register sequence of the CRC_USE_HARDWARE version of crc32()
+static uint32_t crc32Unit(const uint8_t *data, size_t len, uint32_t crc = 0)
+{
+    crcUnit unit(0x04C11DB7u, reverse32(~crc));
+
+    for (; len >= 4; len -= 4, data += 4)
+    {
+        unit.write32((static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) |
+                     (static_cast<uint32_t>(data[2]) << 8) | data[3]);
+    }
+    for (; len > 0; len--)
+    {
+        unit.write8(*data++);
+    }
+    return ~unit.read();
+}
+
+static void testCheckValues()
+{
+    const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    CHECK(crc32(check, sizeof(check)) == 0xCBF43926u);
+    CHECK(crc32Bitwise(check, sizeof(check)) == 0xCBF43926u);
+    CHECK(crc32Unit(check, sizeof(check)) == 0xCBF43926u);
+    CHECK(crc16(check, sizeof(check)) == 0x29B1u);
+    CHECK(crc32(check, 0) == 0u && crc32Unit(check, 0) == 0u);
+}
+
+static void testAgreement()
+{
+    constexpr size_t SIZE = 600;
+    std::mt19937 rng(7);
+    uint8_t buf[SIZE];
+    for (auto &b : buf)
+    {
+        b = static_cast<uint8_t>(rng());
+    }
+
+    for (size_t len = 0; len <= SIZE; len += (len < 40) ? 1 : 37)
+    {
+        const uint32_t expected = crc32Bitwise(buf, len);
+        CHECK(crc32(buf, len) == expected);
+        CHECK(crc32Unit(buf, len) == expected);
+
+        // continuation over every split, unaligned tails included
+        for (size_t split = 0; split <= len; split += (len < 40) ? 1 : 13)
+        {
+            CHECK(crc32(buf + split, len - split, crc32(buf, split)) == expected);
+            CHECK(crc32Unit(buf + split, len - split, crc32Unit(buf, split)) == expected);
+            CHECK(crc16(buf + split, len - split, crc16(buf, split)) == crc16(buf, len));
+        }
+    }
+
+    // the config image payload is what the store checks at every boot
+    for (size_t len : {static_cast<size_t>(356), static_cast<size_t>(2036)})
+    {
+        std::vector<uint8_t> payload(len);
+        for (auto &b : payload)
+        {
+            b = static_cast<uint8_t>(rng());
+        }
+        CHECK(crc32(payload.data(), len) == crc32Bitwise(payload.data(), len));
+        CHECK(crc32Unit(payload.data(), len) == crc32Bitwise(payload.data(), len));
+    }
+}
+
+int main()
+{
+    testCheckValues();
+    testAgreement();
+
+    return checkResult("crc_test");
+}
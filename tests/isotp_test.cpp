@@ -0,0 +1,345 @@
+/* Two isotpLinks on a simulated 500 kbit/s bus: the device, answering like
+   the CAN RX thread, and a tester. Each node has the three bxCAN mailboxes,
+   the bus sends one frame at a time, lowest id first, and a frame takes
+   its worst case stuffed length. The node threads wake on a received frame
+   or when idleTime() runs out, at the latest every 10 ms like the RX
+   thread. Checks the calibration read and write exchanges frame for frame
+   and measures how long they take for a few block size / STmin choices. */
+#include "isotp.h"
+#include "can.h"
+#include "check.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+constexpr uint32_t BITRATE = 500000;
+constexpr uint16_t DEVICE_TX_ID = 0x6F8;
+constexpr uint16_t TESTER_TX_ID = 0x6F0;
+constexpr size_t MAILBOXES = 3;
+constexpr sysinterval_t THREAD_TICK = TIME_MS2I(10);
+
+// as in can.cpp: getCals and writeCals, the image is 136 bytes
+constexpr uint8_t READ_REQUEST = 0xBB;
+constexpr uint8_t WRITE_REQUEST = 0xCC;
+constexpr size_t IMAGE_SIZE = 136;
+
+// standard data frame with worst case stuffing
+static sysinterval_t frameTime(const CANTxFrame &frame)
+{
+    const uint32_t bits = 47U + 8U * frame.DLC + (34U + 8U * frame.DLC - 1U) / 4U;
+    return TIME_US2I(bits * 1000000U / BITRATE);
+}
+
+struct node
+{
+    isotpLink link;
+    std::deque<CANTxFrame> mailboxes;
+    std::deque<CANRxFrame> received;
+    systime_t wake = 0;
+    uint16_t txId = 0;
+    size_t sent = 0;
+    size_t dropSequence = 0;  // the n-th consecutive frame is lost on the bus, 0 = none
+    size_t stealSequence = 0; // the n-th one finds its mailbox taken after the look
+    size_t consecutiveSent = 0;
+};
+
+static node device;
+static node tester;
+static node *running; // whose thread is in the link code
+static size_t busFrames;
+
+bool can_lld_is_tx_empty(CANDriver *, canmbx_t)
+{
+    return running->mailboxes.size() < MAILBOXES;
+}
+
+msg_t canSend(const CANTxFrame &frame, sysinterval_t)
+{
+    node &from = (frame.SID == DEVICE_TX_ID) ? device : tester;
+    if (from.mailboxes.size() >= MAILBOXES)
+    {
+        return MSG_TIMEOUT;
+    }
+    if ((frame.data8[0] >> 4) == static_cast<uint8_t>(isotpFrame::consecutive))
+    {
+        if (from.consecutiveSent + 1U == from.stealSequence)
+        {
+            // the CAN TX thread got there first, this attempt only
+            from.stealSequence = 0;
+            return MSG_TIMEOUT;
+        }
+        if (++from.consecutiveSent == from.dropSequence)
+        {
+            return MSG_OK; // lost on the bus
+        }
+    }
+    from.mailboxes.push_back(frame);
+    from.sent++;
+    return MSG_OK;
+}
+
+/* One pass of a node's thread: poll, then the frames that arrived. handler
+   runs for every complete message. */
+template <typename Handler>
+static void runNode(node &n, Handler &&handler)
+{
+    const systime_t now = chVTGetSystemTimeX();
+
+    running = &n;
+    n.link.poll(now);
+    while (!n.received.empty())
+    {
+        const CANRxFrame rx = n.received.front();
+        n.received.pop_front();
+        if (n.link.receive(rx, now))
+        {
+            handler(now);
+        }
+    }
+    n.wake = chTimeAddX(now, std::min(THREAD_TICK, n.link.idleTime(now)));
+}
+
+struct exchange
+{
+    std::vector<uint8_t> request;
+    std::vector<uint8_t> reply;
+    std::vector<uint8_t> image; // what the device holds, or was sent
+    bool answered = false;
+    systime_t finished = 0;
+};
+
+// the device side of can.cpp's handleIsotpRequest
+static void deviceHandler(exchange &ex, systime_t now)
+{
+    const std::span<uint8_t> msg = device.link.buffer();
+    size_t len = 2;
+
+    if (msg[0] == READ_REQUEST && device.link.length() == 1)
+    {
+        std::copy(ex.image.begin(), ex.image.end(), msg.begin());
+        len = IMAGE_SIZE;
+    }
+    else if (msg[0] == WRITE_REQUEST && device.link.length() == 1 + IMAGE_SIZE)
+    {
+        CHECK(std::equal(ex.image.begin(), ex.image.end(), msg.begin() + 1));
+        msg[1] = 0;
+    }
+    else
+    {
+        msg[1] = msg[0];
+        msg[0] = 0x7F;
+    }
+    device.link.transmit(len, now);
+}
+
+/* Runs one request to its reply or until limit, returns the time taken */
+static sysinterval_t run(exchange &ex, sysinterval_t limit)
+{
+    const systime_t start = hostTime;
+    node *busSender = nullptr;
+    systime_t busEnd = 0;
+
+    std::copy(ex.request.begin(), ex.request.end(), tester.link.buffer().begin());
+    running = &tester;
+    tester.link.transmit(ex.request.size(), hostTime);
+    tester.wake = hostTime;
+    device.wake = hostTime;
+
+    auto testerHandler = [&](systime_t now)
+    {
+        ex.reply.assign(tester.link.buffer().begin(), tester.link.buffer().begin() + tester.link.length());
+        ex.answered = true;
+        ex.finished = now;
+    };
+    auto onDevice = [&](systime_t now) { deviceHandler(ex, now); };
+
+    while (!ex.answered && chTimeDiffX(start, hostTime) < limit)
+    {
+        // arbitration: lowest id among the mailbox heads, each node in FIFO order
+        if (busSender == nullptr)
+        {
+            node *heads[] = {&device, &tester};
+            for (node *n : heads)
+            {
+                if (!n->mailboxes.empty() &&
+                    (busSender == nullptr || n->mailboxes.front().SID < busSender->mailboxes.front().SID))
+                {
+                    busSender = n;
+                }
+            }
+            if (busSender != nullptr)
+            {
+                busEnd = chTimeAddX(hostTime, frameTime(busSender->mailboxes.front()));
+            }
+        }
+
+        systime_t next = std::min(device.wake, tester.wake);
+        if (busSender != nullptr)
+        {
+            next = std::min(next, busEnd);
+        }
+        hostTime = std::max(hostTime, next);
+
+        if (busSender != nullptr && hostTime == busEnd)
+        {
+            const CANTxFrame tx = busSender->mailboxes.front();
+            busSender->mailboxes.pop_front();
+            node &to = (busSender == &device) ? tester : device;
+            CANRxFrame rx = {};
+            rx.SID = tx.SID;
+            rx.DLC = tx.DLC;
+            std::copy(std::begin(tx.data8), std::end(tx.data8), rx.data8);
+            to.received.push_back(rx);
+            to.wake = hostTime;
+            busSender = nullptr;
+            busFrames++;
+        }
+        if (device.wake <= hostTime)
+        {
+            runNode(device, onDevice);
+        }
+        if (tester.wake <= hostTime)
+        {
+            runNode(tester, testerHandler);
+        }
+    }
+    return chTimeDiffX(start, ex.answered ? ex.finished : hostTime);
+}
+
+static void resetBus(uint8_t blockSize, uint8_t stMin)
+{
+    device = node{};
+    tester = node{};
+    device.txId = DEVICE_TX_ID;
+    tester.txId = TESTER_TX_ID;
+    device.link.setup(DEVICE_TX_ID, blockSize, stMin);
+    tester.link.setup(TESTER_TX_ID, blockSize, stMin);
+    busFrames = 0;
+}
+
+static std::vector<uint8_t> testImage()
+{
+    std::vector<uint8_t> image(IMAGE_SIZE);
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        image[i] = static_cast<uint8_t>(i * 7U + 3U);
+    }
+    return image;
+}
+
+static void testThroughput()
+{
+    struct setting
+    {
+        uint8_t blockSize;
+        uint8_t stMin;
+        sysinterval_t limit; // upper bound for either exchange
+    };
+    // 22 frames of 270 us make 5.94 ms; STmin 1 ms spaces the 19 consecutive frames
+    const setting settings[] = {
+        {0, 0x00, TIME_US2I(6500)},
+        {8, 0x00, TIME_US2I(7500)},
+        {0, 0xF5, TIME_US2I(15000)},
+        {8, 0x01, TIME_US2I(25000)},
+    };
+
+    CANTxFrame fullFrame = {};
+    fullFrame.DLC = 8;
+
+    std::printf("  BS  STmin   read      write     frames\n");
+    for (const setting &s : settings)
+    {
+        resetBus(s.blockSize, s.stMin);
+        exchange read;
+        read.request = {READ_REQUEST};
+        read.image = testImage();
+        const sysinterval_t readTime = run(read, TIME_MS2I(100));
+        const size_t readFrames = busFrames;
+        CHECK(read.answered && read.reply == read.image);
+
+        resetBus(s.blockSize, s.stMin);
+        exchange write;
+        write.image = testImage();
+        write.request = {WRITE_REQUEST};
+        write.request.insert(write.request.end(), write.image.begin(), write.image.end());
+        const sysinterval_t writeTime = run(write, TIME_MS2I(100));
+        const size_t writeFrames = busFrames;
+        CHECK(write.answered && write.reply.size() == 2U && write.reply[0] == WRITE_REQUEST && write.reply[1] == 0U);
+
+        // one single frame, first frame, flow control and 19 consecutive frames,
+        // plus a flow control per block
+        const size_t blocks = (s.blockSize == 0U) ? 0U : (19U - 1U) / s.blockSize;
+        CHECK(readFrames == 22U + blocks);
+        CHECK(writeFrames == 22U + blocks);
+        CHECK(readTime <= s.limit && writeTime <= s.limit);
+        CHECK(readTime >= readFrames * frameTime(fullFrame));
+
+        std::printf("  %2u  0x%02X  %5.2f ms  %5.2f ms  %zu/%zu\n", s.blockSize, s.stMin, readTime / 1000.0,
+                    writeTime / 1000.0, readFrames, writeFrames);
+    }
+}
+
+// a consecutive frame lost on the bus: the device drops the transfer and
+// never answers, both links are idle again after the timeout
+static void testLostConsecutive()
+{
+    resetBus(0, 0);
+    tester.dropSequence = 5;
+    exchange write;
+    write.image = testImage();
+    write.request = {WRITE_REQUEST};
+    write.request.insert(write.request.end(), write.image.begin(), write.image.end());
+    run(write, TIME_MS2I(ISOTP_TIMEOUT_MS) * 2U);
+    CHECK(!write.answered);
+    CHECK(!device.link.busy() && !tester.link.busy());
+
+    // and the next request goes through
+    tester.dropSequence = 0;
+    exchange read;
+    read.request = {READ_REQUEST};
+    read.image = testImage();
+    run(read, TIME_MS2I(100));
+    CHECK(read.answered && read.reply == read.image);
+}
+
+// the CAN TX thread takes the last mailbox between the look and the send:
+// the frame waits for the next tick instead of going missing
+static void testMailboxTaken()
+{
+    resetBus(0, 0);
+    device.stealSequence = 4;
+    exchange read;
+    read.request = {READ_REQUEST};
+    read.image = testImage();
+    run(read, TIME_MS2I(100));
+    CHECK(read.answered && read.reply == read.image);
+    CHECK(device.stealSequence == 0U);
+}
+
+// a request longer than the buffer is refused with an overflow flow control
+static void testOverflow()
+{
+    resetBus(0, 0);
+    CANRxFrame ff = {};
+    ff.SID = TESTER_TX_ID;
+    ff.DLC = 8;
+    ff.data8[0] = 0x10 | ((ISOTP_MAX_PAYLOAD + 1) >> 8);
+    ff.data8[1] = (ISOTP_MAX_PAYLOAD + 1) & 0xFF;
+    running = &device;
+    CHECK(!device.link.receive(ff, hostTime));
+    CHECK(!device.link.busy());
+    CHECK(device.mailboxes.size() == 1U && device.mailboxes.front().data8[0] ==
+                                                (0x30 | static_cast<uint8_t>(isotpFlow::overflow)));
+}
+
+int main()
+{
+    testThroughput();
+    testLostConsecutive();
+    testMailboxTaken();
+    testOverflow();
+
+    return checkResult("isotp_test");
+}
@@ -0,0 +1,332 @@
+/* deltaEncoder against the reference deltaDecoder, with the records batched
+   into 0x14 packets the way usbStream does. Every record the decoder hands
+   out has to match what went in; after a lost packet it may only skip. */
+#include "stream_codec.h"
+#include "check.h"
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+constexpr size_t PACKET_SIZE = 64;
+
+struct sample
+{
+    uint16_t sequence;
+    uint32_t time;
+    std::vector<uint16_t> values;
+};
+
+/* usbStream's batching: the header takes the sequence the first record was
+   coded against, a packet goes out when the next record would not fit.
+   lose(n) says whether packet n never reaches the host while the device
+   knows it (a failed send), as usbStream::flush() reports it. */
+class batcher
+{
+private:
+    deltaEncoder m_encoder;
+    uint32_t m_mask;
+    std::vector<uint8_t> m_packet;
+    bool (*m_lose)(size_t packet);
+
+public:
+    std::vector<std::vector<uint8_t>> packets;
+    std::vector<bool> lost;
+    size_t keyframes = 0;
+
+    batcher(uint32_t mask, uint16_t keyInterval, bool (*lose)(size_t) = nullptr) : m_mask(mask), m_lose(lose)
+    {
+        m_encoder.reset(keyInterval);
+    }
+
+    // false if the packet was lost
+    bool flush()
+    {
+        if (m_packet.empty())
+        {
+            return true;
+        }
+        const bool gone = m_lose != nullptr && m_lose(packets.size());
+        packets.push_back(m_packet);
+        lost.push_back(gone);
+        m_packet.clear();
+        if (gone)
+        {
+            m_encoder.forceKey();
+        }
+        return !gone;
+    }
+
+    void add(const sample &s)
+    {
+        uint8_t record[deltaEncoder::maxRecord(STREAM_CODEC_MAX_CHANNELS)];
+        uint16_t reference = m_encoder.lastSequence();
+        size_t size = m_encoder.encode(s.sequence, s.time, s.values, record);
+        CHECK(size <= deltaEncoder::maxRecord(s.values.size()));
+
+        if (!m_packet.empty() && m_packet.size() + size > PACKET_SIZE && !flush())
+        {
+            reference = s.sequence;
+            size = m_encoder.encode(s.sequence, s.time, s.values, record);
+        }
+        keyframes += (record[0] & 1U);
+        if (m_packet.empty())
+        {
+            m_packet = {0x14, 0, static_cast<uint8_t>(m_mask), static_cast<uint8_t>(m_mask >> 8),
+                        static_cast<uint8_t>(m_mask >> 16), static_cast<uint8_t>(m_mask >> 24),
+                        static_cast<uint8_t>(reference), static_cast<uint8_t>(reference >> 8)};
+        }
+        m_packet.insert(m_packet.end(), record, record + size);
+        m_packet[1]++;
+    }
+};
+
+/* Decodes packets and checks every record against the samples sent */
+struct receiver
+{
+    deltaDecoder decoder;
+    const std::vector<sample> &sent;
+    size_t next = 0; // index into sent of the first record not yet seen
+    size_t decoded = 0;
+
+    explicit receiver(const std::vector<sample> &samples) : sent(samples) {}
+
+    bool feed(const std::vector<uint8_t> &packet)
+    {
+        return decoder.decode(packet, [&](uint16_t sequence, uint32_t time, std::span<const uint16_t> values)
+        {
+            while (next < sent.size() && sent[next].sequence != sequence)
+            {
+                next++;
+            }
+            CHECK(next < sent.size());
+            if (next == sent.size())
+            {
+                return;
+            }
+            const sample &s = sent[next++];
+            CHECK(time == s.time);
+            CHECK(values.size() == s.values.size());
+            CHECK(std::equal(values.begin(), values.end(), s.values.begin()));
+            decoded++;
+        });
+    }
+};
+
+static uint32_t maskOf(size_t channels)
+{
+    return (channels >= 32U) ? 0xFFFFFFFFU : (1U << channels) - 1U;
+}
+
+static void testZigzagExtremes()
+{
+    const int32_t cases[] = {0, 1, -1, 2, -2, 32767, -32768, 65535, -65535, INT32_MAX, INT32_MIN};
+    for (int32_t v : cases)
+    {
+        CHECK(unzigzag(zigzag(v)) == v);
+    }
+    CHECK(zigzag(-1) == 1U && zigzag(1) == 2U && zigzag(INT32_MIN) == 0xFFFFFFFFU);
+
+    const uint32_t varints[] = {0, 0x7F, 0x80, 0x3FFF, 0x4000, 0x1FFFF, 0xFFFFFFFFU};
+    for (uint32_t v : varints)
+    {
+        uint8_t buf[5];
+        const size_t n = putVarint(buf, v);
+        size_t pos = 0;
+        uint32_t back = 0;
+        CHECK(getVarint(std::span<const uint8_t>(buf, n), pos, back) && back == v && pos == n);
+    }
+    // a step of the full 16 bit range in either direction, the worst case record
+    uint8_t buf[5];
+    CHECK(putVarint(buf, zigzag(-65535)) == 3U && putVarint(buf, zigzag(65535)) == 3U);
+}
+
+// full scale swings on every channel, the time counter wrapping
+static void testFullScaleSwings()
+{
+    constexpr size_t CHANNELS = STREAM_CODEC_MAX_CHANNELS;
+    std::vector<sample> samples;
+    for (uint32_t i = 0; i < 200; i++)
+    {
+        sample s{static_cast<uint16_t>(i), 0xFFFFFF00U + i * 7U, std::vector<uint16_t>(CHANNELS)};
+        for (size_t ch = 0; ch < CHANNELS; ch++)
+        {
+            s.values[ch] = ((i + ch) & 1U) ? 0xFFFF : 0;
+        }
+        samples.push_back(s);
+    }
+
+    batcher tx(maskOf(CHANNELS), 16);
+    for (const sample &s : samples)
+    {
+        tx.add(s);
+    }
+    tx.flush();
+
+    receiver rx(samples);
+    for (const auto &packet : tx.packets)
+    {
+        CHECK(packet.size() <= PACKET_SIZE || packet[1] == 1U);
+        CHECK(rx.feed(packet));
+    }
+    CHECK(rx.decoded == samples.size());
+}
+
+// random walks, a keyframe every interval records and nowhere else
+static void testKeyframes()
+{
+    constexpr size_t CHANNELS = 6;
+    constexpr uint16_t INTERVAL = 10;
+    std::mt19937 rng(1);
+    std::vector<sample> samples;
+    std::vector<uint16_t> level(CHANNELS, 2000);
+    uint32_t time = 0;
+
+    for (uint32_t i = 0; i < 1000; i++)
+    {
+        for (auto &v : level)
+        {
+            v = static_cast<uint16_t>(v + static_cast<int>(rng() % 201) - 100);
+        }
+        time += 20000;
+        samples.push_back({static_cast<uint16_t>(i), time, level});
+    }
+
+    batcher tx(maskOf(CHANNELS), INTERVAL);
+    for (const sample &s : samples)
+    {
+        tx.add(s);
+    }
+    tx.flush();
+    CHECK(tx.keyframes == samples.size() / INTERVAL);
+
+    receiver rx(samples);
+    size_t bytes = 0;
+    for (const auto &packet : tx.packets)
+    {
+        CHECK(rx.feed(packet));
+        bytes += packet.size();
+    }
+    CHECK(rx.decoded == samples.size());
+    std::printf("  %zu samples of %zu channels in %zu packets, %zu bytes (raw %zu)\n", samples.size(), CHANNELS,
+                tx.packets.size(), bytes, samples.size() * (6 + 2 * CHANNELS));
+}
+
+// sequence steps above one (stream divider restarts) and the 16 bit wrap
+static void testSequenceSteps()
+{
+    constexpr size_t CHANNELS = 3;
+    std::vector<sample> samples;
+    uint16_t sequence = 0xFF00;
+    for (uint32_t i = 0; i < 400; i++)
+    {
+        sequence = static_cast<uint16_t>(sequence + 1U + (i % 5U == 0U ? 300U : 0U));
+        samples.push_back({sequence, i * 1000U, {static_cast<uint16_t>(i), static_cast<uint16_t>(i * 3U), 7}});
+    }
+
+    batcher tx(maskOf(CHANNELS), 50);
+    for (const sample &s : samples)
+    {
+        tx.add(s);
+    }
+    tx.flush();
+
+    receiver rx(samples);
+    for (const auto &packet : tx.packets)
+    {
+        CHECK(rx.feed(packet));
+    }
+    CHECK(rx.decoded == samples.size());
+}
+
+static bool everySeventh(size_t packet)
+{
+    return packet % 7U == 3U;
+}
+
+/* Lost packets. When the device knows (its send failed) it sends a key next
+   and the host loses the records of that packet only; when just the host
+   lost it, the reference sequence no longer matches and it skips up to the
+   next periodic key. Nothing wrong is ever decoded. */
+static void testLostPackets(bool deviceKnows)
+{
+    constexpr size_t CHANNELS = 4;
+    constexpr uint16_t INTERVAL = 30;
+    std::vector<sample> samples;
+    for (uint32_t i = 0; i < 2000; i++)
+    {
+        samples.push_back({static_cast<uint16_t>(i), i * 500U,
+                           {static_cast<uint16_t>(i * 11U), static_cast<uint16_t>(60000U - i),
+                            static_cast<uint16_t>(i & 0xF), 4000}});
+    }
+
+    batcher tx(maskOf(CHANNELS), INTERVAL, deviceKnows ? everySeventh : nullptr);
+    for (const sample &s : samples)
+    {
+        tx.add(s);
+    }
+    tx.flush();
+
+    receiver rx(samples);
+    size_t dropped = 0;
+    for (size_t p = 0; p < tx.packets.size(); p++)
+    {
+        if (everySeventh(p))
+        {
+            CHECK(tx.lost[p] == deviceKnows);
+            dropped += tx.packets[p][1];
+            continue;
+        }
+        CHECK(rx.feed(tx.packets[p]));
+    }
+    CHECK(rx.decoded + dropped <= samples.size());
+    if (deviceKnows)
+    {
+        CHECK(rx.decoded + dropped == samples.size());
+    }
+    std::printf("  %s: %zu of %zu records lost with their packets, %zu more skipped to the next key\n",
+                deviceKnows ? "device-side loss" : "host-side loss", dropped, samples.size(),
+                samples.size() - dropped - rx.decoded);
+}
+
+static void testMalformed()
+{
+    std::vector<sample> samples = {{1, 100, {1, 2}}, {2, 200, {3, 4}}};
+    batcher tx(maskOf(2), 8);
+    for (const sample &s : samples)
+    {
+        tx.add(s);
+    }
+    tx.flush();
+    CHECK(tx.packets.size() == 1U);
+
+    std::vector<uint8_t> packet = tx.packets[0];
+    deltaDecoder decoder;
+    auto ignore = [](uint16_t, uint32_t, std::span<const uint16_t>) {};
+
+    std::vector<uint8_t> truncated(packet.begin(), packet.end() - 1);
+    CHECK(!decoder.decode(truncated, ignore));
+    std::vector<uint8_t> trailing = packet;
+    trailing.push_back(0);
+    CHECK(!decoder.decode(trailing, ignore));
+    CHECK(!decoder.decode(std::span<const uint8_t>(packet.data(), STREAM_DELTA_HEADER - 1), ignore));
+    // an overlong varint
+    std::vector<uint8_t> overlong(packet.begin(), packet.begin() + STREAM_DELTA_HEADER);
+    overlong[1] = 1;
+    overlong.insert(overlong.end(), {0x80, 0x80, 0x80, 0x80, 0x80, 0x01});
+    CHECK(!decoder.decode(overlong, ignore));
+}
+
+int main()
+{
+    testZigzagExtremes();
+    testFullScaleSwings();
+    testKeyframes();
+    testSequenceSteps();
+    testLostPackets(true);
+    testLostPackets(false);
+    testMalformed();
+
+    return checkResult("stream_codec_test");
+}
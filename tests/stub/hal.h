@@ -0,0 +1,164 @@
+#pragma once
+/* Host stand-in for the ChibiOS HAL and kernel: just enough types and calls
+   for the firmware headers and the modules under test. The system time is
+   a variable the tests move, locks are no-ops (everything runs on one
+   thread) and CAN transmits go to canSend and can_lld_is_tx_empty, which a
+   test that needs them defines. */
+#include <cstdint>
+#include <cstddef>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+/* kernel, 1 MHz system tick as on the target */
+using systime_t = uint32_t;
+using sysinterval_t = uint32_t;
+using msg_t = int32_t;
+using eventmask_t = uint32_t;
+using eventflags_t = uint32_t;
+
+#define MSG_OK 0
+#define MSG_TIMEOUT -1
+#define TIME_IMMEDIATE ((sysinterval_t)0)
+#define TIME_INFINITE ((sysinterval_t)-1)
+#define TIME_MS2I(ms) ((sysinterval_t)(ms) * 1000U)
+#define TIME_US2I(us) ((sysinterval_t)(us))
+#define TIME_I2MS(i) ((i) / 1000U)
+#define TIME_I2US(i) (i)
+
+inline systime_t hostTime = 0;
+
+inline systime_t chVTGetSystemTimeX() { return hostTime; }
+inline systime_t chTimeAddX(systime_t t, sysinterval_t i) { return t + i; }
+inline sysinterval_t chTimeDiffX(systime_t start, systime_t end) { return end - start; }
+inline bool chTimeIsInRangeX(systime_t t, systime_t start, systime_t end) { return (t - start) < (end - start); }
+
+inline void chSysLock() {}
+inline void chSysUnlock() {}
+inline void chSysLockFromISR() {}
+inline void chSysUnlockFromISR() {}
+
+struct mutex_t
+{
+    int owner;
+};
+inline void chMtxObjectInit(mutex_t *) {}
+inline void chMtxLock(mutex_t *) {}
+inline void chMtxUnlock(mutex_t *) {}
+
+/* PAL, declared only: the tests never touch a pin */
+struct GPIO_TypeDef
+{
+    uint32_t IDR, ODR;
+};
+using ioportid_t = GPIO_TypeDef *;
+using iopadid_t = uint32_t;
+bool palReadPad(ioportid_t port, iopadid_t pad);
+void palSetPad(ioportid_t port, iopadid_t pad);
+void palClearPad(ioportid_t port, iopadid_t pad);
+
+/* PWM, for the pwmcfg constant in io.h */
+#define STM32_SYSCLK 48000000U
+#define STM32_PCLK 48000000U
+#define PWM_OUTPUT_DISABLED 0U
+#define PWM_OUTPUT_ACTIVE_HIGH 1U
+#define PWM_COMPLEMENTARY_OUTPUT_ACTIVE_LOW 2U
+struct PWMChannelConfig
+{
+    uint32_t mode;
+    void *callback;
+};
+struct PWMConfig
+{
+    uint32_t frequency;
+    uint32_t period;
+    void *callback;
+    PWMChannelConfig channels[4];
+    uint32_t cr2;
+    uint32_t bdtr;
+    uint32_t dier;
+};
+
+/* CAN */
+#define CAN_ANY_MAILBOX 0U
+#define CAN_IDE_STD 0U
+#define CAN_IDE_EXT 1U
+#define CAN_RTR_DATA 0U
+#define CAN_RTR_REMOTE 1U
+#define CAN_MCR_ABOM (1U << 6)
+#define CAN_MCR_AWUM (1U << 5)
+#define CAN_MCR_TXFP (1U << 2)
+#define CAN_BTR_BRP(n) ((uint32_t)(n))
+#define CAN_BTR_TS1(n) ((uint32_t)(n) << 16)
+#define CAN_BTR_TS2(n) ((uint32_t)(n) << 20)
+#define CAN_BTR_SJW(n) ((uint32_t)(n) << 24)
+#define CAN_BTR_LBKM (1U << 30)
+#define CAN_BTR_SILM (1U << 31)
+
+using canmbx_t = uint32_t;
+
+struct CANTxFrame
+{
+    uint8_t DLC : 4;
+    uint8_t RTR : 1;
+    uint8_t IDE : 1;
+    union
+    {
+        uint32_t SID : 11;
+        uint32_t EID : 29;
+    };
+    union
+    {
+        uint8_t data8[8];
+        uint16_t data16[4];
+        uint32_t data32[2];
+    };
+};
+
+struct CANRxFrame
+{
+    uint8_t FMI;
+    uint16_t TIME;
+    uint8_t DLC : 4;
+    uint8_t RTR : 1;
+    uint8_t IDE : 1;
+    union
+    {
+        uint32_t SID : 11;
+        uint32_t EID : 29;
+    };
+    union
+    {
+        uint8_t data8[8];
+        uint16_t data16[4];
+        uint32_t data32[2];
+    };
+};
+
+struct CANConfig
+{
+    uint32_t mcr;
+    uint32_t btr;
+};
+
+struct CANFilter
+{
+    uint32_t filter;
+    uint32_t mode;
+    uint32_t scale;
+    uint32_t assignment;
+    uint32_t register1;
+    uint32_t register2;
+};
+
+struct CANDriver
+{
+    int state;
+};
+inline CANDriver CAND1;
+
+/* mailbox state for the modules that look before they send, defined by
+   the test like canSend */
+bool can_lld_is_tx_empty(CANDriver *canp, canmbx_t mailbox);
@@ -0,0 +1,165 @@
+#include "usb_commands.h"
+#include "usb_response.h"
+#include "usbcfg.h"
+#include "slcan.h"
+
+static apistatus runGetData(api &instance, std::span<const uint8_t>, std::optional<frameTag> frame)
+{
+    instance.sendData(frame);
+    return apistatus::ok;
+}
+static constexpr usbCommand getDataCommand{apicommand::getData, 0, 0, static_cast<uint8_t>(apiresponse::dataResponse),
+                                           DATA_REPLY_SIZE, runGetData, dataFields};
+
+static apistatus runGetCals(api &instance, std::span<const uint8_t>, std::optional<frameTag> frame)
+{
+    instance.sendCals(frame);
+    return apistatus::ok;
+}
+static constexpr usbCommand getCalsCommand{apicommand::getCals, 0, 0, static_cast<uint8_t>(apiresponse::avCalsResponse),
+                                           CAL_IMAGE_SIZE, runGetCals, calFields};
+
+static apistatus runWriteCals(api &instance, std::span<const uint8_t> in, std::optional<frameTag>)
+{
+    return instance.writeCals(in);
+}
+static constexpr usbCommand writeCalsCommand{apicommand::writeCals, CAL_IMAGE_SIZE, 100, 0, 1, runWriteCals};
+
+static apistatus runGetCanCfg(api &instance, std::span<const uint8_t>, std::optional<frameTag> frame)
+{
+    instance.sendCanCfg(frame);
+    return apistatus::ok;
+}
+static constexpr usbCommand getCanCfgCommand{apicommand::getCanCfg, 0, 0, static_cast<uint8_t>(apiresponse::canCfgResponse),
+                                             CAN_CFG_PACKET_SIZE, runGetCanCfg, canCfgFields};
+
+static apistatus runWriteCanCfg(api &instance, std::span<const uint8_t> in, std::optional<frameTag>)
+{
+    return instance.writeCanCfg(in);
+}
+static constexpr usbCommand writeCanCfgCommand{apicommand::writeCanCfg, CAN_CFG_PACKET_SIZE, 100, 0, 1, runWriteCanCfg};
+
+static apistatus runGetCanMap(api &instance, std::span<const uint8_t>, std::optional<frameTag> frame)
+{
+    instance.sendCanMap(frame);
+    return apistatus::ok;
+}
+static constexpr usbCommand getCanMapCommand{apicommand::getCanMap, 0, 0, static_cast<uint8_t>(apiresponse::canMapResponse),
+                                             CAN_MAP_PACKET_SIZE, runGetCanMap, canMapFields};
+
+static apistatus runWriteCanMap(api &instance, std::span<const uint8_t> in, std::optional<frameTag>)
+{
+    return instance.writeCanMap(in);
+}
+static constexpr usbCommand writeCanMapCommand{apicommand::writeCanMap, CAN_MAP_PACKET_SIZE, 100, 0, 1, runWriteCanMap};
+
+static apistatus runGetCanStats(api &instance, std::span<const uint8_t>, std::optional<frameTag> frame)
+{
+    instance.sendCanStats(frame);
+    return apistatus::ok;
+}
+static constexpr usbCommand getCanStatsCommand{apicommand::getCanStats, 0, 0, static_cast<uint8_t>(apiresponse::canStatsResponse),
+                                               CAN_STATS_PACKET_SIZE, runGetCanStats, canStatsFields};
+
+static apistatus runStartStream(api &instance, std::span<const uint8_t> in, std::optional<frameTag> frame)
+{
+    return instance.startStream(in, frame.has_value());
+}
+static constexpr usbCommand startStreamCommand{apicommand::startStream, STREAM_REQUEST_SIZE, 50, 0, 1, runStartStream};
+
+static apistatus runStopStream(api &instance, std::span<const uint8_t>, std::optional<frameTag>)
+{
+    return instance.stopStream();
+}
+static constexpr usbCommand stopStreamCommand{apicommand::stopStream, 0, 0, 0, 1, runStopStream};
+
+// the command port speaks SLCAN (slcan.h) from the next byte on
+static apistatus runSlcanMode(api &, std::span<const uint8_t>, std::optional<frameTag>)
+{
+    getSlcan().enter();
+    return apistatus::ok;
+}
+static constexpr usbCommand slcanModeCommand{apicommand::slcanMode, 0, 0, 0, 1, runSlcanMode};
+
+static apistatus runCaptureBurst(api &instance, std::span<const uint8_t> in, std::optional<frameTag> frame)
+{
+    return instance.startCapture(in, frame.has_value());
+}
+static constexpr usbCommand captureBurstCommand{apicommand::captureBurst, CAPTURE_REQUEST_SIZE, 50, 0, 1, runCaptureBurst};
+
+static apistatus runGetSchema(api &instance, std::span<const uint8_t> in, std::optional<frameTag> frame);
+static constexpr usbCommand getSchemaCommand{apicommand::getSchema, 0, 0, static_cast<uint8_t>(apiresponse::schemaResponse),
+                                             0, runGetSchema};
+
+static apistatus runGetFields(api &instance, std::span<const uint8_t> in, std::optional<frameTag> frame);
+static constexpr usbCommand getFieldsCommand{apicommand::getFields, 2, 50, static_cast<uint8_t>(apiresponse::fieldResponse),
+                                             FIELD_PACKET_SIZE, runGetFields};
+
+using commandRegistry = usbRegistry<getDataCommand, getCalsCommand, writeCalsCommand, getCanCfgCommand,
+                                    writeCanCfgCommand, getCanMapCommand, writeCanMapCommand, getCanStatsCommand,
+                                    startStreamCommand, stopStreamCommand, slcanModeCommand, captureBurstCommand,
+                                    getSchemaCommand, getFieldsCommand>;
+
+static_assert(commandRegistry::maxRequest() <= USB_MAX_REQUEST, "USB_MAX_REQUEST is out of date");
+
+// id + command count + (opcode, request size, timeout, reply id, reply size) per command
+constexpr size_t SCHEMA_PACKET_SIZE = 1 + 1 + commandRegistry::size() * 7;
+
+static apistatus runGetSchema(api &, std::span<const uint8_t>, std::optional<frameTag> frame)
+{
+    usbResponse resp(&SDU1, frame);
+
+    resp.u8(static_cast<uint8_t>(apiresponse::schemaResponse));
+    resp.u8(static_cast<uint8_t>(commandRegistry::size()));
+    for (size_t i = 0; i < commandRegistry::size(); i++)
+    {
+        const usbCommand &cmd = commandRegistry::at(i);
+        resp.u8(static_cast<uint8_t>(cmd.opcode));
+        resp.u8(cmd.requestSize);
+        resp.u16(cmd.timeoutMs);
+        resp.u8(cmd.replyId);
+        resp.u16((cmd.opcode == apicommand::getSchema) ? SCHEMA_PACKET_SIZE : cmd.replySize);
+    }
+    resp.send();
+    return apistatus::ok;
+}
+
+/* Field index of a command's reply: [0] 0x9D, [1] opcode, [2] index, [3] field
+   count, [4] type, [5] offset, [6] count, [7] stride, name NUL padded. An unknown
+   opcode or index answers with count 0 and the rest zeroed. */
+static apistatus runGetFields(api &, std::span<const uint8_t> in, std::optional<frameTag> frame)
+{
+    if (in.size() != 2)
+    {
+        return apistatus::rejected;
+    }
+    const usbCommand *cmd = commandRegistry::find(in[0]);
+    const std::span<const usbField> fields = (cmd != nullptr) ? cmd->fields : std::span<const usbField>();
+    usbResponse resp(&SDU1, frame);
+
+    if (auto out = resp.reserve<FIELD_PACKET_SIZE>())
+    {
+        std::fill(out->begin(), out->end(), 0);
+        (*out)[0] = static_cast<uint8_t>(apiresponse::fieldResponse);
+        (*out)[1] = in[0];
+        (*out)[2] = in[1];
+        (*out)[3] = static_cast<uint8_t>(fields.size());
+        if (in[1] < fields.size())
+        {
+            const usbField &f = fields[in[1]];
+            const std::string_view name(f.name);
+            (*out)[4] = static_cast<uint8_t>(f.type);
+            (*out)[5] = f.offset;
+            (*out)[6] = f.count;
+            (*out)[7] = f.stride;
+            std::copy(name.begin(), name.end(), out->begin() + 8);
+        }
+        resp.send();
+    }
+    return apistatus::ok;
+}
+
+const usbCommand *findCommand(uint8_t opcode)
+{
+    return commandRegistry::find(opcode);
+}
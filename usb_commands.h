@@ -0,0 +1,98 @@
+#pragma once
+#include "api.h"
+#include <span>
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <cstdint>
+
+/* One entry per USB command, declared next to its handler. requestSize is
+   the packet a plain opcode is followed by (a frame may carry less, the
+   handler checks), timeoutMs how long that packet may take to arrive in
+   full. replyId/replySize describe the answer for the schema export, fields
+   its layout for getFields (empty for the status byte replies). */
+struct usbCommand
+{
+    apicommand opcode;
+    uint8_t requestSize;
+    uint16_t timeoutMs;
+    uint8_t replyId; // first byte of the reply packet, 0 = status byte only
+    uint16_t replySize;
+    apistatus (*run)(api &instance, std::span<const uint8_t> in, std::optional<frameTag> frame);
+    std::span<const usbField> fields = {};
+
+    constexpr bool dataReply() const { return replyId != 0U; };
+};
+
+/* Compile-time command registry over the constexpr command entries. Opcodes are checked for duplicates and
+   looked up through a dense index over the opcode range, no search. */
+template <const usbCommand &...Commands>
+class usbRegistry
+{
+private:
+    static constexpr std::array<const usbCommand *, sizeof...(Commands)> s_commands = {&Commands...};
+    static constexpr uint8_t s_first = std::min({static_cast<uint8_t>(Commands.opcode)...});
+    static constexpr uint8_t s_last = std::max({static_cast<uint8_t>(Commands.opcode)...});
+
+    // opcode - s_first -> command index + 1, 0 = no command
+    static constexpr std::array<uint8_t, s_last - s_first + 1> buildIndex()
+    {
+        std::array<uint8_t, s_last - s_first + 1> index = {};
+        for (size_t i = 0; i < s_commands.size(); i++)
+        {
+            index[static_cast<uint8_t>(s_commands[i]->opcode) - s_first] = static_cast<uint8_t>(i + 1);
+        }
+        return index;
+    };
+    static constexpr bool unique()
+    {
+        for (size_t i = 0; i < s_commands.size(); i++)
+        {
+            for (size_t k = i + 1; k < s_commands.size(); k++)
+            {
+                if (s_commands[i]->opcode == s_commands[k]->opcode)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    // every described field ends inside the reply
+    static constexpr bool fieldsFit()
+    {
+        for (const usbCommand *cmd : s_commands)
+        {
+            for (const usbField &f : cmd->fields)
+            {
+                if (f.offset + (f.count - 1U) * f.stride + fieldTypeSize(f.type) > cmd->replySize)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    static constexpr std::array<uint8_t, s_last - s_first + 1> s_index = buildIndex();
+    static_assert(unique(), "two USB commands share an opcode");
+    static_assert(fieldsFit(), "a USB command describes a field past its reply");
+
+public:
+    static constexpr size_t size() { return s_commands.size(); };
+    static constexpr const usbCommand &at(size_t i) { return *s_commands[i]; };
+    static constexpr const usbCommand *find(uint8_t opcode)
+    {
+        if (opcode < s_first || opcode > s_last || s_index[opcode - s_first] == 0U)
+        {
+            return nullptr;
+        }
+        return s_commands[s_index[opcode - s_first] - 1U];
+    };
+    static constexpr size_t maxRequest() { return std::max({static_cast<size_t>(Commands.requestSize)...}); };
+};
+
+// largest packet behind a plain opcode
+constexpr size_t USB_MAX_REQUEST = std::max({CAL_IMAGE_SIZE, CAN_CFG_PACKET_SIZE, CAN_MAP_PACKET_SIZE, STREAM_REQUEST_SIZE});
+static_assert(USB_MAX_REQUEST <= FRAME_MAX_REQUEST, "host packet does not fit a request frame");
+
+const usbCommand *findCommand(uint8_t opcode);
@@ -4,6 +4,47 @@
 #include "usbcfg.h"
 #include "io.h"
 #include "api.h"
+#include "usb_stream.h"
+#include "usb_response.h"
+#include "usb_parser.h"
+#include "usb_commands.h"
+#include "slcan.h"
+#include <array>
+
+// Runs one request. Framed requests always get a reply: the command's own
+// packet, or a status frame that ACKs a write or NACKs a request that never
+// ran, so a pipelining host can match every one. Plain opcodes stay silent.
+static void handleRequest(const usbRequest &request)
+{
+    static api apiInstance;
+    apistatus status = request.status;
+    bool replied = false;
+
+    if (status == apistatus::ok)
+    {
+        const usbCommand *cmd = findCommand(request.opcode);
+        if (cmd == nullptr)
+        {
+            status = apistatus::unknownCommand;
+        }
+        else if (request.payload.size() > cmd->requestSize)
+        {
+            status = apistatus::badLength;
+        }
+        else
+        {
+            status = cmd->run(apiInstance, request.payload, request.frame);
+            replied = cmd->dataReply() && status == apistatus::ok;
+        }
+    }
+
+    if (request.frame && !replied)
+    {
+        usbResponse resp(&SDU1, request.frame);
+        resp.u8(static_cast<uint8_t>(status));
+        resp.send();
+    }
+}
 
 static THD_WORKING_AREA(waUsbThread, 1024);
 static THD_FUNCTION(UsbThread, arg)
@@ -12,35 +53,48 @@ static THD_FUNCTION(UsbThread, arg)
     (void)arg;
     chRegSetThreadName("USB Thread");
 
-    static api apiInstance;
+    static usbParser parser(handleRequest);
+    slcanBridge &slcan = getSlcan();
+    std::array<uint8_t, 64> chunk;
 
     while (true)
     {
         if (!usbIsConfigured()) {
+            parser.reset();
+            slcan.leave();
             chThdSleepMilliseconds(50);
             continue;
         }
         /* Check if the USB is active (enumerated and configured). */
         if (usbGetDriverStateI(serusbcfg.usbp) == USB_ACTIVE)
         {
-            uint8_t rx;
-            if (chnReadTimeout(&SDU1, &rx, 1, TIME_INFINITE) == 1)
+            // take what is already queued, only wait when there is nothing
+            size_t n = chnReadTimeout(&SDU1, chunk.data(), chunk.size(), TIME_IMMEDIATE);
+            if (n == 0U)
+            {
+                const msg_t rx = chnGetTimeout(&SDU1, parser.waitTime());
+                if (rx == MSG_TIMEOUT)
+                {
+                    parser.expire();
+                    continue;
+                }
+                if (rx < MSG_OK)
+                {
+                    parser.reset();
+                    continue;
+                }
+                chunk[0] = static_cast<uint8_t>(rx);
+                n = 1;
+            }
+            for (size_t i = 0; i < n; i++)
             {
-                switch (rx)
+                if (slcan.active())
+                {
+                    slcan.feed(chunk[i]);
+                }
+                else if (!parser.idle() || !slcan.sniff(chunk[i]))
                 {
-                case static_cast<uint8_t>(apicommand::getData):
-                    apiInstance.getData();
-                    apiInstance.sendData();
-                    break;
-                case static_cast<uint8_t>(apicommand::getCals):
-                    apiInstance.getCals();
-                    apiInstance.sendCals();
-                    break;
-                case static_cast<uint8_t>(apicommand::writeCals):
-                    apiInstance.writeCals();
-                    break;
-                default:
-                    break;
+                    parser.feed(chunk[i]);
                 }
             }
         }
@@ -51,6 +105,8 @@ void startUsb()
 {
     sduObjectInit(&SDU1);
     sduStart(&SDU1, &serusbcfg);
+    sduObjectInit(&SDU2);
+    sduStart(&SDU2, &serusbcfg2);
 
     usbDisconnectBus(serusbcfg.usbp);
     chThdSleepMilliseconds(1500); // Wait for host to recognize disconnect
@@ -58,4 +114,6 @@ void startUsb()
     usbConnectBus(serusbcfg.usbp);
 
     chThdCreateStatic(waUsbThread, sizeof(waUsbThread), NORMALPRIO + 2, UsbThread, NULL);
+    startUsbStream();
+    startSlcan();
 }
\ No newline at end of file
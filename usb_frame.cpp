@@ -0,0 +1,112 @@
+#include "usb_frame.h"
+#include "crc.h"
+#include <cstring>
+
+frameParser::frameParser()
+{
+    m_buffer.fill(0);
+    m_fill = 0;
+    m_frameSize = 0;
+    m_errors = 0;
+    m_error = frameError::none;
+    m_errorTag = {0, 0};
+}
+
+void frameParser::reject(frameError error)
+{
+    m_errors++;
+    m_error = error;
+    m_errorTag = (m_fill >= FRAME_HEADER_SIZE) ? frameTag{m_buffer[2], m_buffer[3]} : frameTag{0, 0};
+    drop(1);
+}
+
+frameError frameParser::takeError(frameTag &tag)
+{
+    const frameError error = m_error;
+    tag = m_errorTag;
+    m_error = frameError::none;
+    return error;
+}
+
+void frameParser::drop(size_t n)
+{
+    // skip n bytes and whatever follows up to the next SOF
+    while (n < m_fill && m_buffer[n] != FRAME_SOF)
+    {
+        n++;
+    }
+    n = (n < m_fill) ? n : m_fill;
+    std::memmove(m_buffer.data(), m_buffer.data() + n, m_fill - n);
+    m_fill -= n;
+}
+
+void frameParser::release()
+{
+    if (m_frameSize != 0U)
+    {
+        drop(m_frameSize);
+        m_frameSize = 0;
+    }
+}
+
+bool frameParser::scan()
+{
+    // judged once the header is in, so a rejected frame can be named in the NACK
+    while (m_fill >= FRAME_HEADER_SIZE)
+    {
+        const size_t length = m_buffer[1];
+        if (length > FRAME_MAX_REQUEST)
+        {
+            reject(frameError::badLength);
+            continue;
+        }
+        const size_t total = FRAME_HEADER_SIZE + length + FRAME_CRC_SIZE;
+        if (m_fill < total)
+        {
+            return false;
+        }
+        const uint16_t crc = crc16(&m_buffer[1], FRAME_HEADER_SIZE - 1 + length);
+        if (m_buffer[total - 2] == (crc & 0xFF) && m_buffer[total - 1] == (crc >> 8))
+        {
+            m_frameSize = total;
+            return true;
+        }
+        reject(frameError::badCrc);
+    }
+    return false;
+}
+
+bool frameParser::push(uint8_t byte)
+{
+    release();
+    if (m_fill == 0 && byte != FRAME_SOF)
+    {
+        return false;
+    }
+    m_buffer[m_fill++] = byte;
+    return scan();
+}
+
+bool frameParser::next()
+{
+    release();
+    return scan();
+}
+
+void frameParser::clear()
+{
+    m_fill = 0;
+    m_frameSize = 0;
+    m_error = frameError::none;
+}
+
+bool frameParser::expire()
+{
+    release();
+    if (m_fill == 0)
+    {
+        return false;
+    }
+    reject(frameError::timeout);
+    return scan();
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <array>
+#include <span>
+#include <cstdint>
+#include <cstddef>
+
+/* Framed USB protocol:
+   [0] SOF 0xA5, [1] payload length, [2] type, [3] sequence, payload,
+   CRC-16 (crc.h) over bytes 1.. up to the end of the payload, little-endian.
+   A request's type is its apicommand opcode, the reply carries the same type
+   and sequence so the host can keep several requests in flight. */
+constexpr uint8_t FRAME_SOF = 0xA5;
+constexpr size_t FRAME_HEADER_SIZE = 4;
+constexpr size_t FRAME_CRC_SIZE = 2;
+constexpr size_t FRAME_OVERHEAD = FRAME_HEADER_SIZE + FRAME_CRC_SIZE;
+// largest host packet is the 136-byte calibration image
+constexpr size_t FRAME_MAX_REQUEST = 144;
+// a partly received frame is dropped after this much silence
+constexpr uint32_t FRAME_TIMEOUT_MS = 20;
+
+struct frameTag
+{
+    uint8_t type;
+    uint8_t sequence;
+};
+
+enum class frameError : uint8_t
+{
+    none,
+    badLength,
+    badCrc,
+    timeout
+};
+
+/* Collects request frames from the byte stream. A frame with a bad length
+   or CRC costs only its SOF byte: the hunt restarts right behind it, on
+   bytes already received, so the next good frame is never lost with it. */
+class frameParser
+{
+private:
+    std::array<uint8_t, FRAME_HEADER_SIZE + FRAME_MAX_REQUEST + FRAME_CRC_SIZE> m_buffer;
+    size_t m_fill;
+    size_t m_frameSize; // size of the frame handed out, dropped on the next call
+    uint32_t m_errors;
+    frameError m_error;
+    frameTag m_errorTag;
+
+    void reject(frameError error);
+    void drop(size_t n);
+    void release();
+    bool scan();
+
+public:
+    frameParser();
+    // true when a checked frame is ready, valid until the next call
+    bool push(uint8_t byte);
+    // the next frame already sitting in the buffer, if any
+    bool next();
+    // the sender went quiet mid-frame, give up on it
+    bool expire();
+    void clear();
+    bool busy() const { return m_fill > m_frameSize; };
+    frameTag tag() const { return {m_buffer[2], m_buffer[3]}; };
+    std::span<const uint8_t> payload() const { return {&m_buffer[FRAME_HEADER_SIZE], m_buffer[1]}; };
+    uint32_t errors() const { return m_errors; };
+    // the last frame given up on since the previous call, with its header as received
+    frameError takeError(frameTag &tag);
+};
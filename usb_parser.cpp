@@ -0,0 +1,111 @@
+#include "usb_parser.h"
+
+static apistatus frameStatus(frameError error)
+{
+    switch (error)
+    {
+    case frameError::badLength:
+        return apistatus::badLength;
+    case frameError::badCrc:
+        return apistatus::badCrc;
+    default:
+        return apistatus::timeout;
+    }
+}
+
+usbParser::usbParser(usbRequestSink sink)
+{
+    m_packet.fill(0);
+    m_command = nullptr;
+    m_packetFill = 0;
+    m_started = 0;
+    m_sink = sink;
+}
+
+void usbParser::reset()
+{
+    m_command = nullptr;
+    m_packetFill = 0;
+    m_frames.clear();
+}
+
+void usbParser::drainFrames(bool ready)
+{
+    while (true)
+    {
+        frameTag tag;
+        const frameError error = m_frames.takeError(tag);
+        if (error != frameError::none)
+        {
+            m_sink({tag.type, {}, tag, frameStatus(error)});
+        }
+        if (!ready)
+        {
+            return;
+        }
+        m_sink({m_frames.tag().type, m_frames.payload(), m_frames.tag(), apistatus::ok});
+        ready = m_frames.next();
+    }
+}
+
+void usbParser::feed(uint8_t byte)
+{
+    if (m_command != nullptr)
+    {
+        m_packet[m_packetFill++] = byte;
+        if (m_packetFill == m_command->requestSize)
+        {
+            const uint8_t opcode = static_cast<uint8_t>(m_command->opcode);
+            m_command = nullptr;
+            m_sink({opcode, std::span<const uint8_t>(m_packet.data(), m_packetFill), std::nullopt, apistatus::ok});
+        }
+        return;
+    }
+
+    if (!m_frames.busy() && byte != FRAME_SOF)
+    {
+        // plain opcode; unknown ones are dropped as before
+        const usbCommand *cmd = findCommand(byte);
+        if (cmd == nullptr)
+        {
+            return;
+        }
+        if (cmd->requestSize == 0U)
+        {
+            m_sink({byte, {}, std::nullopt, apistatus::ok});
+            return;
+        }
+        m_command = cmd;
+        m_packetFill = 0;
+        m_started = chVTGetSystemTimeX();
+        return;
+    }
+
+    drainFrames(m_frames.push(byte));
+}
+
+void usbParser::expire()
+{
+    if (m_command != nullptr)
+    {
+        if (chTimeDiffX(m_started, chVTGetSystemTimeX()) >= TIME_MS2I(m_command->timeoutMs))
+        {
+            const uint8_t opcode = static_cast<uint8_t>(m_command->opcode);
+            m_command = nullptr;
+            m_sink({opcode, {}, std::nullopt, apistatus::timeout});
+        }
+        return;
+    }
+    drainFrames(m_frames.expire());
+}
+
+sysinterval_t usbParser::waitTime() const
+{
+    if (m_command != nullptr)
+    {
+        const sysinterval_t elapsed = chTimeDiffX(m_started, chVTGetSystemTimeX());
+        const sysinterval_t limit = TIME_MS2I(m_command->timeoutMs);
+        return (elapsed >= limit) ? TIME_IMMEDIATE : limit - elapsed;
+    }
+    return m_frames.busy() ? TIME_MS2I(FRAME_TIMEOUT_MS) : TIME_INFINITE;
+}
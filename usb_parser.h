@@ -0,0 +1,51 @@
+#pragma once
+#include "ch.h"
+#include "hal.h"
+#include "usb_frame.h"
+#include "usb_commands.h"
+#include <array>
+#include <span>
+#include <optional>
+
+/* A request as the parser hands it over: ready to run when status is ok,
+   otherwise it never ran and only deserves a NACK. */
+struct usbRequest
+{
+    uint8_t opcode;
+    std::span<const uint8_t> payload;
+    std::optional<frameTag> frame; // set for framed requests, the reply is framed too
+    apistatus status;
+};
+
+using usbRequestSink = void (*)(const usbRequest &request);
+
+/* Byte driven request parser for the command port. Between requests every
+   byte decides for itself: SOF starts a frame, anything else is a plain
+   opcode, so one host can mix both and a tool that only speaks plain
+   opcodes works after a framed one. Plain opcodes collect their fixed
+   packet against the command's timeout, frames go through the frame
+   parser. Nothing here blocks: the USB thread feeds whatever bytes it
+   has and waits at most waitTime() for more. */
+class usbParser
+{
+private:
+    frameParser m_frames;
+    std::array<uint8_t, USB_MAX_REQUEST> m_packet;
+    const usbCommand *m_command; // plain opcode still collecting its packet
+    size_t m_packetFill;
+    systime_t m_started;
+    usbRequestSink m_sink;
+
+    void drainFrames(bool ready);
+
+public:
+    explicit usbParser(usbRequestSink sink);
+    void feed(uint8_t byte);
+    // waitTime() ran out without a byte
+    void expire();
+    sysinterval_t waitTime() const;
+    // between requests, nothing collected
+    bool idle() const { return m_command == nullptr && !m_frames.busy(); };
+    // host gone, drop whatever was half received
+    void reset();
+};
@@ -0,0 +1,134 @@
+#include "usb_response.h"
+#include "usbcfg.h"
+#include "crc.h"
+#include <cstring>
+
+// one response at a time per port
+static MUTEX_DECL(commandLock);
+static MUTEX_DECL(streamLock);
+
+usbResponse::usbResponse(SerialUSBDriver *sdup, std::optional<frameTag> frame, sysinterval_t timeout)
+{
+    m_queue = &sdup->obqueue;
+    m_begin = nullptr;
+    m_ptr = nullptr;
+    m_top = nullptr;
+    m_framed = frame.has_value();
+    m_lock = (sdup == &SDU2) ? &streamLock : &commandLock;
+
+    m_ok = false;
+    // an immediate response gives up rather than queue behind another one
+    if (timeout == TIME_IMMEDIATE)
+    {
+        m_locked = chMtxTryLock(m_lock);
+    }
+    else
+    {
+        chMtxLock(m_lock);
+        m_locked = true;
+    }
+    if (!m_locked)
+    {
+        return;
+    }
+
+    // a partly filled buffer left by chnWrite goes out first; the buffer we
+    // get keeps its write pointer at the start while we encode, so the SOF
+    // flush never sees a half written response
+    obqFlush(m_queue);
+    m_ok = obqGetEmptyBufferTimeout(m_queue, timeout) == MSG_OK;
+    if (m_ok)
+    {
+        m_begin = m_queue->ptr;
+        m_ptr = m_begin;
+        m_top = m_queue->top;
+    }
+    if (m_ok && m_framed)
+    {
+        // the length is filled in and the CRC appended by send()
+        m_top -= FRAME_CRC_SIZE;
+        u8(FRAME_SOF);
+        u8(0);
+        u8(frame->type);
+        u8(frame->sequence);
+    }
+}
+
+usbResponse::~usbResponse()
+{
+    if (m_locked)
+    {
+        chMtxUnlock(m_lock);
+    }
+}
+
+uint8_t *usbResponse::claim(size_t n)
+{
+    if (!m_ok || n > static_cast<size_t>(m_top - m_ptr))
+    {
+        chDbgAssert(!m_ok, "USB response overflow");
+        m_ok = false;
+        return nullptr;
+    }
+    uint8_t *p = m_ptr;
+    m_ptr += n;
+    return p;
+}
+
+void usbResponse::u8(uint8_t value)
+{
+    if (uint8_t *p = claim(1))
+    {
+        p[0] = value;
+    }
+}
+
+void usbResponse::u16(uint16_t value)
+{
+    if (uint8_t *p = claim(2))
+    {
+        p[0] = value & 0xFF;
+        p[1] = value >> 8;
+    }
+}
+
+void usbResponse::u32(uint32_t value)
+{
+    if (uint8_t *p = claim(4))
+    {
+        p[0] = value & 0xFF;
+        p[1] = (value >> 8) & 0xFF;
+        p[2] = (value >> 16) & 0xFF;
+        p[3] = (value >> 24) & 0xFF;
+    }
+}
+
+void usbResponse::bytes(std::span<const uint8_t> data)
+{
+    if (uint8_t *p = claim(data.size()))
+    {
+        std::memcpy(p, data.data(), data.size());
+    }
+}
+
+size_t usbResponse::send()
+{
+    size_t n = size();
+
+    // an overflowed response is dropped whole, the buffer is reused by the next one
+    if (!m_ok || (n == 0U && !m_framed))
+    {
+        return 0;
+    }
+    if (m_framed)
+    {
+        m_begin[1] = static_cast<uint8_t>(n);
+        const uint16_t crc = crc16(&m_begin[1], FRAME_HEADER_SIZE - 1 + n);
+        m_top += FRAME_CRC_SIZE;
+        u16(crc);
+        n += FRAME_OVERHEAD;
+    }
+    obqPostFullBuffer(m_queue, n);
+    m_ok = false;
+    return n;
+}
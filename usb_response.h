@@ -0,0 +1,59 @@
+#pragma once
+#include "ch.h"
+#include "hal.h"
+#include "usb_frame.h"
+#include <span>
+#include <optional>
+#include <cstdint>
+
+/* Encodes one response straight into a free buffer of a CDC output queue
+   and hands the whole buffer to the USB driver at once, so a response is
+   one USB transfer and needs no staging copy. Fields are little-endian.
+   Responses must fit one queue buffer (SERIAL_USB_BUFFERS_SIZE). Given a
+   frame tag the response goes out as one frame (usb_frame.h), the header
+   and CRC are added here and the encoders stay the same. */
+class usbResponse
+{
+private:
+    output_buffers_queue_t *m_queue;
+    mutex_t *m_lock;
+    uint8_t *m_begin;
+    uint8_t *m_ptr;
+    uint8_t *m_top;
+    bool m_ok;
+    bool m_locked;
+    bool m_framed;
+
+    uint8_t *claim(size_t n);
+
+public:
+    // responses from different threads to one port are serialized
+    explicit usbResponse(SerialUSBDriver *sdup, std::optional<frameTag> frame = std::nullopt,
+                         sysinterval_t timeout = TIME_INFINITE);
+    ~usbResponse();
+    usbResponse(const usbResponse &) = delete;
+    usbResponse &operator=(const usbResponse &) = delete;
+    bool valid() const { return m_ok; };
+    // bytes that still fit, 0 once the response is unusable
+    size_t room() const { return m_ok ? static_cast<size_t>(m_top - m_ptr) : 0U; };
+    // bytes encoded so far, frame header not counted
+    size_t size() const { return static_cast<size_t>(m_ptr - m_begin) - (m_framed ? FRAME_HEADER_SIZE : 0U); };
+    void u8(uint8_t value);
+    void u16(uint16_t value);
+    void u32(uint32_t value);
+    void bytes(std::span<const uint8_t> data);
+    // raw space for encoders working on a fixed layout, empty if it does not fit
+    template <size_t N>
+    std::optional<std::span<uint8_t, N>> reserve()
+    {
+        static_assert(N + FRAME_OVERHEAD <= SERIAL_USB_BUFFERS_SIZE, "response larger than a USB queue buffer");
+        uint8_t *p = claim(N);
+        if (p == nullptr)
+        {
+            return std::nullopt;
+        }
+        return std::span<uint8_t, N>(p, N);
+    };
+    // queue the buffer for transmission, returns the bytes sent
+    size_t send();
+};
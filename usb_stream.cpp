@@ -0,0 +1,256 @@
+#include "usb_stream.h"
+#include "usb_response.h"
+#include "usbcfg.h"
+#include "api.h"
+#include "analog.h"
+#include "can_layout.h"
+#include <bit>
+#include <algorithm>
+
+usbStream::usbStream()
+{
+    m_mask = 0;
+    m_divider = 1;
+    m_count = 0;
+    m_sequence = 0;
+    m_flushMs = 0;
+    m_keyInterval = 0;
+    m_active = false;
+    m_framed = false;
+    m_restarted = false;
+
+    m_batch.fill(0);
+    m_batchFill = 0;
+    m_batchId = apiresponse::streamBatchResponse;
+    m_batchFramed = false;
+    m_batchSequence = 0;
+    m_batchStart = 0;
+    m_batchFlush = 0;
+}
+
+void usbStream::start(uint32_t mask, uint16_t divider, uint16_t flushMs, uint16_t keyInterval, bool framed)
+{
+    chSysLock();
+    m_mask = mask & ((1UL << CAN_SIGNAL_COUNT) - 1);
+    m_divider = (divider == 0U) ? 1U : (divider > STREAM_MAX_DIVIDER ? STREAM_MAX_DIVIDER : divider);
+    m_flushMs = (flushMs > STREAM_MAX_FLUSH_MS) ? STREAM_MAX_FLUSH_MS : flushMs;
+    m_keyInterval = keyInterval;
+    m_count = 0;
+    m_sequence = 0;
+    m_active = m_mask != 0U;
+    m_framed = framed;
+    m_restarted = true;
+    chSysUnlock();
+}
+
+void usbStream::stop()
+{
+    chSysLock();
+    m_active = false;
+    chSysUnlock();
+}
+
+static std::optional<frameTag> streamFrame(bool framed, apiresponse id, uint16_t sequence)
+{
+    if (!framed)
+    {
+        return std::nullopt;
+    }
+    return frameTag{static_cast<uint8_t>(id), static_cast<uint8_t>(sequence)};
+}
+
+bool usbStream::flush()
+{
+    if (m_batchFill == 0U)
+    {
+        return true;
+    }
+    // never wait for the host, a full queue costs this batch and nothing else
+    usbResponse resp(&SDU2, streamFrame(m_batchFramed, m_batchId, m_batchSequence), TIME_IMMEDIATE);
+    resp.bytes(std::span<const uint8_t>(m_batch.data(), m_batchFill));
+    // deltas after a lost batch would decode against the wrong values
+    const bool lost = resp.send() == 0U && m_batchId == apiresponse::streamDeltaResponse;
+    if (lost)
+    {
+        m_encoder.forceKey();
+    }
+    m_batchFill = 0;
+    return !lost;
+}
+
+static_assert(CAN_SIGNAL_COUNT <= STREAM_CODEC_MAX_CHANNELS, "stream mask wider than the delta codec");
+
+// sequence, sample time, u16 values
+static size_t rawRecord(uint16_t sequence, uint32_t time, std::span<const uint16_t> values, uint8_t *out)
+{
+    out[0] = sequence & 0xFF;
+    out[1] = sequence >> 8;
+    out[2] = time & 0xFF;
+    out[3] = (time >> 8) & 0xFF;
+    out[4] = (time >> 16) & 0xFF;
+    out[5] = (time >> 24) & 0xFF;
+    size_t n = 6;
+    for (const uint16_t value : values)
+    {
+        out[n++] = value & 0xFF;
+        out[n++] = value >> 8;
+    }
+    return n;
+}
+
+void usbStream::sample()
+{
+    chSysLock();
+    const bool due = m_active && ++m_count >= m_divider;
+    const uint32_t mask = m_mask;
+    const uint16_t sequence = m_sequence;
+    const uint16_t flushMs = m_flushMs;
+    const uint16_t keyInterval = m_keyInterval;
+    const bool framed = m_framed;
+    const bool restarted = m_restarted;
+    if (due)
+    {
+        m_count = 0;
+        m_sequence++;
+        m_restarted = false;
+    }
+    chSysUnlock();
+
+    if (!due || usbGetDriverStateI(serusbcfg.usbp) != USB_ACTIVE)
+    {
+        return;
+    }
+    if (restarted)
+    {
+        flush();
+        m_encoder.reset(keyInterval);
+    }
+
+    const inputs &g_inputs = getInputs();
+    const canSnapshot snap = readSnapshot(g_inputs);
+    const uint32_t time = g_inputs.getAnalogSampleTime();
+    std::array<uint16_t, CAN_SIGNAL_COUNT> selected;
+    size_t count = 0;
+    for (uint32_t bits = mask; bits != 0U; bits &= bits - 1)
+    {
+        selected[count++] = snap[std::countr_zero(bits)];
+    }
+    const std::span<const uint16_t> values(selected.data(), count);
+
+    const bool delta = keyInterval != 0U;
+    const apiresponse id = delta ? apiresponse::streamDeltaResponse : apiresponse::streamBatchResponse;
+    const size_t header = delta ? STREAM_DELTA_HEADER : STREAM_BATCH_HEADER;
+    const size_t limit = USB_BULK_PACKET_SIZE - (framed ? FRAME_OVERHEAD : 0U);
+
+    std::array<uint8_t, deltaEncoder::maxRecord(CAN_SIGNAL_COUNT)> record;
+    uint16_t reference = m_encoder.lastSequence();
+    size_t size = (flushMs != 0U && delta) ? m_encoder.encode(sequence, time, values, record.data())
+                                           : rawRecord(sequence, time, values, record.data());
+
+    if (m_batchFill != 0U && (id != m_batchId || framed != m_batchFramed || m_batchFill + size > limit) && !flush() &&
+        delta)
+    {
+        // this record was coded against the lost batch, code it again as a
+        // keyframe against itself
+        reference = sequence;
+        size = m_encoder.encode(sequence, time, values, record.data());
+    }
+
+    if (flushMs == 0U || header + size > limit)
+    {
+        // unbatched, or a record too large for a batch: one 0x12 packet
+        flush();
+        m_encoder.forceKey();
+        usbResponse resp(&SDU2, streamFrame(framed, apiresponse::streamResponse, sequence), TIME_IMMEDIATE);
+        resp.u8(static_cast<uint8_t>(apiresponse::streamResponse));
+        resp.u16(sequence);
+        resp.u32(time);
+        resp.u32(mask);
+        for (const uint16_t value : values)
+        {
+            resp.u16(value);
+        }
+        resp.send();
+        return;
+    }
+
+    if (m_batchFill == 0U)
+    {
+        m_batch[0] = static_cast<uint8_t>(id);
+        m_batch[1] = 0;
+        m_batch[2] = mask & 0xFF;
+        m_batch[3] = (mask >> 8) & 0xFF;
+        m_batch[4] = (mask >> 16) & 0xFF;
+        m_batch[5] = (mask >> 24) & 0xFF;
+        if (delta)
+        {
+            m_batch[6] = reference & 0xFF;
+            m_batch[7] = reference >> 8;
+        }
+        m_batchFill = header;
+        m_batchId = id;
+        m_batchFramed = framed;
+        m_batchSequence = static_cast<uint8_t>(sequence);
+        m_batchStart = chVTGetSystemTimeX();
+        m_batchFlush = TIME_MS2I(flushMs);
+    }
+
+    std::copy_n(record.begin(), size, &m_batch[m_batchFill]);
+    m_batchFill += size;
+    m_batch[1]++;
+
+    // no room for another sample like this one, nothing to wait for
+    if (m_batchFill + size > limit)
+    {
+        flush();
+    }
+}
+
+sysinterval_t usbStream::idleTime() const
+{
+    if (m_batchFill == 0U)
+    {
+        return TIME_INFINITE;
+    }
+    const sysinterval_t elapsed = chTimeDiffX(m_batchStart, chVTGetSystemTimeX());
+    return (elapsed >= m_batchFlush) ? TIME_IMMEDIATE : m_batchFlush - elapsed;
+}
+
+void usbStream::service()
+{
+    if (m_batchFill != 0U && (!m_active || chTimeDiffX(m_batchStart, chVTGetSystemTimeX()) >= m_batchFlush))
+    {
+        flush();
+    }
+}
+
+usbStream &getUsbStream()
+{
+    static usbStream instance;
+    return instance;
+}
+
+static THD_WORKING_AREA(waUsbStreamThread, 512);
+static void UsbStreamThread(void *arg)
+{
+    (void)arg;
+    chRegSetThreadName("USB Stream Thread");
+
+    event_listener_t el_analog;
+    chEvtRegister(&getAnalogEvent(), &el_analog, 0);
+    usbStream &stream = getUsbStream();
+
+    while (true)
+    {
+        if (chEvtWaitAnyTimeout(EVENT_MASK(0), stream.idleTime()) != 0U)
+        {
+            stream.sample();
+        }
+        stream.service();
+    }
+}
+
+void startUsbStream()
+{
+    chThdCreateStatic(waUsbStreamThread, sizeof(waUsbStreamThread), NORMALPRIO + 1, UsbStreamThread, nullptr);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "ch.h"
+#include "hal.h"
+#include "api.h"
+#include "stream_codec.h"
+#include <array>
+#include <cstdint>
+
+constexpr uint16_t STREAM_MAX_DIVIDER = 1000;
+constexpr uint16_t STREAM_MAX_FLUSH_MS = 1000;
+// full-speed bulk wMaxPacketSize of the CDC data endpoint (usbcfg.c)
+constexpr size_t USB_BULK_PACKET_SIZE = 64;
+// 0x13 packet: id, record count, channel mask
+constexpr size_t STREAM_BATCH_HEADER = 1 + 1 + 4;
+
+/* Pushes the selected channels every divider-th ADC cycle until stopped,
+   on the second CDC port (SDU2) so the stream never queues behind commands.
+   With a flush timeout the samples are batched into 0x13 packets filled up
+   to one bulk packet, a batch goes out when the next sample would not fit
+   or when its first sample is flushMs old. Without one every sample is its
+   own 0x12 packet. A key interval switches the batches to the delta coded
+   0x14 packets of stream_codec.h. The sequence number counts every due sample, so samples
+   the USB queue had no room for show up as a gap on the host. */
+class usbStream
+{
+private:
+    uint32_t m_mask;     // bit n = signal n of the CAN signal list
+    uint16_t m_divider;
+    uint16_t m_count;
+    uint16_t m_sequence;
+    uint16_t m_flushMs;
+    uint16_t m_keyInterval; // 0 = plain 0x13 batches
+    bool m_active;
+    bool m_framed;      // started by a framed request, stream in frames too
+    bool m_restarted;
+
+    // batch being filled, only touched by the stream thread
+    std::array<uint8_t, USB_BULK_PACKET_SIZE> m_batch;
+    size_t m_batchFill;
+    apiresponse m_batchId;
+    bool m_batchFramed;
+    uint8_t m_batchSequence;
+    systime_t m_batchStart;
+    sysinterval_t m_batchFlush;
+    deltaEncoder m_encoder;
+
+    // false if a batch of deltas was lost and the encoder forced a keyframe
+    bool flush();
+
+public:
+    usbStream();
+    void start(uint32_t mask, uint16_t divider, uint16_t flushMs, uint16_t keyInterval, bool framed);
+    void stop();
+    // called by the stream thread after every ADC cycle
+    void sample();
+    // how long the stream thread may wait before a pending batch is due
+    sysinterval_t idleTime() const;
+    // sends a batch that is due or whose stream was stopped
+    void service();
+};
+
+usbStream &getUsbStream();
+void startUsbStream();
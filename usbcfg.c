@@ -15,29 +15,70 @@
 */
 #include "usbcfg.h"
 #include "hal.h"
+#if USE_GS_USB
+#include "gs_usb.h"
+#endif
 
-/* Virtual serial port over USB.*/
+/* Virtual serial ports over USB: SDU1 carries the commands, SDU2 the stream.*/
 SerialUSBDriver SDU1;
+SerialUSBDriver SDU2;
 static volatile bool usb_configured_flag = false;  // set when host sets configuration
 
+#if USE_GS_USB
 /*
- * Endpoints to be used for USBD2.
+ * The Linux gs_usb driver binds to interface 0 and older kernels use
+ * EP1 IN and EP2 OUT whatever the descriptors say, the CDC ports move up.
+ */
+#define GSUSB_DATA_IN_EP                1
+#define GSUSB_DATA_OUT_EP               2
+#define GSUSB_IF_NUM                    0
+#define USBD2_DATA_REQUEST_EP           3
+#define USBD2_DATA_AVAILABLE_EP         3
+#define USBD2_INTERRUPT_REQUEST_EP      4
+#define USBD3_DATA_REQUEST_EP           5
+#define USBD3_DATA_AVAILABLE_EP         5
+#define USBD3_INTERRUPT_REQUEST_EP      6
+#define USB_CDC_CIF_NUM0                1
+#define USB_CDC_DIF_NUM0                2
+#define USB_CDC_CIF_NUM1                3
+#define USB_CDC_DIF_NUM1                4
+#define USB_NUM_INTERFACES              5
+#define USB_VENDOR_ID                   0x1D50
+#define USB_PRODUCT_ID                  0x606F
+#else
+/*
+ * Endpoints to be used for USBD2 (commands) and USBD3 (stream).
  */
 #define USBD2_DATA_REQUEST_EP           1
 #define USBD2_DATA_AVAILABLE_EP         1
 #define USBD2_INTERRUPT_REQUEST_EP      2
+#define USBD3_DATA_REQUEST_EP           3
+#define USBD3_DATA_AVAILABLE_EP         3
+#define USBD3_INTERRUPT_REQUEST_EP      4
+
+/*
+ * Interfaces, a communication and a data interface per CDC function.
+ */
+#define USB_CDC_CIF_NUM0                0
+#define USB_CDC_DIF_NUM0                1
+#define USB_CDC_CIF_NUM1                2
+#define USB_CDC_DIF_NUM1                3
+#define USB_NUM_INTERFACES              4
+#define USB_VENDOR_ID                   0x0483
+#define USB_PRODUCT_ID                  0x5740
+#endif
 
 /*
  * USB Device Descriptor.
  */
 static const uint8_t vcom_device_descriptor_data[18] = {
-  USB_DESC_DEVICE       (0x0110,        /* bcdUSB (1.1).                    */
-                         0x02,          /* bDeviceClass (CDC).              */
-                         0x00,          /* bDeviceSubClass.                 */
-                         0x00,          /* bDeviceProtocol.                 */
+  USB_DESC_DEVICE       (0x0200,        /* bcdUSB (2.0), needed for IADs.   */
+                         0xEF,          /* bDeviceClass (Miscellaneous).    */
+                         0x02,          /* bDeviceSubClass (Common Class).  */
+                         0x01,          /* bDeviceProtocol (IAD).           */
                          0x40,          /* bMaxPacketSize.                  */
-                         0x0483,        /* idVendor (ST).                   */
-                         0x5740,        /* idProduct.                       */
+                         USB_VENDOR_ID, /* idVendor (ST, or gs_usb).        */
+                         USB_PRODUCT_ID,/* idProduct.                       */
                          0x0200,        /* bcdDevice.                       */
                          1,             /* iManufacturer.                   */
                          2,             /* iProduct.                        */
@@ -53,81 +94,150 @@ static const USBDescriptor vcom_device_descriptor = {
   vcom_device_descriptor_data
 };
 
-/* Configuration Descriptor tree for a CDC.*/
-static const uint8_t vcom_configuration_descriptor_data[67] = {
+/*
+ * One CDC-ACM function: communication interface with its interrupt
+ * endpoint, data interface with the bulk pair. 58 bytes.
+ */
+#define CDC_IF_DESC_SET_SIZE                                                  \
+  (USB_DESC_INTERFACE_SIZE + 5 + 5 + 4 + 5 + USB_DESC_ENDPOINT_SIZE +         \
+   USB_DESC_INTERFACE_SIZE + (USB_DESC_ENDPOINT_SIZE * 2))
+
+#define CDC_IF_DESC_SET(comIfNum, datIfNum, comInEp, datOutEp, datInEp)      \
+  /* Interface Descriptor.*/                                                  \
+  USB_DESC_INTERFACE    (comIfNum,      /* bInterfaceNumber.                */\
+                         0x00,          /* bAlternateSetting.               */\
+                         0x01,          /* bNumEndpoints.                   */\
+                         0x02,          /* bInterfaceClass (Communications  \
+                                           Interface Class, CDC section     \
+                                           4.2).                            */\
+                         0x02,          /* bInterfaceSubClass (Abstract     \
+                                         Control Model, CDC section 4.3).   */\
+                         0x01,          /* bInterfaceProtocol (AT commands, \
+                                           CDC section 4.4).                */\
+                         0),            /* iInterface.                      */\
+  /* Header Functional Descriptor (CDC section 5.2.3).*/                      \
+  USB_DESC_BYTE         (5),            /* bLength.                         */\
+  USB_DESC_BYTE         (0x24),         /* bDescriptorType (CS_INTERFACE).  */\
+  USB_DESC_BYTE         (0x00),         /* bDescriptorSubtype (Header       \
+                                           Functional Descriptor.           */\
+  USB_DESC_BCD          (0x0110),       /* bcdCDC.                          */\
+  /* Call Management Functional Descriptor. */                                \
+  USB_DESC_BYTE         (5),            /* bFunctionLength.                 */\
+  USB_DESC_BYTE         (0x24),         /* bDescriptorType (CS_INTERFACE).  */\
+  USB_DESC_BYTE         (0x01),         /* bDescriptorSubtype (Call Management\
+                                           Functional Descriptor).          */\
+  USB_DESC_BYTE         (0x00),         /* bmCapabilities (D0+D1).          */\
+  USB_DESC_BYTE         (datIfNum),     /* bDataInterface.                  */\
+  /* ACM Functional Descriptor.*/                                             \
+  USB_DESC_BYTE         (4),            /* bFunctionLength.                 */\
+  USB_DESC_BYTE         (0x24),         /* bDescriptorType (CS_INTERFACE).  */\
+  USB_DESC_BYTE         (0x02),         /* bDescriptorSubtype (Abstract     \
+                                           Control Management Descriptor).  */\
+  USB_DESC_BYTE         (0x02),         /* bmCapabilities.                  */\
+  /* Union Functional Descriptor.*/                                           \
+  USB_DESC_BYTE         (5),            /* bFunctionLength.                 */\
+  USB_DESC_BYTE         (0x24),         /* bDescriptorType (CS_INTERFACE).  */\
+  USB_DESC_BYTE         (0x06),         /* bDescriptorSubtype (Union        \
+                                           Functional Descriptor).          */\
+  USB_DESC_BYTE         (comIfNum),     /* bMasterInterface (Communication  \
+                                           Class Interface).                */\
+  USB_DESC_BYTE         (datIfNum),     /* bSlaveInterface0 (Data Class     \
+                                           Interface).                      */\
+  /* Interrupt Endpoint Descriptor.*/                                         \
+  USB_DESC_ENDPOINT     (comInEp|0x80,                                        \
+                         0x03,          /* bmAttributes (Interrupt).        */\
+                         0x0008,        /* wMaxPacketSize.                  */\
+                         0xFF),         /* bInterval.                       */\
+  /* Interface Descriptor.*/                                                  \
+  USB_DESC_INTERFACE    (datIfNum,      /* bInterfaceNumber.                */\
+                         0x00,          /* bAlternateSetting.               */\
+                         0x02,          /* bNumEndpoints.                   */\
+                         0x0A,          /* bInterfaceClass (Data Class      \
+                                           Interface, CDC section 4.5).     */\
+                         0x00,          /* bInterfaceSubClass (CDC section  \
+                                           4.6).                            */\
+                         0x00,          /* bInterfaceProtocol (CDC section  \
+                                           4.7).                            */\
+                         0x00),         /* iInterface.                      */\
+  /* Bulk OUT Endpoint Descriptor.*/                                          \
+  USB_DESC_ENDPOINT     (datOutEp,      /* bEndpointAddress.                */\
+                         0x02,          /* bmAttributes (Bulk).             */\
+                         0x0040,        /* wMaxPacketSize.                  */\
+                         0x00),         /* bInterval.                       */\
+  /* Bulk IN Endpoint Descriptor.*/                                           \
+  USB_DESC_ENDPOINT     (datInEp|0x80,  /* bEndpointAddress.                */\
+                         0x02,          /* bmAttributes (Bulk).             */\
+                         0x0040,        /* wMaxPacketSize.                  */\
+                         0x00)          /* bInterval.                       */
+
+/*
+ * Interface Association Descriptor in front of each CDC function, so the
+ * host binds one driver to each communication/data interface pair.
+ */
+#define IAD_CDC_IF_DESC_SET_SIZE                                              \
+  (USB_DESC_INTERFACE_ASSOCIATION_SIZE + CDC_IF_DESC_SET_SIZE)
+
+#define IAD_CDC_IF_DESC_SET(comIfNum, datIfNum, comInEp, datOutEp, datInEp)  \
+  USB_DESC_INTERFACE_ASSOCIATION(comIfNum, /* bFirstInterface.            */\
+                         2,             /* bInterfaceCount.                 */\
+                         0x02,          /* bFunctionClass (CDC).            */\
+                         0x02,          /* bFunctionSubClass (ACM).         */\
+                         0x01,          /* bFunctionProcotol (AT commands). */\
+                         0),            /* iInterface.                      */\
+  CDC_IF_DESC_SET(comIfNum, datIfNum, comInEp, datOutEp, datInEp)
+
+#if USE_GS_USB
+/*
+ * gs_usb vendor interface with its bulk pair. 23 bytes.
+ */
+#define GSUSB_IF_DESC_SET_SIZE                                                \
+  (USB_DESC_INTERFACE_SIZE + (USB_DESC_ENDPOINT_SIZE * 2))
+
+#define GSUSB_IF_DESC_SET                                                     \
+  USB_DESC_INTERFACE    (GSUSB_IF_NUM,  /* bInterfaceNumber.                */\
+                         0x00,          /* bAlternateSetting.               */\
+                         0x02,          /* bNumEndpoints.                   */\
+                         0xFF,          /* bInterfaceClass (Vendor).        */\
+                         0xFF,          /* bInterfaceSubClass.              */\
+                         0xFF,          /* bInterfaceProtocol.              */\
+                         0),            /* iInterface.                      */\
+  USB_DESC_ENDPOINT     (GSUSB_DATA_IN_EP|0x80,                               \
+                         0x02,          /* bmAttributes (Bulk).             */\
+                         0x0040,        /* wMaxPacketSize.                  */\
+                         0x00),         /* bInterval.                       */\
+  USB_DESC_ENDPOINT     (GSUSB_DATA_OUT_EP,                                   \
+                         0x02,          /* bmAttributes (Bulk).             */\
+                         0x0040,        /* wMaxPacketSize.                  */\
+                         0x00),         /* bInterval.                       */
+#else
+#define GSUSB_IF_DESC_SET_SIZE          0
+#define GSUSB_IF_DESC_SET
+#endif
+
+#define VCOM_CONFIGURATION_SIZE                                               \
+  (USB_DESC_CONFIGURATION_SIZE + GSUSB_IF_DESC_SET_SIZE +                     \
+   (IAD_CDC_IF_DESC_SET_SIZE * 2))
+
+/* Configuration Descriptor tree for two CDCs and the gs_usb interface.*/
+static const uint8_t vcom_configuration_descriptor_data[VCOM_CONFIGURATION_SIZE] = {
   /* Configuration Descriptor.*/
-  USB_DESC_CONFIGURATION(67,            /* wTotalLength.                    */
-                         0x02,          /* bNumInterfaces.                  */
+  USB_DESC_CONFIGURATION(VCOM_CONFIGURATION_SIZE, /* wTotalLength.        */
+                         USB_NUM_INTERFACES, /* bNumInterfaces.             */
                          0x01,          /* bConfigurationValue.             */
                          0,             /* iConfiguration.                  */
                          0xC0,          /* bmAttributes (self powered).     */
                          50),           /* bMaxPower (100mA).               */
-  /* Interface Descriptor.*/
-  USB_DESC_INTERFACE    (0x00,          /* bInterfaceNumber.                */
-                         0x00,          /* bAlternateSetting.               */
-                         0x01,          /* bNumEndpoints.                   */
-                         0x02,          /* bInterfaceClass (Communications
-                                           Interface Class, CDC section
-                                           4.2).                            */
-                         0x02,          /* bInterfaceSubClass (Abstract
-                                         Control Model, CDC section 4.3).   */
-                         0x01,          /* bInterfaceProtocol (AT commands,
-                                           CDC section 4.4).                */
-                         0),            /* iInterface.                      */
-  /* Header Functional Descriptor (CDC section 5.2.3).*/
-  USB_DESC_BYTE         (5),            /* bLength.                         */
-  USB_DESC_BYTE         (0x24),         /* bDescriptorType (CS_INTERFACE).  */
-  USB_DESC_BYTE         (0x00),         /* bDescriptorSubtype (Header
-                                           Functional Descriptor.           */
-  USB_DESC_BCD          (0x0110),       /* bcdCDC.                          */
-  /* Call Management Functional Descriptor. */
-  USB_DESC_BYTE         (5),            /* bFunctionLength.                 */
-  USB_DESC_BYTE         (0x24),         /* bDescriptorType (CS_INTERFACE).  */
-  USB_DESC_BYTE         (0x01),         /* bDescriptorSubtype (Call Management
-                                           Functional Descriptor).          */
-  USB_DESC_BYTE         (0x00),         /* bmCapabilities (D0+D1).          */
-  USB_DESC_BYTE         (0x01),         /* bDataInterface.                  */
-  /* ACM Functional Descriptor.*/
-  USB_DESC_BYTE         (4),            /* bFunctionLength.                 */
-  USB_DESC_BYTE         (0x24),         /* bDescriptorType (CS_INTERFACE).  */
-  USB_DESC_BYTE         (0x02),         /* bDescriptorSubtype (Abstract
-                                           Control Management Descriptor).  */
-  USB_DESC_BYTE         (0x02),         /* bmCapabilities.                  */
-  /* Union Functional Descriptor.*/
-  USB_DESC_BYTE         (5),            /* bFunctionLength.                 */
-  USB_DESC_BYTE         (0x24),         /* bDescriptorType (CS_INTERFACE).  */
-  USB_DESC_BYTE         (0x06),         /* bDescriptorSubtype (Union
-                                           Functional Descriptor).          */
-  USB_DESC_BYTE         (0x00),         /* bMasterInterface (Communication
-                                           Class Interface).                */
-  USB_DESC_BYTE         (0x01),         /* bSlaveInterface0 (Data Class
-                                           Interface).                      */
-  /* Endpoint 2 Descriptor.*/
-  USB_DESC_ENDPOINT     (USBD2_INTERRUPT_REQUEST_EP|0x80,
-                         0x03,          /* bmAttributes (Interrupt).        */
-                         0x0008,        /* wMaxPacketSize.                  */
-                         0xFF),         /* bInterval.                       */
-  /* Interface Descriptor.*/
-  USB_DESC_INTERFACE    (0x01,          /* bInterfaceNumber.                */
-                         0x00,          /* bAlternateSetting.               */
-                         0x02,          /* bNumEndpoints.                   */
-                         0x0A,          /* bInterfaceClass (Data Class
-                                           Interface, CDC section 4.5).     */
-                         0x00,          /* bInterfaceSubClass (CDC section
-                                           4.6).                            */
-                         0x00,          /* bInterfaceProtocol (CDC section
-                                           4.7).                            */
-                         0x00),         /* iInterface.                      */
-  /* Endpoint 3 Descriptor.*/
-  USB_DESC_ENDPOINT     (USBD2_DATA_AVAILABLE_EP,       /* bEndpointAddress.*/
-                         0x02,          /* bmAttributes (Bulk).             */
-                         0x0040,        /* wMaxPacketSize.                  */
-                         0x00),         /* bInterval.                       */
-  /* Endpoint 1 Descriptor.*/
-  USB_DESC_ENDPOINT     (USBD2_DATA_REQUEST_EP|0x80,    /* bEndpointAddress.*/
-                         0x02,          /* bmAttributes (Bulk).             */
-                         0x0040,        /* wMaxPacketSize.                  */
-                         0x00)          /* bInterval.                       */
+  GSUSB_IF_DESC_SET
+  IAD_CDC_IF_DESC_SET(USB_CDC_CIF_NUM0,
+                      USB_CDC_DIF_NUM0,
+                      USBD2_INTERRUPT_REQUEST_EP,
+                      USBD2_DATA_AVAILABLE_EP,
+                      USBD2_DATA_REQUEST_EP),
+  IAD_CDC_IF_DESC_SET(USB_CDC_CIF_NUM1,
+                      USB_CDC_DIF_NUM1,
+                      USBD3_INTERRUPT_REQUEST_EP,
+                      USBD3_DATA_AVAILABLE_EP,
+                      USBD3_DATA_REQUEST_EP)
 };
 
 /*
@@ -215,58 +325,147 @@ static const USBDescriptor *get_descriptor(USBDriver *usbp,
 }
 
 /**
- * @brief   IN EP1 state.
+ * @brief   IN state of the command data endpoint.
+ */
+static USBInEndpointState cmd_data_instate;
+
+/**
+ * @brief   OUT state of the command data endpoint.
+ */
+static USBOutEndpointState cmd_data_outstate;
+
+/**
+ * @brief   Command data endpoint initialization structure (both IN and OUT).
+ */
+static const USBEndpointConfig cmd_data_config = {
+  USB_EP_MODE_TYPE_BULK,
+  NULL,
+  sduDataTransmitted,
+  sduDataReceived,
+  0x0040,
+  0x0040,
+  &cmd_data_instate,
+  &cmd_data_outstate,
+  2,
+  NULL
+};
+
+/**
+ * @brief   IN state of the command interrupt endpoint.
+ */
+static USBInEndpointState cmd_intr_instate;
+
+/**
+ * @brief   Command interrupt endpoint initialization structure (IN only).
+ */
+static const USBEndpointConfig cmd_intr_config = {
+  USB_EP_MODE_TYPE_INTR,
+  NULL,
+  sduInterruptTransmitted,
+  NULL,
+  0x0010,
+  0x0000,
+  &cmd_intr_instate,
+  NULL,
+  1,
+  NULL
+};
+
+/**
+ * @brief   IN state of the stream data endpoint.
  */
-static USBInEndpointState ep1instate;
+static USBInEndpointState stream_data_instate;
 
 /**
- * @brief   OUT EP1 state.
+ * @brief   OUT state of the stream data endpoint.
  */
-static USBOutEndpointState ep1outstate;
+static USBOutEndpointState stream_data_outstate;
 
 /**
- * @brief   EP1 initialization structure (both IN and OUT).
+ * @brief   Stream data endpoint initialization structure (both IN and OUT).
  */
-static const USBEndpointConfig ep1config = {
+static const USBEndpointConfig stream_data_config = {
   USB_EP_MODE_TYPE_BULK,
   NULL,
   sduDataTransmitted,
   sduDataReceived,
   0x0040,
   0x0040,
-  &ep1instate,
-  &ep1outstate,
+  &stream_data_instate,
+  &stream_data_outstate,
   2,
   NULL
 };
 
 /**
- * @brief   IN EP2 state.
+ * @brief   IN state of the stream interrupt endpoint.
  */
-static USBInEndpointState ep2instate;
+static USBInEndpointState stream_intr_instate;
 
 /**
- * @brief   EP2 initialization structure (IN only).
+ * @brief   Stream interrupt endpoint initialization structure (IN only).
  */
-static const USBEndpointConfig ep2config = {
+static const USBEndpointConfig stream_intr_config = {
   USB_EP_MODE_TYPE_INTR,
   NULL,
   sduInterruptTransmitted,
   NULL,
   0x0010,
   0x0000,
-  &ep2instate,
+  &stream_intr_instate,
   NULL,
   1,
   NULL
 };
 
+#if USE_GS_USB
+/**
+ * @brief   IN state of the gs_usb endpoint.
+ */
+static USBInEndpointState gs_in_instate;
+
+/**
+ * @brief   gs_usb IN endpoint initialization structure, frames to the host.
+ */
+static const USBEndpointConfig gs_in_config = {
+  USB_EP_MODE_TYPE_BULK,
+  NULL,
+  gsUsbDataTransmitted,
+  NULL,
+  0x0040,
+  0x0000,
+  &gs_in_instate,
+  NULL,
+  1,
+  NULL
+};
+
+/**
+ * @brief   OUT state of the gs_usb endpoint.
+ */
+static USBOutEndpointState gs_out_outstate;
+
+/**
+ * @brief   gs_usb OUT endpoint initialization structure, frames to send.
+ */
+static const USBEndpointConfig gs_out_config = {
+  USB_EP_MODE_TYPE_BULK,
+  NULL,
+  NULL,
+  gsUsbDataReceived,
+  0x0000,
+  0x0040,
+  NULL,
+  &gs_out_outstate,
+  1,
+  NULL
+};
+#endif
+
 /*
  * Handles the USB driver global events.
  */
 static void usb_event(USBDriver *usbp, usbevent_t event) {
-  extern SerialUSBDriver SDU1;
-
   switch (event) {
   case USB_EVENT_ADDRESS:
     return;
@@ -276,11 +475,21 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
     /* Enables the endpoints specified into the configuration.
        Note, this callback is invoked from an ISR so I-Class functions
        must be used.*/
-    usbInitEndpointI(usbp, USBD2_DATA_REQUEST_EP, &ep1config);
-    usbInitEndpointI(usbp, USBD2_INTERRUPT_REQUEST_EP, &ep2config);
+    usbInitEndpointI(usbp, USBD2_DATA_REQUEST_EP, &cmd_data_config);
+    usbInitEndpointI(usbp, USBD2_INTERRUPT_REQUEST_EP, &cmd_intr_config);
+    usbInitEndpointI(usbp, USBD3_DATA_REQUEST_EP, &stream_data_config);
+    usbInitEndpointI(usbp, USBD3_INTERRUPT_REQUEST_EP, &stream_intr_config);
+#if USE_GS_USB
+    usbInitEndpointI(usbp, GSUSB_DATA_IN_EP, &gs_in_config);
+    usbInitEndpointI(usbp, GSUSB_DATA_OUT_EP, &gs_out_config);
+#endif
 
     /* Resetting the state of the CDC subsystem.*/
     sduConfigureHookI(&SDU1);
+    sduConfigureHookI(&SDU2);
+#if USE_GS_USB
+    gsUsbConfigureHookI(usbp);
+#endif
     usb_configured_flag = true;
     chSysUnlockFromISR();
     return;
@@ -293,6 +502,10 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
 
     /* Disconnection event on suspend.*/
     sduSuspendHookI(&SDU1);
+    sduSuspendHookI(&SDU2);
+#if USE_GS_USB
+    gsUsbSuspendHookI(usbp);
+#endif
 
     chSysUnlockFromISR();
     return;
@@ -301,6 +514,7 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
 
     /* Connection event on wakeup.*/
     sduWakeupHookI(&SDU1);
+    sduWakeupHookI(&SDU2);
 
     chSysUnlockFromISR();
     return;
@@ -326,25 +540,44 @@ static void sof_handler(USBDriver *usbp) {
 
   osalSysLockFromISR();
   sduSOFHookI(&SDU1);
+  sduSOFHookI(&SDU2);
   osalSysUnlockFromISR();
 }
 
+/*
+ * Class requests go to the CDC ports, vendor requests to the gs_usb adapter.
+ */
+static bool requests_hook(USBDriver *usbp) {
+#if USE_GS_USB
+  if (gsUsbRequestsHook(usbp))
+    return true;
+#endif
+  return sduRequestsHook(usbp);
+}
+
 /*
  * USB driver configuration.
  */
 const USBConfig usbcfg = {
   usb_event,
   get_descriptor,
-  sduRequestsHook,
+  requests_hook,
   sof_handler
 };
 
 /*
- * Serial over USB driver configuration.
+ * Serial over USB driver configurations.
  */
 const SerialUSBConfig serusbcfg = {
   &USBD1,
   USBD2_DATA_REQUEST_EP,
   USBD2_DATA_AVAILABLE_EP,
   USBD2_INTERRUPT_REQUEST_EP
+};
+
+const SerialUSBConfig serusbcfg2 = {
+  &USBD1,
+  USBD3_DATA_REQUEST_EP,
+  USBD3_DATA_AVAILABLE_EP,
+  USBD3_INTERRUPT_REQUEST_EP
 };
\ No newline at end of file
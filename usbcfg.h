@@ -21,6 +21,13 @@
 #include "hal.h"
 #include "ch.h"
 
+/* Adds the gs_usb CAN adapter interface (gs_usb.h) in front of the CDC
+   ports and takes the gs_usb VID/PID so the Linux driver binds to it.
+   Set with -DUSE_GS_USB=TRUE in UDEFS. */
+#ifndef USE_GS_USB
+#define USE_GS_USB FALSE
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -28,7 +35,9 @@ extern "C" {
 /* These are defined in usbcfg.c */
 extern const USBConfig usbcfg;
 extern const SerialUSBConfig serusbcfg;
-extern SerialUSBDriver SDU1;
+extern const SerialUSBConfig serusbcfg2;
+extern SerialUSBDriver SDU1;   /* commands */
+extern SerialUSBDriver SDU2;   /* stream */
 
 /* Our helper */
 bool usbIsConfigured(void);
@@ -89,4 +89,16 @@ uint16_t getOutputValue(uint16_t raw, size_t idx, bool ntc)
             break;
         }
     }
-}
\ No newline at end of file
+}
+/* Folds the 96 bit factory UID into one word, stable across resets */
+uint32_t getUidHash()
+{
+    const uint32_t *uid = reinterpret_cast<const uint32_t *>(UID_BASE);
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        hash = (hash ^ uid[i]) * 16777619U;
+    }
+    return hash;
+}
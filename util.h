@@ -1,4 +1,5 @@
 #pragma once
 #include "ch.h"
 
-uint16_t getOutputValue(uint16_t raw, size_t idx, bool ntc = false);
\ No newline at end of file
+uint16_t getOutputValue(uint16_t raw, size_t idx, bool ntc = false);
+uint32_t getUidHash();